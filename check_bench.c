@@ -0,0 +1,116 @@
+/*
+ * Copyright 2022 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+/* This measures the overhead of error checking under each egl_check_policy.
+ * A loop of small GL calls runs with and without an egl_check after every
+ * call, like the tests do.
+ */
+
+#include "eglutil.h"
+
+struct check_bench {
+    int iterations;
+
+    struct egl egl;
+    struct egl_framebuffer *fb;
+};
+
+static void
+check_bench_init(struct check_bench *bench, enum egl_check_policy check)
+{
+    struct egl *egl = &bench->egl;
+
+    const struct egl_init_params params = {
+        .check = check,
+    };
+    egl_init(egl, &params);
+
+    bench->fb = egl_create_framebuffer(egl, 64, 64);
+
+    egl_check(egl, "init");
+}
+
+static void
+check_bench_cleanup(struct check_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+
+    egl_check(egl, "cleanup");
+
+    egl_destroy_framebuffer(egl, bench->fb);
+    egl_cleanup(egl);
+}
+
+static uint64_t
+check_bench_run(struct check_bench *bench, bool check)
+{
+    struct egl *egl = &bench->egl;
+    struct egl_gl *gl = &egl->gl;
+    const uint32_t texel = 0xffffffff;
+
+    const uint64_t begin = egl_get_time_ns();
+    for (int i = 0; i < bench->iterations; i++) {
+        gl->BindFramebuffer(GL_FRAMEBUFFER, bench->fb->fbo);
+        if (check)
+            egl_check(egl, "bind fb");
+
+        gl->Viewport(0, 0, 64, 64);
+        gl->ClearColor(1.0f, 0.0f, 0.0f, 1.0f);
+        gl->Clear(GL_COLOR_BUFFER_BIT);
+        if (check)
+            egl_check(egl, "clear");
+
+        gl->BindTexture(GL_TEXTURE_2D, bench->fb->tex);
+        gl->TexSubImage2D(GL_TEXTURE_2D, 0, i % 64, 0, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, &texel);
+        gl->BindTexture(GL_TEXTURE_2D, 0);
+        if (check)
+            egl_check(egl, "upload");
+
+        gl->BindFramebuffer(GL_FRAMEBUFFER, 0);
+        gl->Flush();
+        if (check)
+            egl_check(egl, "flush");
+    }
+    gl->Finish();
+    const uint64_t end = egl_get_time_ns();
+
+    egl_check(egl, "run");
+
+    return end - begin;
+}
+
+int
+main(int argc, const char **argv)
+{
+    struct check_bench bench = {
+        .iterations = 2000,
+    };
+
+    if (argc > 1)
+        bench.iterations = atoi(argv[1]);
+    if (bench.iterations <= 0)
+        egl_die("bad iteration count");
+
+    double base_ns = 0.0;
+    for (int i = EGL_CHECK_SYNC; i < EGL_CHECK_POLICY_COUNT; i++) {
+        check_bench_init(&bench, i);
+
+        /* warm up */
+        check_bench_run(&bench, true);
+
+        const double unchecked_ns = (double)check_bench_run(&bench, false) / bench.iterations;
+        const double checked_ns = (double)check_bench_run(&bench, true) / bench.iterations;
+        if (i == EGL_CHECK_SYNC)
+            base_ns = checked_ns;
+
+        egl_log("%s: %.2fus per iteration with egl_check, %.2fus without (%.2fx of sync)",
+                egl_check_policy_names[i], checked_ns / 1000.0, unchecked_ns / 1000.0,
+                checked_ns / base_ns);
+
+        check_bench_cleanup(&bench);
+    }
+
+    return 0;
+}
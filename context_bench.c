@@ -0,0 +1,123 @@
+/*
+ * Copyright 2022 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+/* This compares creating/destroying a shared context per task with leasing
+ * one from egl_context_pool.
+ */
+
+#include "eglutil.h"
+
+#define MAX_THREADS 64
+
+struct context_bench {
+    int thread_count;
+    int iterations;
+
+    struct egl egl;
+    struct egl_context_pool *pool;
+
+    bool pooled;
+    thrd_t thrds[MAX_THREADS];
+};
+
+static void
+context_bench_init(struct context_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+
+    egl_init(egl, NULL);
+    bench->pool = egl_create_context_pool(egl, bench->thread_count);
+
+    egl_check(egl, "init");
+}
+
+static void
+context_bench_cleanup(struct context_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+
+    egl_check(egl, "cleanup");
+
+    egl_destroy_context_pool(egl, bench->pool);
+    egl_cleanup(egl);
+}
+
+static int
+context_bench_thread(void *data)
+{
+    struct context_bench *bench = data;
+    struct egl *egl = &bench->egl;
+    struct egl_gl *gl = &egl->gl;
+
+    for (int i = 0; i < bench->iterations; i++) {
+        if (bench->pooled) {
+            EGLContext ctx = egl_lease_context(egl, bench->pool);
+            gl->Flush();
+            egl_return_context(egl, bench->pool, ctx);
+        } else {
+            EGLContext ctx = egl_create_context(egl, egl->ctx);
+            if (!egl->MakeCurrent(egl->dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx))
+                egl_die("failed to make context current");
+            gl->Flush();
+            egl->MakeCurrent(egl->dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+            egl->DestroyContext(egl->dpy, ctx);
+        }
+    }
+
+    egl->ReleaseThread();
+
+    return 0;
+}
+
+static double
+context_bench_run(struct context_bench *bench, bool pooled)
+{
+    bench->pooled = pooled;
+
+    const uint64_t begin = egl_get_time_ns();
+
+    for (int i = 0; i < bench->thread_count; i++) {
+        if (thrd_create(&bench->thrds[i], context_bench_thread, bench) != thrd_success)
+            egl_die("thrd_create failed");
+    }
+    for (int i = 0; i < bench->thread_count; i++) {
+        if (thrd_join(bench->thrds[i], NULL) != thrd_success)
+            egl_die("thrd_join failed");
+    }
+
+    const uint64_t end = egl_get_time_ns();
+
+    /* threads run their tasks concurrently */
+    return (double)(end - begin) / bench->iterations;
+}
+
+int
+main(int argc, const char **argv)
+{
+    struct context_bench bench = {
+        .thread_count = 4,
+        .iterations = 200,
+    };
+
+    if (argc > 1)
+        bench.thread_count = atoi(argv[1]);
+    if (argc > 2)
+        bench.iterations = atoi(argv[2]);
+    if (bench.thread_count <= 0 || bench.thread_count > MAX_THREADS || bench.iterations <= 0)
+        egl_die("bad thread or iteration count");
+
+    context_bench_init(&bench);
+
+    const double churn_ns = context_bench_run(&bench, false);
+    const double pooled_ns = context_bench_run(&bench, true);
+
+    egl_log("%d threads x %d tasks", bench.thread_count, bench.iterations);
+    egl_log("create/destroy: %.1fus per task", churn_ns / 1000.0);
+    egl_log("pooled lease: %.1fus per task (%.1fx)", pooled_ns / 1000.0, churn_ns / pooled_ns);
+
+    context_bench_cleanup(&bench);
+
+    return 0;
+}
@@ -0,0 +1,186 @@
+/*
+ * Copyright 2022 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+/* This spreads independent render jobs across all usable devices. */
+
+#include "eglutil.h"
+
+static const char devices_test_vs[] = {
+#include "devices_test.vert.inc"
+};
+
+static const char devices_test_fs[] = {
+#include "devices_test.frag.inc"
+};
+
+static const float devices_test_vertices[3][6] = {
+    {
+        -1.0f, /* x */
+        -1.0f, /* y */
+        1.0f,  /* r */
+        0.0f,  /* g */
+        0.0f,  /* b */
+        1.0f,  /* a */
+    },
+    {
+        1.0f,
+        -1.0f,
+        0.0f,
+        1.0f,
+        0.0f,
+        1.0f,
+    },
+    {
+        0.0f,
+        1.0f,
+        0.0f,
+        0.0f,
+        1.0f,
+        1.0f,
+    },
+};
+
+struct devices_test_device {
+    struct egl_program *prog;
+    struct egl_framebuffer *fb;
+    struct egl_device_stats stats;
+};
+
+struct devices_test {
+    uint32_t width;
+    uint32_t height;
+    int job_count;
+    int draw_count;
+
+    int egl_count;
+    struct egl *egls;
+
+    struct devices_test_device *devs;
+};
+
+static void
+devices_test_init(struct devices_test *test)
+{
+    test->egls = egl_init_all_devices(NULL, &test->egl_count);
+    if (!test->egl_count)
+        egl_die("no usable device");
+
+    test->devs = calloc(test->egl_count, sizeof(*test->devs));
+    if (!test->devs)
+        egl_die("failed to alloc devs");
+
+    for (int i = 0; i < test->egl_count; i++) {
+        struct egl *egl = &test->egls[i];
+        struct devices_test_device *dev = &test->devs[i];
+
+        if (!egl->MakeCurrent(egl->dpy, egl->surf, egl->surf, egl->ctx))
+            egl_die("failed to make context current");
+
+        dev->prog = egl_create_program(egl, devices_test_vs, devices_test_fs);
+        dev->fb = egl_create_framebuffer(egl, test->width, test->height);
+
+        egl_check(egl, "init");
+
+        egl->MakeCurrent(egl->dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    }
+}
+
+static void
+devices_test_cleanup(struct devices_test *test)
+{
+    for (int i = 0; i < test->egl_count; i++) {
+        struct egl *egl = &test->egls[i];
+        struct devices_test_device *dev = &test->devs[i];
+
+        if (!egl->MakeCurrent(egl->dpy, egl->surf, egl->surf, egl->ctx))
+            egl_die("failed to make context current");
+
+        egl_check(egl, "cleanup");
+
+        egl_destroy_framebuffer(egl, dev->fb);
+        egl_destroy_program(egl, dev->prog);
+    }
+
+    free(test->devs);
+    egl_cleanup_all_devices(test->egls, test->egl_count);
+}
+
+static void
+devices_test_job(struct egl *egl, int device, int job, void *data)
+{
+    struct devices_test *test = data;
+    struct devices_test_device *dev = &test->devs[device];
+    struct egl_gl *gl = &egl->gl;
+
+    gl->BindFramebuffer(GL_FRAMEBUFFER, dev->fb->fbo);
+    gl->Viewport(0, 0, test->width, test->height);
+
+    gl->Clear(GL_COLOR_BUFFER_BIT);
+
+    gl->UseProgram(dev->prog->prog);
+
+    gl->VertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(devices_test_vertices[0]),
+                            devices_test_vertices);
+    gl->EnableVertexAttribArray(0);
+
+    gl->VertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(devices_test_vertices[0]),
+                            &devices_test_vertices[0][2]);
+    gl->EnableVertexAttribArray(1);
+
+    gl->DrawArraysInstanced(GL_TRIANGLES, 0, 3, test->draw_count);
+
+    gl->BindFramebuffer(GL_FRAMEBUFFER, 0);
+    gl->Flush();
+}
+
+static void
+devices_test_draw(struct devices_test *test)
+{
+    struct egl_device_stats *stats = calloc(test->egl_count, sizeof(*stats));
+    if (!stats)
+        egl_die("failed to alloc stats");
+
+    const uint64_t begin = egl_get_time_ns();
+    egl_dispatch_device_jobs(test->egls, test->egl_count, test->job_count, devices_test_job,
+                             test, stats);
+    const uint64_t end = egl_get_time_ns();
+
+    for (int i = 0; i < test->egl_count; i++) {
+        struct egl *egl = &test->egls[i];
+        const char *node = egl->QueryDeviceStringEXT(egl->dev, EGL_DRM_RENDER_NODE_FILE_EXT);
+
+        egl_log("device %d (%s): %d jobs in %dms, %.1f jobs/s", i, node ? node : "software",
+                stats[i].job_count, (int)(stats[i].duration_ns / 1000000),
+                stats[i].job_count * 1e9 / stats[i].duration_ns);
+    }
+    egl_log("aggregate: %d jobs in %dms, %.1f jobs/s", test->job_count,
+            (int)((end - begin) / 1000000), test->job_count * 1e9 / (end - begin));
+
+    free(stats);
+}
+
+int
+main(int argc, const char **argv)
+{
+    struct devices_test test = {
+        .width = 480,
+        .height = 360,
+        .job_count = 200,
+        .draw_count = 100,
+    };
+
+    if (argc > 1)
+        test.job_count = atoi(argv[1]);
+    if (argc > 2)
+        test.draw_count = atoi(argv[2]);
+    if (test.job_count <= 0 || test.draw_count <= 0)
+        egl_die("bad job or draw count");
+
+    devices_test_init(&test);
+    devices_test_draw(&test);
+    devices_test_cleanup(&test);
+
+    return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright 2022 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+/* This compares eager and lazy entrypoint resolution of egl_init_library. */
+
+#include "eglutil.h"
+
+struct dispatch_bench {
+    int iterations;
+
+    /* keep the library resident to measure only the resolution */
+    void *handle;
+
+    struct egl egl;
+    __eglMustCastToProperFunctionPointerType eager_procs[EGL_LAZY_SLOT_COUNT];
+};
+
+static void
+dispatch_bench_init(struct dispatch_bench *bench)
+{
+    bench->handle = dlopen(LIBEGL_NAME, RTLD_LOCAL | RTLD_LAZY);
+    if (!bench->handle)
+        egl_die("failed to load %s: %s", LIBEGL_NAME, dlerror());
+}
+
+static void
+dispatch_bench_cleanup(struct dispatch_bench *bench)
+{
+    dlclose(bench->handle);
+}
+
+static uint64_t
+dispatch_bench_init_library(struct dispatch_bench *bench, bool lazy)
+{
+    struct egl *egl = &bench->egl;
+
+    memset(egl, 0, sizeof(*egl));
+    egl->params.lazy_dispatch = lazy;
+
+    const uint64_t begin = egl_get_time_ns();
+    egl_init_library(egl);
+    const uint64_t end = egl_get_time_ns();
+
+    return end - begin;
+}
+
+static uint64_t
+dispatch_bench_resolve(struct dispatch_bench *bench, int *count)
+{
+    /* resolve what the eager dispatch was able to resolve */
+    *count = 0;
+    const uint64_t begin = egl_get_time_ns();
+    for (int i = 0; i < EGL_LAZY_SLOT_COUNT; i++) {
+        if (bench->eager_procs[i]) {
+            egl_lazy_resolve(i);
+            (*count)++;
+        }
+    }
+    const uint64_t end = egl_get_time_ns();
+
+    return end - begin;
+}
+
+static void
+dispatch_bench_run(struct dispatch_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+
+    uint64_t eager_min = UINT64_MAX;
+    uint64_t eager_total = 0;
+    for (int i = 0; i < bench->iterations; i++) {
+        const uint64_t dur = dispatch_bench_init_library(bench, false);
+        if (eager_min > dur)
+            eager_min = dur;
+        eager_total += dur;
+
+        if (!i) {
+            for (int j = 0; j < EGL_LAZY_SLOT_COUNT; j++)
+                bench->eager_procs[j] =
+                    atomic_load_explicit(egl_lazy_get_slot(egl, j), memory_order_relaxed);
+        }
+
+        egl_cleanup_library(egl);
+    }
+
+    uint64_t lazy_min = UINT64_MAX;
+    uint64_t lazy_total = 0;
+    uint64_t resolve_total = 0;
+    int resolve_count = 0;
+    for (int i = 0; i < bench->iterations; i++) {
+        const uint64_t dur = dispatch_bench_init_library(bench, true);
+        if (lazy_min > dur)
+            lazy_min = dur;
+        lazy_total += dur;
+
+        resolve_total += dispatch_bench_resolve(bench, &resolve_count);
+
+        egl_cleanup_library(egl);
+    }
+
+    const double eager_avg = (double)eager_total / bench->iterations;
+    const double lazy_avg = (double)lazy_total / bench->iterations;
+    const double resolve_avg = (double)resolve_total / bench->iterations / resolve_count;
+
+    egl_log("eager init: min %.1fus, avg %.1fus", eager_min / 1000.0, eager_avg / 1000.0);
+    egl_log("lazy init: min %.1fus, avg %.1fus", lazy_min / 1000.0, lazy_avg / 1000.0);
+    egl_log("lazy first call: avg %.1fns over %d entrypoints", resolve_avg, resolve_count);
+    if (resolve_avg > 0.0) {
+        egl_log("lazy breaks even at %d distinct entrypoints",
+                (int)((eager_avg - lazy_avg) / resolve_avg));
+    }
+}
+
+int
+main(int argc, const char **argv)
+{
+    struct dispatch_bench bench = {
+        .iterations = 100,
+    };
+
+    if (argc > 1)
+        bench.iterations = atoi(argv[1]);
+    if (bench.iterations <= 0)
+        egl_die("bad iteration count");
+
+    dispatch_bench_init(&bench);
+    dispatch_bench_run(&bench);
+    dispatch_bench_cleanup(&bench);
+
+    return 0;
+}
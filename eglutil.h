@@ -18,16 +18,25 @@
 #include <ctype.h>
 #include <dlfcn.h>
 #include <drm_fourcc.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <threads.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef __ANDROID__
@@ -42,6 +51,8 @@ struct gbm_bo;
 #else /* __ANDROID__ */
 
 #include <gbm.h>
+#include <linux/dma-buf.h>
+#include <sys/ioctl.h>
 
 #define LIBEGL_NAME "libEGL.so.1"
 
@@ -52,31 +63,155 @@ typedef struct AHardwareBuffer AHardwareBuffer;
 #define PRINTFLIKE(f, a) __attribute__((format(printf, f, a)))
 #define NORETURN __attribute__((noreturn))
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define ALIGN(v, a) (((v) + (a)-1) & ~((a)-1))
 
+/* The entrypoints are atomic because lazy dispatch patches them while other
+ * threads might be calling them.  Calls load them implicitly.
+ */
 struct egl_gl {
-#define PFN_GL(proc, name) PFNGL##proc##PROC name;
+#define PFN_GL(proc, name) _Atomic(PFNGL##proc##PROC) name;
 #include "eglutil_entrypoints.inc"
 };
 
 struct egl_format {
     int drm_format;
     int drm_modifier_count;
+    /* in the driver order, which is its preference */
     const EGLuint64KHR *drm_modifiers;
     const EGLBoolean *external_only;
+    /* indices into drm_modifiers sorted by value, for egl_find_modifier */
+    const uint32_t *sorted_modifiers;
+
+    /* the modifier last chosen by egl_try_alloc_image_storage, for logging;
+     * images can be allocated on any thread
+     */
+    _Atomic uint64_t chosen_modifier;
+};
+
+/* identifies the dma-bufs of the planes and their layout */
+struct egl_import_key {
+    dev_t dev;
+    ino_t inos[4];
+
+    int width;
+    int height;
+    int drm_format;
+    uint64_t drm_modifier;
+
+    int plane_count;
+    uint32_t offsets[4];
+    uint32_t pitches[4];
+};
+
+struct egl_import {
+    uint32_t hash;
+    struct egl_import_key key;
+
+    EGLImage img;
+    int refcount;
+};
+
+enum egl_check_policy {
+    EGL_CHECK_DEFAULT,
+    /* query eglGetError and glGetError */
+    EGL_CHECK_SYNC,
+    /* collect GL errors of egl::ctx from a GL_KHR_debug callback, and query
+     * glGetError on other contexts
+     */
+    EGL_CHECK_DEFERRED,
+    /* use a EGL_KHR_create_context_no_error context and check only EGL errors */
+    EGL_CHECK_OFF,
+
+    EGL_CHECK_POLICY_COUNT,
+};
+
+static const char *const egl_check_policy_names[EGL_CHECK_POLICY_COUNT] = {
+    [EGL_CHECK_DEFAULT] = "default",
+    [EGL_CHECK_SYNC] = "sync",
+    [EGL_CHECK_DEFERRED] = "deferred",
+    [EGL_CHECK_OFF] = "off",
 };
 
+struct egl_image_info;
+
+/* This returns the rank of a modifier for an image.  Higher is better and
+ * negative means unusable.
+ */
+typedef int (*egl_modifier_policy_func)(const struct egl_image_info *info,
+                                        uint64_t drm_modifier,
+                                        bool external_only);
+
 struct egl_init_params {
     EGLint pbuffer_width;
     EGLint pbuffer_height;
+
+    /* use this device rather than the first hw rendernode device */
+    EGLDeviceEXT dev;
+
+    /* use the first software device rather than the first hw rendernode
+     * device; defaults to $EGLUTIL_SOFTWARE
+     */
+    bool software;
+
+    /* resolve entrypoints on their first calls rather than in egl_init */
+    bool lazy_dispatch;
+
+    /* cache device selection and formats in this file; defaults to
+     * $EGLUTIL_CACHE
+     */
+    const char *cache_path;
+
+    /* how egl_check finds errors; defaults to $EGLUTIL_CHECK */
+    enum egl_check_policy check;
+
+    /* ranks modifiers for gbm allocations; defaults to egl_rank_modifier */
+    egl_modifier_policy_func modifier_policy;
+};
+
+enum egl_extension {
+#define EXT(name) EGL_EXTENSION_##name,
+#include "eglutil_extensions.inc"
+
+    EGL_EXTENSION_COUNT,
+};
+
+#define EGL_EXTENSION_WORDS ((EGL_EXTENSION_COUNT + 63) / 64)
+
+/* O(1) query after egl_init; the name is unquoted */
+#define egl_has_ext(egl, name) egl_test_extension((egl)->exts, EGL_EXTENSION_##name)
+
+enum egl_init_phase {
+    EGL_INIT_PHASE_LIBRARY,
+    EGL_INIT_PHASE_DISPLAY,
+    EGL_INIT_PHASE_IMAGE_ALLOCATOR,
+    EGL_INIT_PHASE_CONFIG_AND_SURFACE,
+    EGL_INIT_PHASE_CONTEXT,
+    EGL_INIT_PHASE_FORMATS,
+    EGL_INIT_PHASE_GL,
+
+    EGL_INIT_PHASE_COUNT,
+};
+
+static const char *const egl_init_phase_names[EGL_INIT_PHASE_COUNT] = {
+    [EGL_INIT_PHASE_LIBRARY] = "library",
+    [EGL_INIT_PHASE_DISPLAY] = "display",
+    [EGL_INIT_PHASE_IMAGE_ALLOCATOR] = "image allocator",
+    [EGL_INIT_PHASE_CONFIG_AND_SURFACE] = "config and surface",
+    [EGL_INIT_PHASE_CONTEXT] = "context",
+    [EGL_INIT_PHASE_FORMATS] = "formats",
+    [EGL_INIT_PHASE_GL] = "gl",
 };
 
 struct egl {
     struct egl_init_params params;
 
+    /* CLOCK_MONOTONIC durations of the phases of egl_init */
+    uint64_t init_phase_ns[EGL_INIT_PHASE_COUNT];
+
     struct {
         void *handle;
 
-#define PFN_EGL(proc, name) PFNEGL##proc##PROC name;
+#define PFN_EGL(proc, name) _Atomic(PFNEGL##proc##PROC) name;
 #include "eglutil_entrypoints.inc"
         struct egl_gl gl;
 
@@ -89,25 +224,57 @@ struct egl {
     EGLint minor;
 
     const char *dpy_exts;
-    bool KHR_no_config_context;
-    bool EXT_image_dma_buf_import;
-    bool EXT_image_dma_buf_import_modifiers;
-    bool ANDROID_get_native_client_buffer;
-    bool ANDROID_image_native_buffer;
+
+    /* known client, display, device and GL extensions */
+    uint64_t exts[EGL_EXTENSION_WORDS];
 
     struct gbm_device *gbm;
     int gbm_fd;
     bool is_minigbm;
 
+    /* EGLImages imported from dma-bufs, shared by wraps of the same buffer */
+    struct {
+        mtx_t mutex;
+
+        int count;
+        int capacity;
+        struct egl_import *entries;
+
+        int hit_count;
+        int miss_count;
+    } imports;
+
     EGLConfig config;
     EGLSurface surf;
 
     EGLContext ctx;
 
+    /* sorted by drm_format; the modifiers, external_only and sorted_modifiers
+     * arrays live in the same allocation
+     */
     int format_count;
-    struct egl_format **formats;
+    struct egl_format *formats;
 
     const char *gl_exts;
+
+    /* GL errors of egl::ctx reported by the debug callback */
+    struct {
+        atomic_int count;
+        atomic_bool ready;
+        GLuint id;
+        char message[256];
+    } deferred;
+
+    struct {
+        void *data;
+        size_t size;
+
+        int dev_index;
+        bool dirty;
+
+        /* a per-device params.cache_path owned by the struct egl */
+        char *path;
+    } cache;
 };
 
 struct egl_framebuffer {
@@ -119,6 +286,121 @@ struct egl_program {
     GLuint vs;
     GLuint fs;
     GLuint prog;
+
+    /* set by egl_create_program_async */
+    struct egl_program_compiler *compiler;
+    atomic_bool ready;
+    char *glsl[2];
+    struct egl_program *next;
+};
+
+/* called on the thread that owns the struct egl of the device */
+typedef void (*egl_device_job_func)(struct egl *egl, int device, int job, void *data);
+
+struct egl_device_stats {
+    int job_count;
+    uint64_t duration_ns;
+};
+
+/* contexts sharing with egl::ctx that are leased to threads */
+struct egl_context_pool {
+    mtx_t mutex;
+    cnd_t cond;
+
+    int count;
+    EGLContext *ctxs;
+
+    int free_count;
+    EGLContext *free_ctxs;
+};
+
+/* compiles programs asynchronously, either in the driver with
+ * GL_KHR_parallel_shader_compile or on shared contexts
+ */
+struct egl_program_compiler {
+    struct egl *egl;
+    bool parallel_shader_compile;
+
+    struct egl_context_pool *ctx_pool;
+    mtx_t mutex;
+    cnd_t cond;
+    cnd_t done_cond;
+    bool stop;
+
+    struct egl_program *head;
+    struct egl_program **tail;
+
+    int thread_count;
+    thrd_t *thrds;
+};
+
+typedef void (*egl_job_func)(struct egl *egl, int worker, void *data);
+
+struct egl_job {
+    egl_job_func func;
+    void *data;
+
+    /* indices of earlier jobs in the batch whose GL commands must execute
+     * first; the worker waits for their fences on the GPU
+     */
+    int dep_count;
+    const int *deps;
+};
+
+/* a Chase-Lev deque of job indices; the owner pushes and pops at the bottom
+ * and thieves steal from the top
+ */
+struct egl_job_deque {
+    atomic_long top;
+    atomic_long bottom;
+
+    long mask;
+    atomic_int *jobs;
+};
+
+struct egl_job_worker {
+    struct egl_job_scheduler *sched;
+    int index;
+    thrd_t thrd;
+
+    struct egl_job_deque deque;
+
+    /* stats of the last batch */
+    int job_count;
+    int steal_count;
+};
+
+/* the per-batch state of a job */
+struct egl_job_state {
+    atomic_int pending_dep_count;
+    EGLSync fence;
+
+    int dependent_count;
+    int *dependents;
+};
+
+/* workers with their own contexts sharing with egl::ctx */
+struct egl_job_scheduler {
+    struct egl *egl;
+    struct egl_context_pool *ctx_pool;
+
+    mtx_t mutex;
+    cnd_t start_cond;
+    cnd_t done_cond;
+    int generation;
+    int done_count;
+    bool stop;
+
+    int worker_count;
+    struct egl_job_worker *workers;
+
+    /* the current batch */
+    const struct egl_job *jobs;
+    int job_count;
+    int job_capacity;
+    struct egl_job_state *states;
+    int *dependents;
+    atomic_int remaining_count;
 };
 
 struct egl_image_info {
@@ -130,6 +412,14 @@ struct egl_image_info {
     bool rendering;
     bool sampling;
     bool force_linear;
+
+    /* bypass the modifier policy and use drm_modifier */
+    bool force_modifier;
+    uint64_t drm_modifier;
+
+    /* 0 means 1; layered or mipmapped images are linear and single-plane */
+    int layer_count;
+    int level_count;
 };
 
 struct egl_image_storage {
@@ -137,6 +427,31 @@ struct egl_image_storage {
     AHardwareBuffer *ahb;
 #else
     struct gbm_bo *bo;
+    /* each plane is in its own dma-buf */
+    bool disjoint;
+
+    /* exported on the first wrap and kept until the storage is freed; one fd
+     * per plane when disjoint
+     */
+    int fd_count;
+    int fds[4];
+    EGLAttrib attrs[64];
+    struct egl_import_key import_key;
+    uint32_t import_hash;
+
+    /* the direct mappings of linear dma-bufs, indexed like fds; they are
+     * kept until the storage is freed or egl_release_image_mapping is called
+     */
+    struct {
+        void *ptrs[4];
+        size_t sizes[4];
+        bool failed;
+
+        /* the DMA_BUF_SYNC_* directions of the CPU access started by
+         * EGL_IMAGE_MAP_PERSISTENT, or 0
+         */
+        uint64_t persistent_sync;
+    } dma_buf_mapping;
 #endif
 };
 
@@ -151,26 +466,313 @@ struct egl_image_map {
     int pixel_strides[3];
 
     void *bo_xfer;
+    /* DMA_BUF_SYNC_* flags for a direct dma-buf map, or 0 */
+    uint64_t dma_buf_sync;
+    /* the map is part of a persistent CPU access and unmapping is a no-op */
+    bool persistent;
+};
+
+enum egl_image_map_flags {
+    EGL_IMAGE_MAP_READ = 1 << 0,
+    EGL_IMAGE_MAP_WRITE = 1 << 1,
+    /* start a CPU access on the first persistent map and keep it across
+     * maps and unmaps until egl_release_image_mapping is called, which must
+     * happen before the GPU accesses the image; only linear images mapped
+     * through their dma-bufs support this
+     */
+    EGL_IMAGE_MAP_PERSISTENT = 1 << 2,
+    /* use gbm_bo_map even when the dma-buf can be mapped directly */
+    EGL_IMAGE_MAP_NO_DMA_BUF = 1 << 3,
 };
 
 struct egl_image {
     struct egl_image_info info;
     struct egl_image_storage storage;
+    /* the EGLImage of layer 0 and level 0 */
     EGLImage img;
+
+    /* the EGLImages of other layers and levels, created on demand and indexed
+     * by layer * level_count + level
+     */
+    EGLImage *views;
+};
+
+/* idle images that can be reacquired with identical egl_image_info */
+struct egl_image_pool {
+    mtx_t mutex;
+
+    /* the least recently released first */
+    int max_idle_count;
+    int idle_count;
+    struct egl_image **idle_imgs;
+
+    int hit_count;
+    int miss_count;
+    int trim_count;
+};
+
+static inline uint64_t
+egl_get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000llu + ts.tv_nsec;
+}
+
+/* must be a power of two */
+#define EGL_LOG_RING_SIZE 256
+#define EGL_LOG_MESSAGE_SIZE 240
+
+struct egl_log_record {
+    uint64_t time_ns;
+    pid_t tid;
+    char message[EGL_LOG_MESSAGE_SIZE];
+};
+
+/* a single-producer single-consumer ring; the producer is the owning thread
+ * and the consumer is whoever holds egl_log_state::drain_mutex
+ */
+struct egl_log_ring {
+    struct egl_log_ring *next;
+    atomic_bool owned;
+
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_uint dropped;
+
+    struct egl_log_record records[EGL_LOG_RING_SIZE];
 };
 
+static struct {
+    once_flag once;
+    /* to disown the ring when its thread exits */
+    tss_t ring_key;
+
+    atomic_bool async;
+    /* drop egl_log records; egl_die still prints */
+    atomic_bool quiet;
+    /* rings are never freed; they are reused by new threads */
+    _Atomic(struct egl_log_ring *) rings;
+
+    mtx_t drain_mutex;
+    atomic_bool stop;
+    thrd_t drain_thrd;
+} egl_log_state = {
+    .once = ONCE_FLAG_INIT,
+};
+
+static thread_local struct egl_log_ring *egl_log_ring;
+
 static inline void
-egl_logv(const char *format, va_list ap)
+egl_log_printv(const char *format, va_list ap)
 {
     printf("EGL: ");
     vprintf(format, ap);
     printf("\n");
 }
 
+static inline void
+egl_log_disown_ring(void *ring)
+{
+    atomic_store(&((struct egl_log_ring *)ring)->owned, false);
+}
+
+static inline void
+egl_log_init_state(void)
+{
+    if (tss_create(&egl_log_state.ring_key, egl_log_disown_ring) != thrd_success ||
+        mtx_init(&egl_log_state.drain_mutex, mtx_plain) != thrd_success)
+        abort();
+}
+
+static inline struct egl_log_ring *
+egl_log_get_ring(void)
+{
+    if (egl_log_ring)
+        return egl_log_ring;
+
+    struct egl_log_ring *ring;
+    for (ring = atomic_load(&egl_log_state.rings); ring; ring = ring->next) {
+        bool owned = false;
+        if (atomic_compare_exchange_strong(&ring->owned, &owned, true))
+            break;
+    }
+
+    if (!ring) {
+        ring = calloc(1, sizeof(*ring));
+        if (!ring)
+            return NULL;
+        atomic_init(&ring->owned, true);
+
+        ring->next = atomic_load(&egl_log_state.rings);
+        while (!atomic_compare_exchange_weak(&egl_log_state.rings, &ring->next, ring))
+            ;
+    }
+
+    tss_set(egl_log_state.ring_key, ring);
+    egl_log_ring = ring;
+
+    return ring;
+}
+
+static inline void
+egl_log_pushv(const char *format, va_list ap)
+{
+    struct egl_log_ring *ring = egl_log_get_ring();
+    if (!ring)
+        return;
+
+    const unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    const unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == EGL_LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct egl_log_record *rec = &ring->records[head & (EGL_LOG_RING_SIZE - 1)];
+    rec->time_ns = egl_get_time_ns();
+    rec->tid = gettid();
+    vsnprintf(rec->message, sizeof(rec->message), format, ap);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/* print pending records of all rings in timestamp order */
+static inline int
+egl_log_drain_locked(void)
+{
+    int count = 0;
+
+    while (true) {
+        struct egl_log_ring *oldest = NULL;
+        const struct egl_log_record *oldest_rec = NULL;
+
+        for (struct egl_log_ring *ring = atomic_load(&egl_log_state.rings); ring;
+             ring = ring->next) {
+            const unsigned dropped = atomic_exchange_explicit(&ring->dropped, 0,
+                                                              memory_order_relaxed);
+            if (dropped)
+                printf("EGL: dropped %u log records\n", dropped);
+
+            const unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            const unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            if (tail == head)
+                continue;
+
+            const struct egl_log_record *rec = &ring->records[tail & (EGL_LOG_RING_SIZE - 1)];
+            if (!oldest_rec || oldest_rec->time_ns > rec->time_ns) {
+                oldest = ring;
+                oldest_rec = rec;
+            }
+        }
+
+        if (!oldest)
+            break;
+
+        printf("EGL: [%" PRIu64 ".%06" PRIu64 " %d] %s\n", oldest_rec->time_ns / 1000000000,
+               oldest_rec->time_ns / 1000 % 1000000, (int)oldest_rec->tid, oldest_rec->message);
+
+        atomic_fetch_add_explicit(&oldest->tail, 1, memory_order_release);
+        count++;
+    }
+
+    if (count)
+        fflush(stdout);
+
+    return count;
+}
+
+static inline void
+egl_log_flush(void)
+{
+    if (atomic_load(&egl_log_state.async)) {
+        mtx_lock(&egl_log_state.drain_mutex);
+        egl_log_drain_locked();
+        mtx_unlock(&egl_log_state.drain_mutex);
+    }
+
+    fflush(stdout);
+}
+
+static inline int
+egl_log_drain_thread(void *data)
+{
+    const struct timespec idle = {
+        .tv_nsec = 1000000,
+    };
+
+    while (!atomic_load(&egl_log_state.stop)) {
+        mtx_lock(&egl_log_state.drain_mutex);
+        const int count = egl_log_drain_locked();
+        mtx_unlock(&egl_log_state.drain_mutex);
+
+        if (!count)
+            thrd_sleep(&idle, NULL);
+    }
+
+    return 0;
+}
+
+/* This makes egl_log format into a per-thread ring and return.  A background
+ * thread prints the records with their monotonic timestamps and thread ids.
+ */
+static inline void
+egl_log_start_async(void)
+{
+    call_once(&egl_log_state.once, egl_log_init_state);
+
+    if (atomic_load(&egl_log_state.async))
+        return;
+
+    fflush(stdout);
+    atomic_store(&egl_log_state.stop, false);
+    if (thrd_create(&egl_log_state.drain_thrd, egl_log_drain_thread, NULL) != thrd_success)
+        abort();
+    atomic_store(&egl_log_state.async, true);
+}
+
+/* this should be called after other threads stop logging */
+static inline void
+egl_log_stop_async(void)
+{
+    if (!atomic_load(&egl_log_state.async))
+        return;
+
+    atomic_store(&egl_log_state.stop, true);
+    thrd_join(egl_log_state.drain_thrd, NULL);
+
+    egl_log_flush();
+    atomic_store(&egl_log_state.async, false);
+}
+
+/* This makes egl_log drop its records, for callers that own stdout. */
+static inline void
+egl_log_set_quiet(bool quiet)
+{
+    atomic_store(&egl_log_state.quiet, quiet);
+}
+
+static inline void
+egl_logv(const char *format, va_list ap)
+{
+    if (atomic_load_explicit(&egl_log_state.quiet, memory_order_relaxed))
+        return;
+
+    if (atomic_load_explicit(&egl_log_state.async, memory_order_relaxed))
+        egl_log_pushv(format, ap);
+    else
+        egl_log_printv(format, ap);
+}
+
 static inline void NORETURN
 egl_diev(const char *format, va_list ap)
 {
-    egl_logv(format, ap);
+    /* print pending records, and the fatal one synchronously in case the
+     * ring is full
+     */
+    egl_log_flush();
+    egl_log_printv(format, ap);
+    fflush(stdout);
     abort();
 }
 
@@ -197,15 +799,159 @@ egl_check(struct egl *egl, const char *where)
     if (egl_err != EGL_SUCCESS)
         egl_die("%s: egl has error 0x%04x", where, egl_err);
 
-    if (egl->ctx) {
+    if (!egl->ctx)
+        return;
+
+    switch (egl->params.check) {
+    case EGL_CHECK_DEFERRED: {
+        /* the callback is only installed on egl::ctx */
+        if (egl->GetCurrentContext() != egl->ctx) {
+            const GLenum gl_err = egl->gl.GetError();
+            if (gl_err != GL_NO_ERROR)
+                egl_die("%s: gl has error 0x%04x", where, gl_err);
+            break;
+        }
+
+        const int count = atomic_load_explicit(&egl->deferred.count, memory_order_relaxed);
+        if (count) {
+            /* the callback might be still copying the message */
+            const bool ready = atomic_load_explicit(&egl->deferred.ready, memory_order_acquire);
+            egl_die("%s: gl has %d error(s), first id %u: %s", where, count, egl->deferred.id,
+                    ready ? egl->deferred.message : "");
+        }
+        break;
+    }
+    case EGL_CHECK_OFF:
+        break;
+    default: {
         const GLenum gl_err = egl->gl.GetError();
         if (gl_err != GL_NO_ERROR)
             egl_die("%s: gl has error 0x%04x", where, gl_err);
+        break;
+    }
+    }
+}
+
+static void GL_APIENTRY
+egl_debug_callback(GLenum source,
+                   GLenum type,
+                   GLuint id,
+                   GLenum severity,
+                   GLsizei length,
+                   const GLchar *message,
+                   const void *user_param)
+{
+    struct egl *egl = (struct egl *)user_param;
+
+    if (type != GL_DEBUG_TYPE_ERROR)
+        return;
+
+    /* keep the first error only; this can be called from driver threads */
+    if (atomic_fetch_add_explicit(&egl->deferred.count, 1, memory_order_relaxed))
+        return;
+
+    egl->deferred.id = id;
+    snprintf(egl->deferred.message, sizeof(egl->deferred.message), "%.*s",
+             length < 0 ? (int)strlen(message) : (int)length, message);
+    atomic_store_explicit(&egl->deferred.ready, true, memory_order_release);
+}
+
+static const struct {
+    const char *name;
+    size_t len;
+} egl_extension_names[EGL_EXTENSION_COUNT] = {
+#define EXT(name) [EGL_EXTENSION_##name] = { #name, sizeof(#name) - 1 },
+#include "eglutil_extensions.inc"
+};
+
+/* an open-addressing hash table from names to extensions */
+static struct {
+    once_flag once;
+    uint16_t slots[256];
+} egl_extension_table = {
+    .once = ONCE_FLAG_INIT,
+};
+
+static_assert(EGL_EXTENSION_COUNT < ARRAY_SIZE(egl_extension_table.slots) / 2, "");
+
+static inline uint32_t
+egl_hash_extension(const char *name, size_t len)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    return hash;
+}
+
+static inline void
+egl_init_extension_table(void)
+{
+    const uint32_t mask = ARRAY_SIZE(egl_extension_table.slots) - 1;
+
+    for (int i = 0; i < EGL_EXTENSION_COUNT; i++) {
+        uint32_t slot = egl_hash_extension(egl_extension_names[i].name,
+                                           egl_extension_names[i].len) &
+                        mask;
+        while (egl_extension_table.slots[slot])
+            slot = (slot + 1) & mask;
+
+        /* 0 means empty */
+        egl_extension_table.slots[slot] = i + 1;
     }
 }
 
 static inline int
-egl_drm_format_to_cpp(int drm_format)
+egl_lookup_extension(const char *name, size_t len)
+{
+    const uint32_t mask = ARRAY_SIZE(egl_extension_table.slots) - 1;
+
+    for (uint32_t slot = egl_hash_extension(name, len) & mask; egl_extension_table.slots[slot];
+         slot = (slot + 1) & mask) {
+        const int ext = egl_extension_table.slots[slot] - 1;
+        if (egl_extension_names[ext].len == len &&
+            !memcmp(egl_extension_names[ext].name, name, len))
+            return ext;
+    }
+
+    return -1;
+}
+
+/* This tokenizes an extension string and sets the bits of known extensions.
+ * Unlike strstr, it never matches a prefix of a longer name.
+ */
+static inline void
+egl_parse_extensions(const char *exts, uint64_t *bits)
+{
+    call_once(&egl_extension_table.once, egl_init_extension_table);
+
+    while (*exts) {
+        while (*exts == ' ')
+            exts++;
+
+        const char *end = exts;
+        while (*end && *end != ' ')
+            end++;
+
+        if (end > exts) {
+            const int ext = egl_lookup_extension(exts, end - exts);
+            if (ext >= 0)
+                bits[ext / 64] |= 1ull << (ext % 64);
+        }
+
+        exts = end;
+    }
+}
+
+static inline bool
+egl_test_extension(const uint64_t *bits, enum egl_extension ext)
+{
+    return bits[ext / 64] & (1ull << (ext % 64));
+}
+
+/* This returns -1 for formats unknown to eglutil. */
+static inline int
+egl_query_drm_format_cpp(int drm_format)
 {
     switch (drm_format) {
     case DRM_FORMAT_ABGR16161616F:
@@ -229,10 +975,19 @@ egl_drm_format_to_cpp(int drm_format)
         /* cpp makes no sense to planar formats */
         return 0;
     default:
-        egl_die("unsupported drm format 0x%x", drm_format);
+        return -1;
     }
 }
 
+static inline int
+egl_drm_format_to_cpp(int drm_format)
+{
+    const int cpp = egl_query_drm_format_cpp(drm_format);
+    if (cpp < 0)
+        egl_die("unsupported drm format 0x%x", drm_format);
+    return cpp;
+}
+
 static inline int
 egl_drm_format_to_plane_count(int drm_format)
 {
@@ -265,6 +1020,111 @@ egl_drm_format_to_plane_format(int drm_format, int plane)
     }
 }
 
+static inline bool
+egl_drm_modifier_is_compressed(uint64_t drm_modifier)
+{
+    switch (fourcc_mod_get_vendor(drm_modifier)) {
+    case DRM_FORMAT_MOD_VENDOR_INTEL:
+        switch (drm_modifier) {
+        case I915_FORMAT_MOD_Y_TILED_CCS:
+        case I915_FORMAT_MOD_Yf_TILED_CCS:
+        case I915_FORMAT_MOD_Y_TILED_GEN12_RC_CCS:
+        case I915_FORMAT_MOD_Y_TILED_GEN12_MC_CCS:
+        case I915_FORMAT_MOD_Y_TILED_GEN12_RC_CCS_CC:
+        case I915_FORMAT_MOD_4_TILED_DG2_RC_CCS:
+        case I915_FORMAT_MOD_4_TILED_DG2_MC_CCS:
+        case I915_FORMAT_MOD_4_TILED_DG2_RC_CCS_CC:
+            return true;
+        default:
+            return false;
+        }
+    case DRM_FORMAT_MOD_VENDOR_AMD:
+        return AMD_FMT_MOD_GET(DCC, drm_modifier);
+    case DRM_FORMAT_MOD_VENDOR_ARM: {
+        const uint64_t type = (drm_modifier >> 52) & 0xf;
+        return type == DRM_FORMAT_MOD_ARM_TYPE_AFBC || type == DRM_FORMAT_MOD_ARM_TYPE_AFRC;
+    }
+    default:
+        return false;
+    }
+}
+
+/* This is the default modifier policy.  It prefers compressed over tiled over
+ * linear to save bandwidth, except that linear comes first and compression is
+ * avoided when mapping.  external_only modifiers cannot be rendered to and
+ * come last otherwise.
+ */
+static inline int
+egl_rank_modifier(const struct egl_image_info *info, uint64_t drm_modifier, bool external_only)
+{
+    int rank = 8;
+
+    if (external_only) {
+        if (info->rendering)
+            return -1;
+        rank -= 8;
+    }
+
+    if (drm_modifier == DRM_FORMAT_MOD_LINEAR) {
+        if (info->mapping)
+            rank += 16;
+    } else if (egl_drm_modifier_is_compressed(drm_modifier)) {
+        if (info->mapping)
+            return -1;
+        rank += 4;
+    } else {
+        rank += 2;
+    }
+
+    return rank;
+}
+
+static inline int
+egl_image_info_layer_count(const struct egl_image_info *info)
+{
+    return info->layer_count ? info->layer_count : 1;
+}
+
+static inline int
+egl_image_info_level_count(const struct egl_image_info *info)
+{
+    return info->level_count ? info->level_count : 1;
+}
+
+static inline int
+egl_image_level_size(int size, int level)
+{
+    return size >> level ? size >> level : 1;
+}
+
+/* Layers and levels are packed into one 2D allocation sharing the row pitch,
+ * level by level and then layer by layer.  This returns the first row of a
+ * layer and level, or the allocation height for level_count.
+ */
+static inline int
+egl_image_info_row(const struct egl_image_info *info, int layer, int level)
+{
+    const int layer_count = egl_image_info_layer_count(info);
+
+    int row = 0;
+    for (int i = 0; i < level; i++)
+        row += egl_image_level_size(info->height, i) * layer_count;
+
+    return row + egl_image_level_size(info->height, level) * layer;
+}
+
+static inline int
+egl_image_info_storage_height(const struct egl_image_info *info)
+{
+    return egl_image_info_row(info, 0, egl_image_info_level_count(info));
+}
+
+static inline bool
+egl_image_info_is_layered(const struct egl_image_info *info)
+{
+    return egl_image_info_layer_count(info) > 1 || egl_image_info_level_count(info) > 1;
+}
+
 #ifdef __ANDROID__
 
 static inline void
@@ -312,13 +1172,15 @@ egl_drm_format_to_ahb_format(int drm_format)
     }
 }
 
-static inline void
-egl_alloc_image_storage(struct egl *egl, struct egl_image *img)
+static inline bool
+egl_try_alloc_image_storage(struct egl *egl, struct egl_image *img)
 {
     const struct egl_image_info *info = &img->info;
 
     if (info->force_linear)
         egl_log("cannot force linear in AHB");
+    if (egl_image_info_is_layered(info))
+        egl_die("no layered AHB support");
 
     const enum AHardwareBuffer_Format format = egl_drm_format_to_ahb_format(info->drm_format);
     uint64_t usage = 0;
@@ -336,8 +1198,7 @@ egl_alloc_image_storage(struct egl *egl, struct egl_image *img)
         .format = format,
         .usage = usage,
     };
-    if (AHardwareBuffer_allocate(&desc, &img->storage.ahb))
-        egl_die("failed to create ahb");
+    return !AHardwareBuffer_allocate(&desc, &img->storage.ahb);
 }
 
 static inline void
@@ -347,12 +1208,41 @@ egl_free_image_storage(struct egl *egl, struct egl_image *img)
 }
 
 static inline void
-egl_map_image_storage(struct egl *egl, const struct egl_image *img, struct egl_image_map *map)
+egl_release_image_mapping(struct egl *egl, struct egl_image *img)
+{
+}
+
+/* This maps a sub-rectangle.  Planar formats must be mapped as a whole.  The
+ * locked pointers always point to the start of the buffer and are offset to
+ * the region here.  EGL_IMAGE_MAP_PERSISTENT is not supported.
+ */
+static inline void
+egl_map_image_region(struct egl *egl,
+                     struct egl_image *img,
+                     int x,
+                     int y,
+                     int width,
+                     int height,
+                     uint32_t flags,
+                     struct egl_image_map *map)
 {
     const struct egl_image_info *info = &img->info;
-    const uint64_t usage =
-        AHARDWAREBUFFER_USAGE_CPU_READ_RARELY | AHARDWAREBUFFER_USAGE_CPU_WRITE_RARELY;
-    const ARect rect = { .right = info->width, .bottom = info->height };
+
+    if (x < 0 || y < 0 || width <= 0 || height <= 0 || x + width > info->width ||
+        y + height > info->height)
+        egl_die("bad map region %dx%d+%d+%d", width, height, x, y);
+    if ((x || y || width != info->width || height != info->height) &&
+        egl_drm_format_to_plane_count(info->drm_format) > 1)
+        egl_die("planar formats must be mapped as a whole");
+    if (flags & EGL_IMAGE_MAP_PERSISTENT)
+        egl_die("persistent maps require linear images mapped through their dma-bufs");
+
+    uint64_t usage = 0;
+    if (flags & EGL_IMAGE_MAP_READ)
+        usage |= AHARDWAREBUFFER_USAGE_CPU_READ_OFTEN;
+    if (flags & EGL_IMAGE_MAP_WRITE)
+        usage |= AHARDWAREBUFFER_USAGE_CPU_WRITE_OFTEN;
+    const ARect rect = { .left = x, .top = y, .right = x + width, .bottom = y + height };
 
 #if __ANDROID_API__ >= 29
     AHardwareBuffer_Planes planes;
@@ -361,7 +1251,8 @@ egl_map_image_storage(struct egl *egl, const struct egl_image *img, struct egl_i
 
     map->plane_count = planes.planeCount;
     for (int i = 0; i < map->plane_count; i++) {
-        map->planes[i] = planes.planes[i].data;
+        map->planes[i] = (char *)planes.planes[i].data + planes.planes[i].rowStride * y +
+                         planes.planes[i].pixelStride * x;
         map->row_strides[i] = planes.planes[i].rowStride;
         map->pixel_strides[i] = planes.planes[i].pixelStride;
     }
@@ -378,7 +1269,7 @@ egl_map_image_storage(struct egl *egl, const struct egl_image *img, struct egl_i
 
     const int cpp = egl_drm_format_to_cpp(info->drm_format);
     map->plane_count = 1;
-    map->planes[0] = ptr;
+    map->planes[0] = (char *)ptr + desc.stride * cpp * y + cpp * x;
     map->row_strides[0] = desc.stride * cpp;
     map->pixel_strides[0] = cpp;
 #endif
@@ -386,6 +1277,27 @@ egl_map_image_storage(struct egl *egl, const struct egl_image *img, struct egl_i
     map->bo_xfer = NULL;
 }
 
+static inline void
+egl_map_image_storage(struct egl *egl, struct egl_image *img, struct egl_image_map *map)
+{
+    egl_map_image_region(egl, img, 0, 0, img->info.width, img->info.height,
+                         EGL_IMAGE_MAP_READ | EGL_IMAGE_MAP_WRITE, map);
+}
+
+static inline void
+egl_map_image_level(struct egl *egl,
+                    struct egl_image *img,
+                    int layer,
+                    int level,
+                    uint32_t flags,
+                    struct egl_image_map *map)
+{
+    if (layer || level)
+        egl_die("no layered AHB support");
+
+    egl_map_image_region(egl, img, 0, 0, img->info.width, img->info.height, flags, map);
+}
+
 static inline void
 egl_unmap_image_storage(struct egl *egl, struct egl_image *img, struct egl_image_map *map)
 {
@@ -395,7 +1307,8 @@ egl_unmap_image_storage(struct egl *egl, struct egl_image *img, struct egl_image
 static inline void
 egl_wrap_image_storage(struct egl *egl, struct egl_image *img)
 {
-    if (!egl->ANDROID_get_native_client_buffer || !egl->ANDROID_image_native_buffer)
+    if (!egl_has_ext(egl, EGL_ANDROID_get_native_client_buffer) ||
+        !egl_has_ext(egl, EGL_ANDROID_image_native_buffer))
         egl_die("no ahb import support");
 
     EGLClientBuffer buf = egl->GetNativeClientBufferANDROID(img->storage.ahb);
@@ -414,6 +1327,22 @@ egl_wrap_image_storage(struct egl *egl, struct egl_image *img)
         egl_die("failed to create img");
 }
 
+static inline void
+egl_unwrap_image_storage(struct egl *egl, struct egl_image *img)
+{
+    egl->DestroyImage(egl->dpy, img->img);
+    img->img = EGL_NO_IMAGE;
+}
+
+static inline EGLImage
+egl_get_image_view(struct egl *egl, struct egl_image *img, int layer, int level)
+{
+    if (layer || level)
+        egl_die("no layered AHB support");
+
+    return img->img;
+}
+
 #else /* __ANDROID__ */
 
 static inline void
@@ -422,6 +1351,9 @@ egl_init_image_allocator(struct egl *egl)
     if (egl->dev == EGL_NO_DEVICE_EXT)
         egl_die("gbm requires EGLDeviceEXT");
 
+    if (mtx_init(&egl->imports.mutex, mtx_plain) != thrd_success)
+        egl_die("failed to init mtx");
+
     egl->gbm_fd = -1;
 
     const char *node = egl->QueryDeviceStringEXT(egl->dev, EGL_DRM_RENDER_NODE_FILE_EXT);
@@ -446,127 +1378,227 @@ egl_init_image_allocator(struct egl *egl)
 static inline void
 egl_cleanup_image_allocator(struct egl *egl)
 {
+    if (egl->imports.count)
+        egl_log("leaked %d imported EGLImages", egl->imports.count);
+    for (int i = 0; i < egl->imports.count; i++)
+        egl->DestroyImage(egl->dpy, egl->imports.entries[i].img);
+    free(egl->imports.entries);
+    mtx_destroy(&egl->imports.mutex);
+
     if (egl->gbm) {
         gbm_device_destroy(egl->gbm);
         close(egl->gbm_fd);
     }
 }
 
+static inline int
+egl_find_format_index(const struct egl *egl, int drm_format)
+{
+    int lo = 0;
+    int hi = egl->format_count;
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        const uint32_t val = egl->formats[mid].drm_format;
+        if (val == (uint32_t)drm_format)
+            return mid;
+
+        if (val < (uint32_t)drm_format)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return -1;
+}
+
 static inline const struct egl_format *
 egl_find_format(const struct egl *egl, int drm_format)
 {
-    for (int i = 0; i < egl->format_count; i++) {
-        if (egl->formats[i]->drm_format == drm_format)
-            return egl->formats[i];
-    }
-    return NULL;
+    const int idx = egl_find_format_index(egl, drm_format);
+    return idx >= 0 ? &egl->formats[idx] : NULL;
 }
 
 static inline const uint64_t *
 egl_find_modifier(const struct egl_format *fmt, uint64_t drm_modifier)
 {
+    int lo = 0;
+    int hi = fmt->drm_modifier_count;
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        const uint64_t *mod = &fmt->drm_modifiers[fmt->sorted_modifiers[mid]];
+        const uint64_t val = *mod;
+        if (val == drm_modifier)
+            return mod;
+
+        if (val < drm_modifier)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+/* modifiers of a format in the order to try */
+static inline int
+egl_rank_modifiers(struct egl *egl,
+                   const struct egl_image_info *info,
+                   const struct egl_format *fmt,
+                   uint64_t *drm_modifiers)
+{
+    /* layers and levels are packed by rows, which only works for linear */
+    const bool layered = egl_image_info_is_layered(info);
+    if (layered && info->force_modifier && info->drm_modifier != DRM_FORMAT_MOD_LINEAR)
+        egl_die("layered images must be linear");
+
+    if (info->force_linear || info->force_modifier || layered) {
+        const uint64_t drm_modifier =
+            info->force_modifier ? info->drm_modifier : DRM_FORMAT_MOD_LINEAR;
+        if (!egl_find_modifier(fmt, drm_modifier))
+            egl_die("unsupported modifier 0x%016" PRIx64, drm_modifier);
+
+        drm_modifiers[0] = drm_modifier;
+        return 1;
+    }
+
+    int *ranks = malloc(sizeof(*ranks) * (fmt->drm_modifier_count + 1));
+    if (!ranks)
+        egl_die("failed to alloc ranks");
+
+    int count = 0;
     for (int i = 0; i < fmt->drm_modifier_count; i++) {
-        if (fmt->drm_modifiers[i] == drm_modifier) {
-            return &fmt->drm_modifiers[i];
+        const int rank =
+            egl->params.modifier_policy(info, fmt->drm_modifiers[i], fmt->external_only[i]);
+        if (rank < 0)
+            continue;
+
+        /* insertion sort; ties keep the driver order */
+        int j = count++;
+        for (; j > 0 && ranks[j - 1] < rank; j--) {
+            ranks[j] = ranks[j - 1];
+            drm_modifiers[j] = drm_modifiers[j - 1];
         }
+        ranks[j] = rank;
+        drm_modifiers[j] = fmt->drm_modifiers[i];
     }
-    return NULL;
+
+    free(ranks);
+
+    return count;
 }
 
-static inline void
-egl_alloc_image_storage(struct egl *egl, struct egl_image *img)
+static inline bool
+egl_is_bo_disjoint(struct gbm_bo *bo)
+{
+    const int plane_count = gbm_bo_get_plane_count(bo);
+    const union gbm_bo_handle handle = gbm_bo_get_handle_for_plane(bo, 0);
+    for (int i = 1; i < plane_count; i++) {
+        const union gbm_bo_handle h = gbm_bo_get_handle_for_plane(bo, i);
+        if (memcmp(&handle, &h, sizeof(h)))
+            return true;
+    }
+    return false;
+}
+
+static inline bool
+egl_try_alloc_image_storage(struct egl *egl, struct egl_image *img)
 {
     const struct egl_image_info *info = &img->info;
 
-    const struct egl_format *fmt = egl_find_format(egl, info->drm_format);
-    if (!fmt)
+    const int fmt_idx = egl_find_format_index(egl, info->drm_format);
+    if (fmt_idx < 0)
         egl_die("unsupported drm format 0x%08x", info->drm_format);
-
-    const uint64_t *drm_modifiers = fmt->drm_modifiers;
-    int drm_modifier_count = fmt->drm_modifier_count;
-    if (info->force_linear) {
-        drm_modifiers = egl_find_modifier(fmt, DRM_FORMAT_MOD_LINEAR);
-        if (!drm_modifiers)
-            egl_die("failed to find linear modifier");
-        drm_modifier_count = 1;
+    struct egl_format *fmt = &egl->formats[fmt_idx];
+
+    if (egl_image_info_is_layered(info)) {
+        if (egl_drm_format_to_plane_count(info->drm_format) > 1)
+            egl_die("layered images must be single-plane");
+
+        const int max_size = info->width > info->height ? info->width : info->height;
+        int max_level_count = 1;
+        while (max_size >> max_level_count)
+            max_level_count++;
+        if (egl_image_info_level_count(info) > max_level_count)
+            egl_die("too many levels");
     }
 
-    struct gbm_bo *bo = gbm_bo_create_with_modifiers(
-        egl->gbm, info->width, info->height, info->drm_format, drm_modifiers, drm_modifier_count);
+    uint64_t *drm_modifiers = malloc(sizeof(*drm_modifiers) * (fmt->drm_modifier_count + 1));
+    if (!drm_modifiers)
+        egl_die("failed to alloc modifiers");
+    const int drm_modifier_count = egl_rank_modifiers(egl, info, fmt, drm_modifiers);
+
+    /* gbm picks its favorite when given a list; try one at a time instead */
+    const int height = egl_image_info_storage_height(info);
+    struct gbm_bo *bo = NULL;
+    for (int i = 0; i < drm_modifier_count && !bo; i++) {
+        bo = gbm_bo_create_with_modifiers(egl->gbm, info->width, height, info->drm_format,
+                                          &drm_modifiers[i], 1);
+    }
+    free(drm_modifiers);
     if (!bo)
-        egl_die("failed to create gbm bo");
+        return false;
 
-    const int plane_count = gbm_bo_get_plane_count(bo);
-    if (plane_count > 1) {
-        /* make sure all planes have the same handle (for mapping) */
-        const union gbm_bo_handle handle = gbm_bo_get_handle_for_plane(bo, 0);
-        for (int i = 1; i < plane_count; i++) {
-            const union gbm_bo_handle h = gbm_bo_get_handle_for_plane(bo, i);
-            if (memcmp(&handle, &h, sizeof(h)))
-                egl_die("bo planes have different handles");
-        }
+    const uint64_t drm_modifier = gbm_bo_get_modifier(bo);
+    if (atomic_exchange(&fmt->chosen_modifier, drm_modifier) != drm_modifier) {
+        egl_log("using modifier 0x%016" PRIx64 " for format 0x%08x", drm_modifier,
+                info->drm_format);
     }
 
     img->storage.bo = bo;
+    img->storage.disjoint = egl_is_bo_disjoint(bo);
+
+    return true;
 }
 
 static inline void
-egl_free_image_storage(struct egl *egl, struct egl_image *img)
+egl_sync_image_dma_buf(struct egl_image *img, uint64_t flags)
 {
-    gbm_bo_destroy(img->storage.bo);
+    const struct dma_buf_sync sync = {
+        .flags = flags,
+    };
+    for (int i = 0; i < img->storage.fd_count; i++) {
+        while (ioctl(img->storage.fds[i], DMA_BUF_IOCTL_SYNC, &sync)) {
+            if (errno != EINTR && errno != EAGAIN)
+                egl_die("failed to sync dma-buf");
+        }
+    }
 }
 
+/* This ends the persistent CPU access, if any, and drops the direct dma-buf
+ * mappings.  The image must not be mapped otherwise.
+ */
 static inline void
-egl_map_image_storage(struct egl *egl, struct egl_image *img, struct egl_image_map *map)
+egl_release_image_mapping(struct egl *egl, struct egl_image *img)
 {
-    const struct egl_image_info *info = &img->info;
-    struct gbm_bo *bo = img->storage.bo;
-
-    uint32_t stride;
-    void *xfer = NULL;
-    void *ptr = gbm_bo_map(bo, 0, 0, info->width, info->height, GBM_BO_TRANSFER_READ_WRITE,
-                           &stride, &xfer);
-    if (!ptr)
-        egl_die("failed to map bo");
-
-    map->plane_count = egl_drm_format_to_plane_count(info->drm_format);
-    if (map->plane_count > 1) {
-        if (map->plane_count > gbm_bo_get_plane_count(bo))
-            egl_die("unexpected bo plane count");
-
-        for (int i = 0; i < map->plane_count; i++) {
-            map->planes[i] = ptr + gbm_bo_get_offset(bo, i);
-            map->row_strides[i] = gbm_bo_get_stride_for_plane(bo, i);
-            map->pixel_strides[i] =
-                egl_drm_format_to_cpp(egl_drm_format_to_plane_format(info->drm_format, i));
-        }
+    struct egl_image_storage *storage = &img->storage;
 
-        /* Y and UV */
-        if (map->plane_count == 2) {
-            map->plane_count = 3;
-            map->planes[2] = map->planes[1] + map->pixel_strides[1] / 2;
-            map->row_strides[2] = map->row_strides[1];
-            map->pixel_strides[2] = map->pixel_strides[1];
-        }
-    } else {
-        map->planes[0] = ptr;
-        map->row_strides[0] = stride;
-        map->pixel_strides[0] = egl_drm_format_to_cpp(info->drm_format);
+    if (storage->dma_buf_mapping.persistent_sync) {
+        egl_sync_image_dma_buf(img, DMA_BUF_SYNC_END | storage->dma_buf_mapping.persistent_sync);
+        storage->dma_buf_mapping.persistent_sync = 0;
     }
 
-    map->bo_xfer = xfer;
+    for (int i = 0; i < storage->fd_count; i++) {
+        if (storage->dma_buf_mapping.ptrs[i])
+            munmap(storage->dma_buf_mapping.ptrs[i], storage->dma_buf_mapping.sizes[i]);
+        storage->dma_buf_mapping.ptrs[i] = NULL;
+        storage->dma_buf_mapping.sizes[i] = 0;
+    }
 }
 
 static inline void
-egl_unmap_image_storage(struct egl *egl, struct egl_image *img, struct egl_image_map *map)
+egl_free_image_storage(struct egl *egl, struct egl_image *img)
 {
-    struct egl_image_storage *storage = &img->storage;
-
-    gbm_bo_unmap(storage->bo, map->bo_xfer);
+    egl_release_image_mapping(egl, img);
+    for (int i = 0; i < img->storage.fd_count; i++)
+        close(img->storage.fds[i]);
+    gbm_bo_destroy(img->storage.bo);
 }
 
-static inline int
-egl_image_to_dma_buf_attrs(const struct egl_image *img, EGLAttrib *attrs, int count)
+static inline void
+egl_image_to_dma_buf_attrs(const struct egl_image *img,
+                           const int *fds,
+                           int layer,
+                           int level,
+                           EGLAttrib *attrs,
+                           int count)
 {
     const struct egl_image_info *info = &img->info;
     struct gbm_bo *bo = img->storage.bo;
@@ -576,20 +1608,21 @@ egl_image_to_dma_buf_attrs(const struct egl_image *img, EGLAttrib *attrs, int co
     attrs[c++] = EGL_IMAGE_PRESERVED;
     attrs[c++] = EGL_TRUE;
     attrs[c++] = EGL_WIDTH;
-    attrs[c++] = info->width;
+    attrs[c++] = egl_image_level_size(info->width, level);
     attrs[c++] = EGL_HEIGHT;
-    attrs[c++] = info->height;
+    attrs[c++] = egl_image_level_size(info->height, level);
     attrs[c++] = EGL_LINUX_DRM_FOURCC_EXT;
     attrs[c++] = info->drm_format;
 
-    const int fd = gbm_bo_get_fd_for_plane(bo, 0);
-    if (fd < 0)
-        egl_die("failed to export gbm bo");
+    /* layered images have a single plane */
+    const int row = egl_image_info_row(info, layer, level);
     const uint64_t drm_modifier = gbm_bo_get_modifier(bo);
     const int plane_count = gbm_bo_get_plane_count(bo);
     for (int i = 0; i < plane_count; i++) {
-        const int offset = gbm_bo_get_offset(bo, i);
+        const int offset =
+            gbm_bo_get_offset(bo, i) + gbm_bo_get_stride_for_plane(bo, i) * row;
         const int stride = gbm_bo_get_stride_for_plane(bo, i);
+        const int fd = fds[img->storage.disjoint ? i : 0];
 
         static_assert(GBM_MAX_PLANES <= 4, "");
         if (i < 3) {
@@ -615,555 +1648,2526 @@ egl_image_to_dma_buf_attrs(const struct egl_image *img, EGLAttrib *attrs, int co
 
     attrs[c++] = EGL_NONE;
     assert(c <= count);
-
-    return fd;
 }
 
 static inline void
-egl_wrap_image_storage(struct egl *egl, struct egl_image *img)
+egl_get_import_key(const struct egl_image *img,
+                   const int *fds,
+                   int fd_count,
+                   int layer,
+                   int level,
+                   struct egl_import_key *key)
 {
-    if (!egl->EXT_image_dma_buf_import || !egl->EXT_image_dma_buf_import_modifiers)
-        egl_die("no dma-buf import support");
-
-    EGLAttrib img_attrs[64];
-    const int fd = egl_image_to_dma_buf_attrs(img, img_attrs, ARRAY_SIZE(img_attrs));
+    const struct egl_image_info *info = &img->info;
+    struct gbm_bo *bo = img->storage.bo;
 
-    img->img = egl->CreateImage(egl->dpy, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, img_attrs);
-    if (img->img == EGL_NO_IMAGE)
-        egl_die("failed to create img");
+    /* zero the padding for memcmp */
+    memset(key, 0, sizeof(*key));
+    for (int i = 0; i < fd_count; i++) {
+        struct stat st;
+        if (fstat(fds[i], &st))
+            egl_die("failed to stat dma-buf");
 
-    close(fd);
+        /* dma-bufs share the anonymous inode filesystem */
+        key->dev = st.st_dev;
+        key->inos[i] = st.st_ino;
+    }
+    key->width = egl_image_level_size(info->width, level);
+    key->height = egl_image_level_size(info->height, level);
+    key->drm_format = info->drm_format;
+    key->drm_modifier = gbm_bo_get_modifier(bo);
+    key->plane_count = gbm_bo_get_plane_count(bo);
+
+    const int row = egl_image_info_row(info, layer, level);
+    for (int i = 0; i < key->plane_count; i++) {
+        key->pitches[i] = gbm_bo_get_stride_for_plane(bo, i);
+        key->offsets[i] = gbm_bo_get_offset(bo, i) + key->pitches[i] * row;
+    }
 }
 
-#endif /* __ANDROID__ */
-
-static inline void
-egl_init_library_dispatch(struct egl *egl)
+static inline uint32_t
+egl_hash_import_key(const struct egl_import_key *key)
 {
-    /* we assume EGL 1.5, which includes EGL_EXT_client_extensions and
-     * EGL_KHR_client_get_all_proc_addresses
-     */
-#define PFN_EGL_EXT(proc, name) egl->name = (PFNEGL##proc##PROC)egl->GetProcAddress("egl" #name);
-#define PFN_GL_EXT(proc, name) egl->gl.name = (PFNGL##proc##PROC)egl->GetProcAddress("gl" #name);
-#define PFN_EGL(proc, name)                                                                      \
-    PFN_EGL_EXT(proc, name)                                                                      \
-    if (!egl->name)                                                                              \
-        egl_die("no egl" #name);
-#define PFN_GL(proc, name)                                                                       \
-    PFN_GL_EXT(proc, name)                                                                       \
-    if (!egl->gl.name)                                                                           \
-        egl_die("no gl" #name);
-#include "eglutil_entrypoints.inc"
+    /* FNV-1a */
+    const uint8_t *bytes = (const uint8_t *)key;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(*key); i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
 }
 
+/* This exports the bo, one fd per plane when disjoint, and computes the
+ * import attrs and key once.
+ */
 static inline void
-egl_init_library(struct egl *egl)
+egl_export_image_storage(struct egl *egl, struct egl_image *img)
 {
-    egl->handle = dlopen(LIBEGL_NAME, RTLD_LOCAL | RTLD_LAZY);
-    if (!egl->handle)
-        egl_die("failed to load %s: %s", LIBEGL_NAME, dlerror());
-
-    const char gipa_name[] = "eglGetProcAddress";
-    egl->GetProcAddress = dlsym(egl->handle, gipa_name);
-    if (!egl->GetProcAddress)
-        egl_die("failed to find %s: %s", gipa_name, dlerror());
-
-    egl_init_library_dispatch(egl);
+    struct egl_image_storage *storage = &img->storage;
+    if (storage->fd_count)
+        return;
 
-    egl->client_exts = egl->QueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
-    if (!egl->client_exts) {
-#ifdef __ANDROID__
-        egl_log("no client extension");
-        egl->client_exts = "";
-        egl->GetError();
-#else
-        egl_die("no client extension");
-#endif
+    const int fd_count = storage->disjoint ? gbm_bo_get_plane_count(storage->bo) : 1;
+    for (int i = 0; i < fd_count; i++) {
+        storage->fds[i] = gbm_bo_get_fd_for_plane(storage->bo, i);
+        if (storage->fds[i] < 0)
+            egl_die("failed to export gbm bo plane %d", i);
     }
+
+    egl_image_to_dma_buf_attrs(img, storage->fds, 0, 0, storage->attrs,
+                               ARRAY_SIZE(storage->attrs));
+    egl_get_import_key(img, storage->fds, fd_count, 0, 0, &storage->import_key);
+    storage->import_hash = egl_hash_import_key(&storage->import_key);
+    storage->fd_count = fd_count;
 }
 
-static inline void
-egl_init_display_extensions(struct egl *egl)
+/* This mmaps the dma-bufs of a linear image once.  It returns false when the
+ * exporter does not support mmap.
+ */
+static inline bool
+egl_map_image_dma_buf(struct egl *egl, struct egl_image *img)
 {
-    egl->dpy_exts = egl->QueryString(egl->dpy, EGL_EXTENSIONS);
+    struct egl_image_storage *storage = &img->storage;
+    if (storage->dma_buf_mapping.ptrs[0] || storage->dma_buf_mapping.failed)
+        return storage->dma_buf_mapping.ptrs[0];
+
+    egl_export_image_storage(egl, img);
+
+    for (int i = 0; i < storage->fd_count; i++) {
+        const off_t size = lseek(storage->fds[i], 0, SEEK_END);
+        void *ptr = MAP_FAILED;
+        if (size > 0)
+            ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, storage->fds[i], 0);
+        if (ptr == MAP_FAILED) {
+            egl_log("failed to mmap dma-buf; falling back to gbm_bo_map");
+            for (int j = 0; j < i; j++)
+                munmap(storage->dma_buf_mapping.ptrs[j], storage->dma_buf_mapping.sizes[j]);
+            memset(&storage->dma_buf_mapping, 0, sizeof(storage->dma_buf_mapping));
+            storage->dma_buf_mapping.failed = true;
+            return false;
+        }
 
-    egl->KHR_no_config_context = strstr(egl->dpy_exts, "EGL_KHR_no_config_context");
-    egl->EXT_image_dma_buf_import = strstr(egl->dpy_exts, "EGL_EXT_image_dma_buf_import");
-    egl->EXT_image_dma_buf_import_modifiers =
-        strstr(egl->dpy_exts, "EGL_EXT_image_dma_buf_import_modifiers");
-    egl->ANDROID_get_native_client_buffer =
-        strstr(egl->dpy_exts, "EGL_ANDROID_get_native_client_buffer");
-    egl->ANDROID_image_native_buffer = strstr(egl->dpy_exts, "EGL_ANDROID_image_native_buffer");
+        storage->dma_buf_mapping.ptrs[i] = ptr;
+        storage->dma_buf_mapping.sizes[i] = size;
+    }
+
+    return true;
 }
 
+/* This maps a sub-rectangle of the bo, whose rows cover all layers and
+ * levels.  The direction flags let gbm skip the readback of a staging copy for
+ * write-only maps, and skip the write back for read-only maps.  A map without
+ * a direction is a read-write map.  Linear dma-bufs stay mmapped across
+ * maps; without EGL_IMAGE_MAP_PERSISTENT, every map and unmap still starts
+ * and ends a CPU access.
+ */
 static inline void
-egl_init_display(struct egl *egl)
+egl_map_image_bo(struct egl *egl,
+                 struct egl_image *img,
+                 int x,
+                 int y,
+                 int width,
+                 int height,
+                 uint32_t flags,
+                 struct egl_image_map *map)
 {
-    const bool EXT_device_enumeration = strstr(egl->client_exts, "EGL_EXT_device_enumeration");
-    const bool EXT_device_query = strstr(egl->client_exts, "EGL_EXT_device_query");
-    const bool EXT_platform_device = strstr(egl->client_exts, "EGL_EXT_platform_device");
-    const bool KHR_platform_android = strstr(egl->client_exts, "EGL_KHR_platform_android");
-
-    if (EXT_device_enumeration && EXT_device_query && EXT_platform_device) {
-        egl_log("using platform device");
-
-        EGLDeviceEXT devs[16];
-        EGLint count;
-        if (!egl->QueryDevicesEXT(ARRAY_SIZE(devs), devs, &count))
-            egl_die("failed to query devices");
-
-        egl->dev = EGL_NO_DEVICE_EXT;
-        for (int i = 0; i < count; i++) {
-            const char *exts = egl->QueryDeviceStringEXT(devs[i], EGL_EXTENSIONS);
-
-            /* EGL_EXT_device_drm_render_node */
-            if (!strstr(exts, "EGL_EXT_device_drm_render_node"))
-                continue;
+    const struct egl_image_info *info = &img->info;
+    struct gbm_bo *bo = img->storage.bo;
 
-            const bool swrast = strstr(exts, "software");
-            if (!swrast) {
-                egl->dev = devs[i];
-                break;
+    /* DMA_BUF_SYNC_START without a direction fails with EINVAL */
+    if (!(flags & (EGL_IMAGE_MAP_READ | EGL_IMAGE_MAP_WRITE)))
+        flags |= EGL_IMAGE_MAP_READ | EGL_IMAGE_MAP_WRITE;
+
+    /* linear dma-bufs are mapped directly and bracketed by DMA_BUF_IOCTL_SYNC */
+    const bool dma_buf = !(flags & EGL_IMAGE_MAP_NO_DMA_BUF) &&
+                         gbm_bo_get_modifier(bo) == DRM_FORMAT_MOD_LINEAR &&
+                         egl_map_image_dma_buf(egl, img);
+    /* gbm_bo_map cannot map planes in different dma-bufs */
+    if (!dma_buf && img->storage.disjoint)
+        egl_die("disjoint planes can only be mapped as linear dma-bufs");
+    /* gbm_bo_map of a tiled bo is a staging copy that would go stale */
+    if (!dma_buf && (flags & EGL_IMAGE_MAP_PERSISTENT))
+        egl_die("persistent maps require linear images mapped through their dma-bufs");
+
+    /* the pointers to plane offsets, except that gbm_bo_map of a
+     * single-plane format points to the origin of the region
+     */
+    void *bases[4];
+    uint32_t stride;
+    void *xfer = NULL;
+    uint64_t dma_buf_sync = 0;
+    bool persistent = false;
+    if (dma_buf) {
+        if (flags & EGL_IMAGE_MAP_READ)
+            dma_buf_sync |= DMA_BUF_SYNC_READ;
+        if (flags & EGL_IMAGE_MAP_WRITE)
+            dma_buf_sync |= DMA_BUF_SYNC_WRITE;
+
+        uint64_t *persistent_sync = &img->storage.dma_buf_mapping.persistent_sync;
+        if (flags & EGL_IMAGE_MAP_PERSISTENT) {
+            /* restart the access when it lacks a direction */
+            if ((*persistent_sync & dma_buf_sync) != dma_buf_sync) {
+                if (*persistent_sync)
+                    egl_sync_image_dma_buf(img, DMA_BUF_SYNC_END | *persistent_sync);
+                *persistent_sync |= dma_buf_sync;
+                egl_sync_image_dma_buf(img, DMA_BUF_SYNC_START | *persistent_sync);
             }
+            dma_buf_sync = 0;
+            persistent = true;
+        } else {
+            egl_sync_image_dma_buf(img, DMA_BUF_SYNC_START | dma_buf_sync);
         }
-        if (egl->dev == EGL_NO_DEVICE_EXT)
-            egl_die("failed to find a hw rendernode device");
-
-        egl->dpy = egl->GetPlatformDisplay(EGL_PLATFORM_DEVICE_EXT, egl->dev, NULL);
-    } else if (KHR_platform_android) {
-        egl_log("using platform android");
 
-        egl->dev = EGL_NO_DEVICE_EXT;
-        egl->dpy = egl->GetPlatformDisplay(EGL_PLATFORM_ANDROID_KHR, EGL_DEFAULT_DISPLAY, NULL);
+        for (int i = 0; i < gbm_bo_get_plane_count(bo); i++) {
+            void *ptr = img->storage.dma_buf_mapping.ptrs[img->storage.disjoint ? i : 0];
+            bases[i] = ptr + gbm_bo_get_offset(bo, i);
+        }
+        stride = gbm_bo_get_stride_for_plane(bo, 0);
     } else {
-        egl_log("using EGL_DEFAULT_DISPLAY");
-        egl->dev = EGL_NO_DEVICE_EXT;
-        egl->dpy = egl->GetDisplay(EGL_DEFAULT_DISPLAY);
+        uint32_t gbm_flags = 0;
+        if (flags & EGL_IMAGE_MAP_READ)
+            gbm_flags |= GBM_BO_TRANSFER_READ;
+        if (flags & EGL_IMAGE_MAP_WRITE)
+            gbm_flags |= GBM_BO_TRANSFER_WRITE;
+
+        void *ptr = gbm_bo_map(bo, x, y, width, height, gbm_flags, &stride, &xfer);
+        if (!ptr)
+            egl_die("failed to map bo");
+        x = 0;
+        y = 0;
+
+        if (egl_drm_format_to_plane_count(info->drm_format) > 1) {
+            for (int i = 0; i < gbm_bo_get_plane_count(bo); i++)
+                bases[i] = ptr + gbm_bo_get_offset(bo, i);
+        } else {
+            bases[0] = ptr;
+        }
     }
 
-    if (egl->dpy == EGL_NO_DISPLAY)
-        egl_die("failed to get platform display");
-
-    if (!egl->Initialize(egl->dpy, &egl->major, &egl->minor))
-        egl_die("failed to initialize display");
-
-    egl_init_display_extensions(egl);
+    map->plane_count = egl_drm_format_to_plane_count(info->drm_format);
+    if (map->plane_count > 1) {
+        if (map->plane_count > gbm_bo_get_plane_count(bo))
+            egl_die("unexpected bo plane count");
 
-    if (egl->major != 1 || egl->minor < 5) {
-#ifdef __ANDROID__
-        egl_log("fixing up for EGL %d.%d", egl->major, egl->minor);
-        if (!strstr(egl->dpy_exts, "EGL_KHR_image_base"))
-            egl_die("no EGL_KHR_image_base");
-        egl->CreateImage = (PFNEGLCREATEIMAGEPROC)egl->GetProcAddress("eglCreateImageKHR");
-        egl->DestroyImage = (PFNEGLDESTROYIMAGEPROC)egl->GetProcAddress("eglDestroyImageKHR");
-#else
-        egl_die("EGL 1.5 is required");
-#endif
+        for (int i = 0; i < map->plane_count; i++) {
+            map->planes[i] = bases[i];
+            map->row_strides[i] = gbm_bo_get_stride_for_plane(bo, i);
+            map->pixel_strides[i] =
+                egl_drm_format_to_cpp(egl_drm_format_to_plane_format(info->drm_format, i));
+        }
+
+        /* Y and UV */
+        if (map->plane_count == 2) {
+            map->plane_count = 3;
+            map->planes[2] = map->planes[1] + map->pixel_strides[1] / 2;
+            map->row_strides[2] = map->row_strides[1];
+            map->pixel_strides[2] = map->pixel_strides[1];
+        }
+    } else {
+        const int cpp = egl_drm_format_to_cpp(info->drm_format);
+        map->planes[0] = bases[0] + stride * y + cpp * x;
+        map->row_strides[0] = stride;
+        map->pixel_strides[0] = cpp;
     }
+
+    map->bo_xfer = xfer;
+    map->dma_buf_sync = dma_buf_sync;
+    map->persistent = persistent;
 }
 
+/* This maps a sub-rectangle of layer 0 and level 0.  Planar formats must be
+ * mapped as a whole.
+ */
 static inline void
-egl_init_config_and_surface(struct egl *egl)
+egl_map_image_region(struct egl *egl,
+                     struct egl_image *img,
+                     int x,
+                     int y,
+                     int width,
+                     int height,
+                     uint32_t flags,
+                     struct egl_image_map *map)
 {
-    const bool with_pbuffer = egl->params.pbuffer_width && egl->params.pbuffer_height;
-    if (egl->KHR_no_config_context && !with_pbuffer) {
-        egl_log("using EGL_NO_CONFIG_KHR");
-        egl->config = EGL_NO_CONFIG_KHR;
+    const struct egl_image_info *info = &img->info;
+
+    if (x < 0 || y < 0 || width <= 0 || height <= 0 || x + width > info->width ||
+        y + height > info->height)
+        egl_die("bad map region %dx%d+%d+%d", width, height, x, y);
+    if ((x || y || width != info->width || height != info->height) &&
+        egl_drm_format_to_plane_count(info->drm_format) > 1)
+        egl_die("planar formats must be mapped as a whole");
+
+    egl_map_image_bo(egl, img, x, y, width, height, flags, map);
+}
+
+/* This maps a layer and level as a whole. */
+static inline void
+egl_map_image_level(struct egl *egl,
+                    struct egl_image *img,
+                    int layer,
+                    int level,
+                    uint32_t flags,
+                    struct egl_image_map *map)
+{
+    const struct egl_image_info *info = &img->info;
+
+    if (layer < 0 || layer >= egl_image_info_layer_count(info) || level < 0 ||
+        level >= egl_image_info_level_count(info))
+        egl_die("bad layer %d or level %d", layer, level);
+
+    egl_map_image_bo(egl, img, 0, egl_image_info_row(info, layer, level),
+                     egl_image_level_size(info->width, level),
+                     egl_image_level_size(info->height, level), flags, map);
+}
+
+static inline void
+egl_map_image_storage(struct egl *egl, struct egl_image *img, struct egl_image_map *map)
+{
+    egl_map_image_region(egl, img, 0, 0, img->info.width, img->info.height,
+                         EGL_IMAGE_MAP_READ | EGL_IMAGE_MAP_WRITE, map);
+}
+
+static inline void
+egl_unmap_image_storage(struct egl *egl, struct egl_image *img, struct egl_image_map *map)
+{
+    struct egl_image_storage *storage = &img->storage;
+
+    if (map->persistent)
         return;
+
+    if (map->dma_buf_sync)
+        egl_sync_image_dma_buf(img, DMA_BUF_SYNC_END | map->dma_buf_sync);
+    else
+        gbm_bo_unmap(storage->bo, map->bo_xfer);
+}
+
+/* This looks up the import cache and creates an EGLImage on misses.  Imports
+ * of the same dma-buf with the same layout share the EGLImage.
+ */
+static inline EGLImage
+egl_import_dma_buf(struct egl *egl,
+                   const struct egl_import_key *key,
+                   uint32_t hash,
+                   const EGLAttrib *attrs)
+{
+    mtx_lock(&egl->imports.mutex);
+
+    for (int i = 0; i < egl->imports.count; i++) {
+        struct egl_import *import = &egl->imports.entries[i];
+        if (import->hash == hash && !memcmp(&import->key, key, sizeof(*key))) {
+            import->refcount++;
+            egl->imports.hit_count++;
+            mtx_unlock(&egl->imports.mutex);
+
+            return import->img;
+        }
     }
 
-    const EGLint config_attrs[] = {
-        EGL_RED_SIZE,
-        8,
-        EGL_GREEN_SIZE,
-        8,
-        EGL_BLUE_SIZE,
-        8,
-        EGL_ALPHA_SIZE,
-        8,
-        EGL_RENDERABLE_TYPE,
-        EGL_OPENGL_ES3_BIT,
-        EGL_SURFACE_TYPE,
-        with_pbuffer ? EGL_PBUFFER_BIT : 0,
-        EGL_NONE,
-    };
+    EGLImage img = egl->CreateImage(egl->dpy, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attrs);
+    if (img == EGL_NO_IMAGE)
+        egl_die("failed to create img");
 
-    EGLint count;
-    if (!egl->ChooseConfig(egl->dpy, config_attrs, &egl->config, 1, &count) || !count)
-        egl_die("failed to choose a config");
+    if (egl->imports.count == egl->imports.capacity) {
+        const int capacity = egl->imports.capacity ? egl->imports.capacity * 2 : 8;
+        struct egl_import *entries = realloc(egl->imports.entries, sizeof(*entries) * capacity);
+        if (!entries)
+            egl_die("failed to grow import cache");
 
-    if (!with_pbuffer) {
-        egl_log("using EGL_NO_SURFACE");
-        egl->surf = EGL_NO_SURFACE;
-        return;
+        egl->imports.capacity = capacity;
+        egl->imports.entries = entries;
     }
 
-    const EGLint surf_attrs[] = {
-        EGL_WIDTH, egl->params.pbuffer_width, EGL_HEIGHT, egl->params.pbuffer_height, EGL_NONE,
+    egl->imports.entries[egl->imports.count++] = (struct egl_import){
+        .hash = hash,
+        .key = *key,
+        .img = img,
+        .refcount = 1,
     };
+    egl->imports.miss_count++;
 
-    egl->surf = egl->CreatePbufferSurface(egl->dpy, egl->config, surf_attrs);
-    if (egl->surf == EGL_NO_SURFACE)
-        egl_die("failed to create pbuffer surface");
+    mtx_unlock(&egl->imports.mutex);
+
+    return img;
 }
 
+/* the EGLImage is destroyed when the last import goes away */
 static inline void
-egl_init_context(struct egl *egl)
+egl_release_dma_buf(struct egl *egl, EGLImage img)
 {
-    if (egl->QueryAPI() != EGL_OPENGL_ES_API)
-        egl_die("current api is not GLES");
+    mtx_lock(&egl->imports.mutex);
 
-    const EGLint ctx_attrs[] = {
-        EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 2, EGL_NONE,
-    };
+    int idx = -1;
+    for (int i = 0; i < egl->imports.count; i++) {
+        if (egl->imports.entries[i].img == img) {
+            idx = i;
+            break;
+        }
+    }
+    if (idx < 0)
+        egl_die("unwrapping an unknown EGLImage");
 
-    EGLContext ctx = egl->CreateContext(egl->dpy, egl->config, EGL_NO_CONTEXT, ctx_attrs);
-    if (ctx == EGL_NO_CONTEXT)
-        egl_die("failed to create a context");
+    struct egl_import *import = &egl->imports.entries[idx];
+    if (!--import->refcount) {
+        egl->DestroyImage(egl->dpy, import->img);
+        *import = egl->imports.entries[--egl->imports.count];
+    }
 
-    if (!egl->MakeCurrent(egl->dpy, egl->surf, egl->surf, ctx))
-        egl_die("failed to make context current");
+    mtx_unlock(&egl->imports.mutex);
+}
 
-    egl->ctx = ctx;
+static inline void
+egl_wrap_image_storage(struct egl *egl, struct egl_image *img)
+{
+    if (!egl_has_ext(egl, EGL_EXT_image_dma_buf_import) ||
+        !egl_has_ext(egl, EGL_EXT_image_dma_buf_import_modifiers))
+        egl_die("no dma-buf import support");
+
+    egl_export_image_storage(egl, img);
+    img->img = egl_import_dma_buf(egl, &img->storage.import_key, img->storage.import_hash,
+                                  img->storage.attrs);
 }
 
 static inline void
-egl_init_formats(struct egl *egl)
+egl_unwrap_image_storage(struct egl *egl, struct egl_image *img)
 {
-    if (!egl->EXT_image_dma_buf_import_modifiers)
-        return;
+    if (img->views) {
+        const int view_count =
+            egl_image_info_layer_count(&img->info) * egl_image_info_level_count(&img->info);
+        for (int i = 1; i < view_count; i++) {
+            if (img->views[i] != EGL_NO_IMAGE)
+                egl_release_dma_buf(egl, img->views[i]);
+        }
+        free(img->views);
+        img->views = NULL;
+    }
 
-    EGLint fmt_count;
-    if (!egl->QueryDmaBufFormatsEXT(egl->dpy, 0, NULL, &fmt_count))
-        egl_die("failed to get dma-buf format count");
+    egl_release_dma_buf(egl, img->img);
+    img->img = EGL_NO_IMAGE;
+}
 
-    struct egl_format **fmts = malloc(sizeof(*fmts) * fmt_count);
-    EGLint *drm_fmts = malloc(sizeof(*drm_fmts) * fmt_count);
-    if (!fmts || !drm_fmts)
-        egl_die("failed to alloc fmts");
+/* This returns the EGLImage of a layer and level of a wrapped image.  It is
+ * valid until the image is unwrapped.
+ */
+static inline EGLImage
+egl_get_image_view(struct egl *egl, struct egl_image *img, int layer, int level)
+{
+    const struct egl_image_info *info = &img->info;
+    const int level_count = egl_image_info_level_count(info);
+    if (layer < 0 || layer >= egl_image_info_layer_count(info) || level < 0 ||
+        level >= level_count)
+        egl_die("bad layer %d or level %d", layer, level);
+
+    if (!layer && !level)
+        return img->img;
+
+    if (!img->views) {
+        /* EGL_NO_IMAGE is NULL */
+        img->views = calloc(egl_image_info_layer_count(info) * level_count, sizeof(*img->views));
+        if (!img->views)
+            egl_die("failed to alloc views");
+    }
 
-    if (!egl->QueryDmaBufFormatsEXT(egl->dpy, fmt_count, drm_fmts, &fmt_count))
-        egl_die("failed to get dma-buf formats");
+    EGLImage *view = &img->views[layer * level_count + level];
+    if (*view == EGL_NO_IMAGE) {
+        struct egl_image_storage *storage = &img->storage;
+        EGLAttrib attrs[64];
+        struct egl_import_key key;
+        egl_image_to_dma_buf_attrs(img, storage->fds, layer, level, attrs, ARRAY_SIZE(attrs));
+        egl_get_import_key(img, storage->fds, storage->fd_count, layer, level, &key);
 
-    for (int i = 0; i < fmt_count; i++) {
-        const EGLint drm_fmt = drm_fmts[i];
+        *view = egl_import_dma_buf(egl, &key, egl_hash_import_key(&key), attrs);
+    }
 
-        EGLint mod_count;
-        if (!egl->QueryDmaBufModifiersEXT(egl->dpy, drm_fmt, 0, NULL, NULL, &mod_count))
-            egl_die("failed to get dma-buf modifier count");
+    return *view;
+}
 
-        struct egl_format *fmt = malloc(sizeof(*fmt) + sizeof(fmt->drm_modifiers) * mod_count +
-                                        sizeof(fmt->external_only) * mod_count);
-        if (!fmt)
-            egl_die("failed to alloc fmt");
-        EGLuint64KHR *drm_modifiers = (EGLuint64KHR *)(fmt + 1);
-        EGLBoolean *external_only = (EGLBoolean *)(drm_modifiers + mod_count);
+/* This imports the dma-bufs described by data, such as a decoded video
+ * frame with one dma-buf per plane.  The size and the format come from info
+ * and the fds are not consumed.  data must have an fd per memory plane of
+ * the modifier, repeated when planes share a dma-buf.  Layers and levels are
+ * only supported on linear dma-bufs, whose rows cover all of them.
+ */
+static inline struct egl_image *
+egl_import_image(struct egl *egl,
+                 const struct egl_image_info *info,
+                 const struct gbm_import_fd_modifier_data *data)
+{
+    int plane_count =
+        gbm_device_get_format_modifier_plane_count(egl->gbm, info->drm_format, data->modifier);
+    if (plane_count <= 0)
+        plane_count = egl_drm_format_to_plane_count(info->drm_format);
+    if (data->num_fds != (uint32_t)plane_count)
+        egl_die("expected %d fds but got %u", plane_count, data->num_fds);
 
-        if (!egl->QueryDmaBufModifiersEXT(egl->dpy, drm_fmt, mod_count, drm_modifiers,
-                                          external_only, &mod_count))
-            egl_die("failed to get dma-buf modifiers");
+    if ((egl_image_info_layer_count(info) > 1 || egl_image_info_level_count(info) > 1) &&
+        data->modifier != DRM_FORMAT_MOD_LINEAR)
+        egl_die("layered imports must be linear");
 
-        fmt->drm_format = drm_fmt;
-        fmt->drm_modifier_count = mod_count;
-        fmt->drm_modifiers = drm_modifiers;
-        fmt->external_only = external_only;
-        fmts[i] = fmt;
+    struct egl_image *img = calloc(1, sizeof(*img));
+    if (!img)
+        egl_die("failed to alloc img");
+
+    struct gbm_import_fd_modifier_data import = *data;
+    import.width = info->width;
+    import.height = egl_image_info_storage_height(info);
+    import.format = info->drm_format;
+
+    struct gbm_bo *bo = gbm_bo_import(egl->gbm, GBM_BO_IMPORT_FD_MODIFIER, &import, 0);
+    if (!bo)
+        egl_die("failed to import dma-bufs");
+
+    img->info = *info;
+    img->info.force_modifier = true;
+    img->info.drm_modifier = data->modifier;
+    img->storage.bo = bo;
+    img->storage.disjoint = egl_is_bo_disjoint(bo);
+    egl_wrap_image_storage(egl, img);
+
+    return img;
+}
+
+#endif /* __ANDROID__ */
+
+enum egl_lazy_slot {
+#define PFN_GIPA(proc, name)
+#define PFN_EGL(proc, name) EGL_LAZY_egl##name,
+#define PFN_GL(proc, name) EGL_LAZY_gl##name,
+#include "eglutil_entrypoints.inc"
+    EGL_LAZY_SLOT_COUNT,
+};
+
+/* This is shared by all lazy instances of struct egl.  When a trampoline
+ * resolves its entrypoint, it patches the slots of all instances such that
+ * later calls go to the driver directly.
+ */
+static struct {
+    pthread_mutex_t mutex;
+    PFNEGLGETPROCADDRESSPROC GetProcAddress;
+    __eglMustCastToProperFunctionPointerType procs[EGL_LAZY_SLOT_COUNT];
+
+    struct egl **instances;
+    int instance_count;
+    int instance_capacity;
+} egl_lazy = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __eglMustCastToProperFunctionPointerType egl_lazy_resolve(enum egl_lazy_slot slot);
+
+/* generated by gen_dispatch.py */
+#include "eglutil_dispatch.inc"
+
+struct egl_lazy_entry {
+    const char *name;
+    size_t offset;
+    __eglMustCastToProperFunctionPointerType trampoline;
+};
+
+static const struct egl_lazy_entry egl_lazy_entries[EGL_LAZY_SLOT_COUNT] = {
+#define PFN_GIPA(proc, name)
+#define PFN_EGL(proc, name)                                                                      \
+    [EGL_LAZY_egl##name] = { "egl" #name, offsetof(struct egl, name),                            \
+                             (__eglMustCastToProperFunctionPointerType)egl_lazy_egl##name },
+#define PFN_GL(proc, name)                                                                       \
+    [EGL_LAZY_gl##name] = { "gl" #name, offsetof(struct egl, gl.name),                           \
+                            (__eglMustCastToProperFunctionPointerType)egl_lazy_gl##name },
+#include "eglutil_entrypoints.inc"
+};
+
+static inline _Atomic(__eglMustCastToProperFunctionPointerType) *
+egl_lazy_get_slot(struct egl *egl, enum egl_lazy_slot slot)
+{
+    return (_Atomic(__eglMustCastToProperFunctionPointerType) *)((char *)egl +
+                                                                 egl_lazy_entries[slot].offset);
+}
+
+static __eglMustCastToProperFunctionPointerType
+egl_lazy_resolve(enum egl_lazy_slot slot)
+{
+    pthread_mutex_lock(&egl_lazy.mutex);
+
+    __eglMustCastToProperFunctionPointerType proc = egl_lazy.procs[slot];
+    if (!proc) {
+        proc = egl_lazy.GetProcAddress(egl_lazy_entries[slot].name);
+        if (!proc)
+            egl_die("no %s", egl_lazy_entries[slot].name);
+        egl_lazy.procs[slot] = proc;
     }
 
-    free(drm_fmts);
+    /* other threads might be calling through the slots; they see either the
+     * trampoline or proc and both work
+     */
+    for (int i = 0; i < egl_lazy.instance_count; i++) {
+        atomic_store_explicit(egl_lazy_get_slot(egl_lazy.instances[i], slot), proc,
+                              memory_order_relaxed);
+    }
 
-    egl->format_count = fmt_count;
-    egl->formats = fmts;
+    pthread_mutex_unlock(&egl_lazy.mutex);
+
+    return proc;
 }
 
 static inline void
-egl_init_gl(struct egl *egl)
+egl_init_library_lazy_dispatch(struct egl *egl)
 {
-    egl->gl_exts = (const char *)egl->gl.GetString(GL_EXTENSIONS);
-    if (!egl->gl_exts)
-        egl_die("no GLES extensions");
+    pthread_mutex_lock(&egl_lazy.mutex);
+
+    if (egl_lazy.instance_count == egl_lazy.instance_capacity) {
+        const int capacity = egl_lazy.instance_capacity ? egl_lazy.instance_capacity * 2 : 4;
+        egl_lazy.instance_capacity = capacity;
+        egl_lazy.instances = realloc(egl_lazy.instances, sizeof(*egl_lazy.instances) * capacity);
+        if (!egl_lazy.instances)
+            egl_die("failed to grow lazy instances");
+    }
+    egl_lazy.instances[egl_lazy.instance_count++] = egl;
+    egl_lazy.GetProcAddress = egl->GetProcAddress;
+
+    for (int i = 0; i < EGL_LAZY_SLOT_COUNT; i++) {
+        const __eglMustCastToProperFunctionPointerType proc = egl_lazy.procs[i];
+        atomic_store_explicit(egl_lazy_get_slot(egl, i),
+                              proc ? proc : egl_lazy_entries[i].trampoline,
+                              memory_order_relaxed);
+    }
+
+    pthread_mutex_unlock(&egl_lazy.mutex);
 }
 
 static inline void
-egl_init(struct egl *egl, const struct egl_init_params *params)
+egl_cleanup_library_lazy_dispatch(struct egl *egl)
 {
-    memset(egl, 0, sizeof(*egl));
+    pthread_mutex_lock(&egl_lazy.mutex);
 
-    if (params)
-        egl->params = *params;
+    for (int i = 0; i < egl_lazy.instance_count; i++) {
+        if (egl_lazy.instances[i] == egl) {
+            egl_lazy.instances[i] = egl_lazy.instances[--egl_lazy.instance_count];
+            break;
+        }
+    }
 
-    egl_init_library(egl);
-    egl_check(egl, "init library");
+    /* the library might be unloaded */
+    if (!egl_lazy.instance_count) {
+        egl_lazy.GetProcAddress = NULL;
+        memset(egl_lazy.procs, 0, sizeof(egl_lazy.procs));
+
+        free(egl_lazy.instances);
+        egl_lazy.instances = NULL;
+        egl_lazy.instance_capacity = 0;
+    }
+
+    pthread_mutex_unlock(&egl_lazy.mutex);
+}
 
-    egl_init_display(egl);
-    egl_check(egl, "init display");
+static inline void
+egl_init_library_dispatch(struct egl *egl)
+{
+    /* we assume EGL 1.5, which includes EGL_EXT_client_extensions and
+     * EGL_KHR_client_get_all_proc_addresses
+     */
+#define PFN_EGL_EXT(proc, name) egl->name = (PFNEGL##proc##PROC)egl->GetProcAddress("egl" #name);
+#define PFN_GL_EXT(proc, name) egl->gl.name = (PFNGL##proc##PROC)egl->GetProcAddress("gl" #name);
+#define PFN_EGL(proc, name)                                                                      \
+    PFN_EGL_EXT(proc, name)                                                                      \
+    if (!egl->name)                                                                              \
+        egl_die("no egl" #name);
+#define PFN_GL(proc, name)                                                                       \
+    PFN_GL_EXT(proc, name)                                                                       \
+    if (!egl->gl.name)                                                                           \
+        egl_die("no gl" #name);
+#include "eglutil_entrypoints.inc"
+}
 
-    egl_init_image_allocator(egl);
-    egl_check(egl, "init image allocator");
+static inline void
+egl_init_library(struct egl *egl)
+{
+    egl->handle = dlopen(LIBEGL_NAME, RTLD_LOCAL | RTLD_LAZY);
+    if (!egl->handle)
+        egl_die("failed to load %s: %s", LIBEGL_NAME, dlerror());
 
-    egl_init_config_and_surface(egl);
-    egl_check(egl, "init config and surface");
+    const char gipa_name[] = "eglGetProcAddress";
+    egl->GetProcAddress = dlsym(egl->handle, gipa_name);
+    if (!egl->GetProcAddress)
+        egl_die("failed to find %s: %s", gipa_name, dlerror());
 
-    egl_init_context(egl);
-    egl_check(egl, "init context");
+    if (egl->params.lazy_dispatch)
+        egl_init_library_lazy_dispatch(egl);
+    else
+        egl_init_library_dispatch(egl);
 
-    egl_init_formats(egl);
-    egl_check(egl, "init formats");
+    egl->client_exts = egl->QueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    if (!egl->client_exts) {
+#ifdef __ANDROID__
+        egl_log("no client extension");
+        egl->client_exts = "";
+        egl->GetError();
+#else
+        egl_die("no client extension");
+#endif
+    }
 
-    egl_init_gl(egl);
-    egl_check(egl, "init gl");
+    egl_parse_extensions(egl->client_exts, egl->exts);
 }
 
 static inline void
-egl_cleanup(struct egl *egl)
+egl_cleanup_library(struct egl *egl)
 {
-    egl_check(egl, "cleanup");
+    if (egl->params.lazy_dispatch)
+        egl_cleanup_library_lazy_dispatch(egl);
 
-    if (egl->format_count) {
-        for (int i = 0; i < egl->format_count; i++)
-            free(egl->formats[i]);
-        free(egl->formats);
-    }
+    dlclose(egl->handle);
+}
 
-    egl->MakeCurrent(egl->dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
-    egl->DestroyContext(egl->dpy, egl->ctx);
-    if (egl->surf != EGL_NO_SURFACE)
-        egl->DestroySurface(egl->dpy, egl->surf);
+/* The cache file is versioned and is mapped as is.  The format table is
+ * copied out of the mapping, and the modifiers are stored in the driver order.
+ */
+#define EGL_CACHE_MAGIC 0x434c4745 /* "EGLC" */
+#define EGL_CACHE_VERSION 2
+
+struct egl_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+
+    int32_t dev_index;
+    char render_node[64];
+
+    /* the driver identity */
+    uint32_t key_offset;
+    uint32_t key_size;
+
+    uint32_t format_offset;
+    uint32_t format_count;
+    uint32_t modifier_offset;
+    uint32_t external_only_offset;
+    uint32_t modifier_count;
+};
 
-    egl_cleanup_image_allocator(egl);
+struct egl_cache_format {
+    int32_t drm_format;
+    uint32_t drm_modifier_index;
+    uint32_t drm_modifier_count;
+};
 
-    egl->Terminate(egl->dpy);
-    egl->ReleaseThread();
+/* This allocates the format table and the modifier arrays in one arena.
+ * egl_sort_formats initializes sorted_modifiers.
+ */
+static inline void
+egl_alloc_formats(struct egl *egl,
+                  int format_count,
+                  int modifier_count,
+                  EGLuint64KHR **drm_modifiers,
+                  EGLBoolean **external_only,
+                  uint32_t **sorted_modifiers)
+{
+    const size_t modifier_offset = ALIGN(sizeof(*egl->formats) * format_count, 8);
+    const size_t external_only_offset =
+        modifier_offset + sizeof(**drm_modifiers) * modifier_count;
+    const size_t sorted_offset =
+        external_only_offset + sizeof(**external_only) * modifier_count;
+    const size_t size = sorted_offset + sizeof(**sorted_modifiers) * modifier_count;
+
+    void *arena = malloc(size ? size : 1);
+    if (!arena)
+        egl_die("failed to alloc fmts");
 
-    dlclose(egl->handle);
+    egl->format_count = format_count;
+    egl->formats = arena;
+    *drm_modifiers = arena + modifier_offset;
+    *external_only = arena + external_only_offset;
+    *sorted_modifiers = arena + sorted_offset;
+}
+
+static inline int
+egl_compare_formats(const void *a, const void *b)
+{
+    const uint32_t x = ((const struct egl_format *)a)->drm_format;
+    const uint32_t y = ((const struct egl_format *)b)->drm_format;
+    return x < y ? -1 : x > y;
+}
+
+static inline void
+egl_sort_formats(struct egl *egl)
+{
+    qsort(egl->formats, egl->format_count, sizeof(*egl->formats), egl_compare_formats);
+
+    /* insertion sort of the indices; the modifiers keep the driver order */
+    for (int i = 0; i < egl->format_count; i++) {
+        const struct egl_format *fmt = &egl->formats[i];
+        const EGLuint64KHR *mods = fmt->drm_modifiers;
+        uint32_t *sorted = (uint32_t *)fmt->sorted_modifiers;
+
+        for (int j = 0; j < fmt->drm_modifier_count; j++) {
+            int k = j;
+            for (; k > 0 && mods[sorted[k - 1]] > mods[j]; k--)
+                sorted[k] = sorted[k - 1];
+            sorted[k] = j;
+        }
+    }
+}
+
+static inline bool
+egl_validate_cache(const void *data, size_t size)
+{
+    const struct egl_cache_header *hdr = data;
+    if (size < sizeof(*hdr) || hdr->magic != EGL_CACHE_MAGIC ||
+        hdr->version != EGL_CACHE_VERSION || hdr->size != size)
+        return false;
+
+    if (!memchr(hdr->render_node, '\0', sizeof(hdr->render_node)))
+        return false;
+
+    /* avoid 32-bit wraparounds */
+    if (!hdr->key_size || hdr->key_offset > size || hdr->key_size > size - hdr->key_offset)
+        return false;
+    const char *key = data + hdr->key_offset;
+    if (key[hdr->key_size - 1])
+        return false;
+
+    if (hdr->format_offset + sizeof(struct egl_cache_format) * hdr->format_count > size ||
+        hdr->modifier_offset % sizeof(uint64_t) ||
+        hdr->modifier_offset + sizeof(EGLuint64KHR) * hdr->modifier_count > size ||
+        hdr->external_only_offset % sizeof(EGLBoolean) ||
+        hdr->external_only_offset + sizeof(EGLBoolean) * hdr->modifier_count > size)
+        return false;
+
+    const struct egl_cache_format *fmts = data + hdr->format_offset;
+    for (uint32_t i = 0; i < hdr->format_count; i++) {
+        if (fmts[i].drm_modifier_index > hdr->modifier_count ||
+            fmts[i].drm_modifier_count > hdr->modifier_count - fmts[i].drm_modifier_index)
+            return false;
+    }
+
+    return true;
+}
+
+static inline void
+egl_init_cache(struct egl *egl)
+{
+    egl->cache.dev_index = -1;
+
+    if (!egl->params.cache_path)
+        return;
+
+    egl->cache.dirty = true;
+
+    const int fd = open(egl->params.cache_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size > 0)
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+        return;
+
+    if (!egl_validate_cache(data, st.st_size)) {
+        egl_log("ignoring invalid cache %s", egl->params.cache_path);
+        munmap(data, st.st_size);
+        return;
+    }
+
+    egl->cache.data = data;
+    egl->cache.size = st.st_size;
+    egl->cache.dirty = false;
+}
+
+static inline void
+egl_cleanup_cache(struct egl *egl)
+{
+    if (egl->cache.data)
+        munmap(egl->cache.data, egl->cache.size);
+    free(egl->cache.path);
+}
+
+static inline bool
+egl_is_device_software(struct egl *egl, EGLDeviceEXT dev)
+{
+    uint64_t exts[EGL_EXTENSION_WORDS] = { 0 };
+    egl_parse_extensions(egl->QueryDeviceStringEXT(dev, EGL_EXTENSIONS), exts);
+
+    return egl_test_extension(exts, EGL_EXTENSION_EGL_MESA_device_software);
+}
+
+static inline EGLDeviceEXT
+egl_find_cached_device(struct egl *egl, const EGLDeviceEXT *devs, int count)
+{
+    const struct egl_cache_header *hdr = egl->cache.data;
+    if (!hdr || hdr->dev_index < 0 || hdr->dev_index >= count)
+        return EGL_NO_DEVICE_EXT;
+
+    const EGLDeviceEXT dev = devs[hdr->dev_index];
+    if (egl_is_device_software(egl, dev) != egl->params.software)
+        return EGL_NO_DEVICE_EXT;
+
+    const char *node = egl->QueryDeviceStringEXT(dev, EGL_DRM_RENDER_NODE_FILE_EXT);
+    if (strcmp(node ? node : "", hdr->render_node))
+        return EGL_NO_DEVICE_EXT;
+
+    egl->cache.dev_index = hdr->dev_index;
+
+    return dev;
+}
+
+static inline void
+egl_get_cache_key(struct egl *egl, char *key, size_t size)
+{
+    const char *node = NULL;
+    if (egl->dev != EGL_NO_DEVICE_EXT)
+        node = egl->QueryDeviceStringEXT(egl->dev, EGL_DRM_RENDER_NODE_FILE_EXT);
+
+    snprintf(key, size, "%s\n%s\n%s\n%s\n%s\n%s", egl->QueryString(egl->dpy, EGL_VENDOR),
+             egl->QueryString(egl->dpy, EGL_VERSION), egl->gl.GetString(GL_VENDOR),
+             egl->gl.GetString(GL_RENDERER), egl->gl.GetString(GL_VERSION), node ? node : "");
+}
+
+static inline bool
+egl_init_formats_from_cache(struct egl *egl, const char *key)
+{
+    const struct egl_cache_header *hdr = egl->cache.data;
+    if (!hdr)
+        return false;
+
+    const void *data = egl->cache.data;
+    if (strcmp(data + hdr->key_offset, key)) {
+        egl_log("driver changed; rebuilding cache %s", egl->params.cache_path);
+        egl->cache.dirty = true;
+        return false;
+    }
+
+    const struct egl_cache_format *cache_fmts = data + hdr->format_offset;
+    const EGLuint64KHR *cache_modifiers = data + hdr->modifier_offset;
+    const EGLBoolean *cache_external_only = data + hdr->external_only_offset;
+
+    EGLuint64KHR *drm_modifiers;
+    EGLBoolean *external_only;
+    uint32_t *sorted_modifiers;
+    egl_alloc_formats(egl, hdr->format_count, hdr->modifier_count, &drm_modifiers,
+                      &external_only, &sorted_modifiers);
+
+    memcpy(drm_modifiers, cache_modifiers, sizeof(*drm_modifiers) * hdr->modifier_count);
+    memcpy(external_only, cache_external_only, sizeof(*external_only) * hdr->modifier_count);
+
+    for (uint32_t i = 0; i < hdr->format_count; i++) {
+        const struct egl_cache_format *cache_fmt = &cache_fmts[i];
+        struct egl_format *fmt = &egl->formats[i];
+
+        fmt->drm_format = cache_fmt->drm_format;
+        fmt->drm_modifier_count = cache_fmt->drm_modifier_count;
+        fmt->drm_modifiers = drm_modifiers + cache_fmt->drm_modifier_index;
+        fmt->external_only = external_only + cache_fmt->drm_modifier_index;
+        fmt->sorted_modifiers = sorted_modifiers + cache_fmt->drm_modifier_index;
+        atomic_init(&fmt->chosen_modifier, DRM_FORMAT_MOD_INVALID);
+    }
+
+    egl_sort_formats(egl);
+
+    return true;
+}
+
+static inline void
+egl_store_cache(struct egl *egl, const char *key)
+{
+    int modifier_count = 0;
+    for (int i = 0; i < egl->format_count; i++)
+        modifier_count += egl->formats[i].drm_modifier_count;
+
+    const size_t key_size = strlen(key) + 1;
+    const size_t key_offset = sizeof(struct egl_cache_header);
+    const size_t format_offset = ALIGN(key_offset + key_size, 8);
+    const size_t modifier_offset =
+        ALIGN(format_offset + sizeof(struct egl_cache_format) * egl->format_count, 8);
+    const size_t external_only_offset = modifier_offset + sizeof(EGLuint64KHR) * modifier_count;
+    const size_t size = external_only_offset + sizeof(EGLBoolean) * modifier_count;
+
+    void *data = calloc(1, size);
+    if (!data)
+        egl_die("failed to alloc cache");
+
+    struct egl_cache_header *hdr = data;
+    *hdr = (struct egl_cache_header){
+        .magic = EGL_CACHE_MAGIC,
+        .version = EGL_CACHE_VERSION,
+        .size = size,
+        .dev_index = egl->cache.dev_index,
+        .key_offset = key_offset,
+        .key_size = key_size,
+        .format_offset = format_offset,
+        .format_count = egl->format_count,
+        .modifier_offset = modifier_offset,
+        .external_only_offset = external_only_offset,
+        .modifier_count = modifier_count,
+    };
+
+    if (egl->dev != EGL_NO_DEVICE_EXT) {
+        const char *node = egl->QueryDeviceStringEXT(egl->dev, EGL_DRM_RENDER_NODE_FILE_EXT);
+        if (node)
+            snprintf(hdr->render_node, sizeof(hdr->render_node), "%s", node);
+    }
+
+    memcpy(data + key_offset, key, key_size);
+
+    struct egl_cache_format *cache_fmts = data + format_offset;
+    EGLuint64KHR *drm_modifiers = data + modifier_offset;
+    EGLBoolean *external_only = data + external_only_offset;
+    int modifier_index = 0;
+    for (int i = 0; i < egl->format_count; i++) {
+        const struct egl_format *fmt = &egl->formats[i];
+
+        cache_fmts[i] = (struct egl_cache_format){
+            .drm_format = fmt->drm_format,
+            .drm_modifier_index = modifier_index,
+            .drm_modifier_count = fmt->drm_modifier_count,
+        };
+        memcpy(drm_modifiers + modifier_index, fmt->drm_modifiers,
+               sizeof(*drm_modifiers) * fmt->drm_modifier_count);
+        memcpy(external_only + modifier_index, fmt->external_only,
+               sizeof(*external_only) * fmt->drm_modifier_count);
+        modifier_index += fmt->drm_modifier_count;
+    }
+
+    /* write to a temp file and rename to replace the cache atomically */
+    char tmp_path[PATH_MAX];
+    const int len =
+        snprintf(tmp_path, sizeof(tmp_path), "%s.%d", egl->params.cache_path, (int)getpid());
+
+    const int fd = len >= 0 && (size_t)len < sizeof(tmp_path)
+                       ? open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)
+                       : -1;
+    if (fd >= 0) {
+        const bool ok = write(fd, data, size) == (ssize_t)size;
+        close(fd);
+
+        if (ok && !rename(tmp_path, egl->params.cache_path))
+            egl->cache.dirty = false;
+        else
+            unlink(tmp_path);
+    }
+
+    if (egl->cache.dirty)
+        egl_log("failed to store cache %s", egl->params.cache_path);
+
+    free(data);
+}
+
+static inline void
+egl_init_display_extensions(struct egl *egl)
+{
+    egl->dpy_exts = egl->QueryString(egl->dpy, EGL_EXTENSIONS);
+    egl_parse_extensions(egl->dpy_exts, egl->exts);
+
+    if (egl->dev != EGL_NO_DEVICE_EXT)
+        egl_parse_extensions(egl->QueryDeviceStringEXT(egl->dev, EGL_EXTENSIONS), egl->exts);
+}
+
+static inline EGLDeviceEXT *
+egl_query_devices(struct egl *egl, int *count)
+{
+    EGLint dev_count;
+    if (!egl->QueryDevicesEXT(0, NULL, &dev_count))
+        egl_die("failed to query device count");
+
+    EGLDeviceEXT *devs = malloc(sizeof(*devs) * dev_count);
+    if (!devs)
+        egl_die("failed to alloc devs");
+
+    if (!egl->QueryDevicesEXT(dev_count, devs, &dev_count))
+        egl_die("failed to query devices");
+
+    *count = dev_count;
+    return devs;
+}
+
+/* software devices have no render node */
+static inline bool
+egl_is_device_usable(struct egl *egl, EGLDeviceEXT dev)
+{
+    if (egl_is_device_software(egl, dev))
+        return true;
+
+    uint64_t exts[EGL_EXTENSION_WORDS] = { 0 };
+    egl_parse_extensions(egl->QueryDeviceStringEXT(dev, EGL_EXTENSIONS), exts);
+
+    return egl_test_extension(exts, EGL_EXTENSION_EGL_EXT_device_drm_render_node) &&
+           egl->QueryDeviceStringEXT(dev, EGL_DRM_RENDER_NODE_FILE_EXT);
+}
+
+static inline void
+egl_init_display(struct egl *egl)
+{
+    egl_init_cache(egl);
+
+    if (egl_has_ext(egl, EGL_EXT_device_enumeration) && egl_has_ext(egl, EGL_EXT_device_query) &&
+        egl_has_ext(egl, EGL_EXT_platform_device)) {
+        egl_log("using platform device");
+
+        int count;
+        EGLDeviceEXT *devs = egl_query_devices(egl, &count);
+
+        if (egl->params.dev != EGL_NO_DEVICE_EXT) {
+            for (int i = 0; i < count; i++) {
+                if (devs[i] == egl->params.dev) {
+                    egl->dev = devs[i];
+                    egl->cache.dev_index = i;
+                    break;
+                }
+            }
+            if (egl->dev == EGL_NO_DEVICE_EXT)
+                egl_die("failed to find the specified device");
+        } else {
+            egl->dev = egl_find_cached_device(egl, devs, count);
+        }
+
+        for (int i = 0; i < count && egl->dev == EGL_NO_DEVICE_EXT; i++) {
+            if (!egl_is_device_usable(egl, devs[i]) ||
+                egl_is_device_software(egl, devs[i]) != egl->params.software)
+                continue;
+
+            egl->dev = devs[i];
+            egl->cache.dev_index = i;
+            egl->cache.dirty = true;
+        }
+        if (egl->dev == EGL_NO_DEVICE_EXT)
+            egl_die("failed to find a %s device",
+                    egl->params.software ? "software" : "hw rendernode");
+
+        free(devs);
+
+        egl->dpy = egl->GetPlatformDisplay(EGL_PLATFORM_DEVICE_EXT, egl->dev, NULL);
+    } else if (egl_has_ext(egl, EGL_KHR_platform_android)) {
+        egl_log("using platform android");
+
+        egl->dev = EGL_NO_DEVICE_EXT;
+        egl->dpy = egl->GetPlatformDisplay(EGL_PLATFORM_ANDROID_KHR, EGL_DEFAULT_DISPLAY, NULL);
+    } else {
+        egl_log("using EGL_DEFAULT_DISPLAY");
+        egl->dev = EGL_NO_DEVICE_EXT;
+        egl->dpy = egl->GetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+
+    if (egl->dpy == EGL_NO_DISPLAY)
+        egl_die("failed to get platform display");
+
+    if (!egl->Initialize(egl->dpy, &egl->major, &egl->minor))
+        egl_die("failed to initialize display");
+
+    egl_init_display_extensions(egl);
+
+    if (egl->major != 1 || egl->minor < 5) {
+#ifdef __ANDROID__
+        egl_log("fixing up for EGL %d.%d", egl->major, egl->minor);
+        if (!egl_has_ext(egl, EGL_KHR_image_base))
+            egl_die("no EGL_KHR_image_base");
+        egl->CreateImage = (PFNEGLCREATEIMAGEPROC)egl->GetProcAddress("eglCreateImageKHR");
+        egl->DestroyImage = (PFNEGLDESTROYIMAGEPROC)egl->GetProcAddress("eglDestroyImageKHR");
+#else
+        egl_die("EGL 1.5 is required");
+#endif
+    }
+}
+
+static inline void
+egl_init_config_and_surface(struct egl *egl)
+{
+    const bool with_pbuffer = egl->params.pbuffer_width && egl->params.pbuffer_height;
+    if (egl_has_ext(egl, EGL_KHR_no_config_context) && !with_pbuffer) {
+        egl_log("using EGL_NO_CONFIG_KHR");
+        egl->config = EGL_NO_CONFIG_KHR;
+        return;
+    }
+
+    const EGLint config_attrs[] = {
+        EGL_RED_SIZE,
+        8,
+        EGL_GREEN_SIZE,
+        8,
+        EGL_BLUE_SIZE,
+        8,
+        EGL_ALPHA_SIZE,
+        8,
+        EGL_RENDERABLE_TYPE,
+        EGL_OPENGL_ES3_BIT,
+        EGL_SURFACE_TYPE,
+        with_pbuffer ? EGL_PBUFFER_BIT : 0,
+        EGL_NONE,
+    };
+
+    EGLint count;
+    if (!egl->ChooseConfig(egl->dpy, config_attrs, &egl->config, 1, &count) || !count)
+        egl_die("failed to choose a config");
+
+    if (!with_pbuffer) {
+        egl_log("using EGL_NO_SURFACE");
+        egl->surf = EGL_NO_SURFACE;
+        return;
+    }
+
+    const EGLint surf_attrs[] = {
+        EGL_WIDTH, egl->params.pbuffer_width, EGL_HEIGHT, egl->params.pbuffer_height, EGL_NONE,
+    };
+
+    egl->surf = egl->CreatePbufferSurface(egl->dpy, egl->config, surf_attrs);
+    if (egl->surf == EGL_NO_SURFACE)
+        egl_die("failed to create pbuffer surface");
+}
+
+static inline EGLContext
+egl_create_context(struct egl *egl, EGLContext share)
+{
+    /* contexts sharing objects must agree on the no-error mode */
+    const bool no_error = egl->params.check == EGL_CHECK_OFF &&
+                          egl_has_ext(egl, EGL_KHR_create_context_no_error);
+    /* GL_KHR_debug only guarantees messages from debug contexts */
+    const bool debug = egl->params.check == EGL_CHECK_DEFERRED;
+
+    EGLint ctx_attrs[7] = {
+        EGL_CONTEXT_MAJOR_VERSION,
+        3,
+        EGL_CONTEXT_MINOR_VERSION,
+        2,
+    };
+    int attr_count = 4;
+    /* the attribute is unknown without EGL_KHR_create_context_no_error */
+    if (no_error) {
+        ctx_attrs[attr_count++] = EGL_CONTEXT_OPENGL_NO_ERROR_KHR;
+        ctx_attrs[attr_count++] = EGL_TRUE;
+    } else if (debug) {
+        ctx_attrs[attr_count++] = EGL_CONTEXT_OPENGL_DEBUG;
+        ctx_attrs[attr_count++] = EGL_TRUE;
+    }
+    ctx_attrs[attr_count] = EGL_NONE;
+
+    EGLContext ctx = egl->CreateContext(egl->dpy, egl->config, share, ctx_attrs);
+    if (ctx == EGL_NO_CONTEXT)
+        egl_die("failed to create a context");
+
+    return ctx;
+}
+
+static inline void
+egl_init_context(struct egl *egl)
+{
+    if (egl->QueryAPI() != EGL_OPENGL_ES_API)
+        egl_die("current api is not GLES");
+
+    if (egl->params.check == EGL_CHECK_OFF &&
+        !egl_has_ext(egl, EGL_KHR_create_context_no_error))
+        egl_log("no EGL_KHR_create_context_no_error; GL errors are ignored but still validated");
+
+    EGLContext ctx = egl_create_context(egl, EGL_NO_CONTEXT);
+
+    if (!egl->MakeCurrent(egl->dpy, egl->surf, egl->surf, ctx))
+        egl_die("failed to make context current");
+
+    egl->ctx = ctx;
+}
+
+static inline void
+egl_init_formats_from_driver(struct egl *egl)
+{
+    EGLint fmt_count;
+    if (!egl->QueryDmaBufFormatsEXT(egl->dpy, 0, NULL, &fmt_count))
+        egl_die("failed to get dma-buf format count");
+
+    EGLint *drm_fmts = malloc(sizeof(*drm_fmts) * fmt_count * 2);
+    if (!drm_fmts)
+        egl_die("failed to alloc fmts");
+    EGLint *mod_counts = drm_fmts + fmt_count;
+
+    if (!egl->QueryDmaBufFormatsEXT(egl->dpy, fmt_count, drm_fmts, &fmt_count))
+        egl_die("failed to get dma-buf formats");
+
+    int total_mod_count = 0;
+    for (int i = 0; i < fmt_count; i++) {
+        if (!egl->QueryDmaBufModifiersEXT(egl->dpy, drm_fmts[i], 0, NULL, NULL, &mod_counts[i]))
+            egl_die("failed to get dma-buf modifier count");
+        total_mod_count += mod_counts[i];
+    }
+
+    EGLuint64KHR *drm_modifiers;
+    EGLBoolean *external_only;
+    uint32_t *sorted_modifiers;
+    egl_alloc_formats(egl, fmt_count, total_mod_count, &drm_modifiers, &external_only,
+                      &sorted_modifiers);
+
+    for (int i = 0; i < fmt_count; i++) {
+        struct egl_format *fmt = &egl->formats[i];
+
+        EGLint mod_count = mod_counts[i];
+        if (!egl->QueryDmaBufModifiersEXT(egl->dpy, drm_fmts[i], mod_count, drm_modifiers,
+                                          external_only, &mod_count))
+            egl_die("failed to get dma-buf modifiers");
+
+        fmt->drm_format = drm_fmts[i];
+        fmt->drm_modifier_count = mod_count;
+        fmt->drm_modifiers = drm_modifiers;
+        fmt->external_only = external_only;
+        fmt->sorted_modifiers = sorted_modifiers;
+        atomic_init(&fmt->chosen_modifier, DRM_FORMAT_MOD_INVALID);
+
+        drm_modifiers += mod_count;
+        external_only += mod_count;
+        sorted_modifiers += mod_count;
+    }
+
+    free(drm_fmts);
+
+    egl_sort_formats(egl);
+}
+
+static inline void
+egl_init_formats(struct egl *egl)
+{
+    char key[1024];
+    bool cached = false;
+    if (egl->params.cache_path) {
+        egl_get_cache_key(egl, key, sizeof(key));
+        cached = egl_init_formats_from_cache(egl, key);
+    }
+
+    if (!cached && egl_has_ext(egl, EGL_EXT_image_dma_buf_import_modifiers))
+        egl_init_formats_from_driver(egl);
+
+    if (egl->params.cache_path && egl->cache.dirty)
+        egl_store_cache(egl, key);
+}
+
+static inline void
+egl_init_gl(struct egl *egl)
+{
+    egl->gl_exts = (const char *)egl->gl.GetString(GL_EXTENSIONS);
+    if (!egl->gl_exts)
+        egl_die("no GLES extensions");
+
+    egl_parse_extensions(egl->gl_exts, egl->exts);
+
+    if (egl->params.check == EGL_CHECK_DEFERRED) {
+        if (!egl_has_ext(egl, GL_KHR_debug))
+            egl_die("deferred error checking requires GL_KHR_debug");
+
+        /* errors generated before the callback is installed */
+        struct egl_gl *gl = &egl->gl;
+        const GLenum gl_err = gl->GetError();
+        if (gl_err != GL_NO_ERROR)
+            egl_die("init: gl has error 0x%04x", gl_err);
+
+        gl->DebugMessageCallback(egl_debug_callback, egl);
+        gl->DebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, NULL, GL_FALSE);
+        gl->DebugMessageControl(GL_DONT_CARE, GL_DEBUG_TYPE_ERROR, GL_DONT_CARE, 0, NULL,
+                                GL_TRUE);
+        gl->Enable(GL_DEBUG_OUTPUT);
+    }
+}
+
+static inline void
+egl_init(struct egl *egl, const struct egl_init_params *params)
+{
+    memset(egl, 0, sizeof(*egl));
+
+    if (params)
+        egl->params = *params;
+    if (!egl->params.cache_path)
+        egl->params.cache_path = getenv("EGLUTIL_CACHE");
+    if (getenv("EGLUTIL_SOFTWARE"))
+        egl->params.software = true;
+    if (!egl->params.modifier_policy)
+        egl->params.modifier_policy = egl_rank_modifier;
+    if (egl->params.check == EGL_CHECK_DEFAULT) {
+        const char *check = getenv("EGLUTIL_CHECK");
+        egl->params.check = EGL_CHECK_SYNC;
+        for (int i = EGL_CHECK_SYNC; check && i < EGL_CHECK_POLICY_COUNT; i++) {
+            if (!strcmp(check, egl_check_policy_names[i]))
+                egl->params.check = i;
+        }
+    }
+
+    void (*const phases[EGL_INIT_PHASE_COUNT])(struct egl *) = {
+        [EGL_INIT_PHASE_LIBRARY] = egl_init_library,
+        [EGL_INIT_PHASE_DISPLAY] = egl_init_display,
+        [EGL_INIT_PHASE_IMAGE_ALLOCATOR] = egl_init_image_allocator,
+        [EGL_INIT_PHASE_CONFIG_AND_SURFACE] = egl_init_config_and_surface,
+        [EGL_INIT_PHASE_CONTEXT] = egl_init_context,
+        [EGL_INIT_PHASE_FORMATS] = egl_init_formats,
+        [EGL_INIT_PHASE_GL] = egl_init_gl,
+    };
+
+    for (int i = 0; i < EGL_INIT_PHASE_COUNT; i++) {
+        const uint64_t begin = egl_get_time_ns();
+
+        phases[i](egl);
+
+        char where[64];
+        snprintf(where, sizeof(where), "init %s", egl_init_phase_names[i]);
+        egl_check(egl, where);
+
+        egl->init_phase_ns[i] = egl_get_time_ns() - begin;
+    }
+}
+
+static inline void
+egl_dump_init_profile(const struct egl *egl, FILE *fp)
+{
+    uint64_t total_ns = 0;
+
+    fprintf(fp, "{\"phases\": {");
+    for (int i = 0; i < EGL_INIT_PHASE_COUNT; i++) {
+        fprintf(fp, "%s\"%s\": %" PRIu64, i ? ", " : "", egl_init_phase_names[i],
+                egl->init_phase_ns[i]);
+        total_ns += egl->init_phase_ns[i];
+    }
+    fprintf(fp, "}, \"total\": %" PRIu64 ", \"unit\": \"ns\"}\n", total_ns);
+}
+
+static inline void
+egl_cleanup(struct egl *egl)
+{
+    egl_check(egl, "cleanup");
+
+    free(egl->formats);
+    egl_cleanup_cache(egl);
+
+    egl->MakeCurrent(egl->dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    egl->DestroyContext(egl->dpy, egl->ctx);
+    if (egl->surf != EGL_NO_SURFACE)
+        egl->DestroySurface(egl->dpy, egl->surf);
+
+    egl_cleanup_image_allocator(egl);
+
+    egl->Terminate(egl->dpy);
+    egl->ReleaseThread();
+
+    egl_cleanup_library(egl);
+}
+
+/* This initializes a struct egl for each usable device, including software
+ * devices.  No context is current to the calling thread upon return.
+ */
+static inline struct egl *
+egl_init_all_devices(const struct egl_init_params *params, int *count)
+{
+    struct egl tmp;
+    memset(&tmp, 0, sizeof(tmp));
+    if (params)
+        tmp.params = *params;
+
+    /* keep the library loaded to keep the device handles valid */
+    egl_init_library(&tmp);
+    if (!egl_has_ext(&tmp, EGL_EXT_device_enumeration) ||
+        !egl_has_ext(&tmp, EGL_EXT_device_query) || !egl_has_ext(&tmp, EGL_EXT_platform_device))
+        egl_die("no device enumeration support");
+
+    int dev_count;
+    EGLDeviceEXT *devs = egl_query_devices(&tmp, &dev_count);
+
+    struct egl *egls = calloc(dev_count, sizeof(*egls));
+    if (!egls)
+        egl_die("failed to alloc egls");
+
+    /* a cache file describes a single device */
+    const char *cache_path = tmp.params.cache_path;
+    if (!cache_path)
+        cache_path = getenv("EGLUTIL_CACHE");
+
+    int egl_count = 0;
+    for (int i = 0; i < dev_count; i++) {
+        if (!egl_is_device_usable(&tmp, devs[i]))
+            continue;
+
+        struct egl_init_params dev_params = tmp.params;
+        dev_params.dev = devs[i];
+
+        char *dev_cache_path = NULL;
+        if (cache_path) {
+            const size_t size = strlen(cache_path) + 16;
+            dev_cache_path = malloc(size);
+            if (!dev_cache_path)
+                egl_die("failed to alloc cache path");
+            snprintf(dev_cache_path, size, "%s.%d", cache_path, egl_count);
+            dev_params.cache_path = dev_cache_path;
+        }
+
+        struct egl *egl = &egls[egl_count++];
+        egl_init(egl, &dev_params);
+        egl->cache.path = dev_cache_path;
+        egl->MakeCurrent(egl->dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    }
+
+    free(devs);
+    egl_cleanup_library(&tmp);
+
+    *count = egl_count;
+    return egls;
+}
+
+static inline void
+egl_cleanup_all_devices(struct egl *egls, int count)
+{
+    for (int i = 0; i < count; i++) {
+        struct egl *egl = &egls[i];
+
+        if (!egl->MakeCurrent(egl->dpy, egl->surf, egl->surf, egl->ctx))
+            egl_die("failed to make context current");
+        egl_cleanup(egl);
+    }
+
+    free(egls);
+}
+
+#define EGL_DEVICE_MAX_JOBS_IN_FLIGHT 2
+
+struct egl_device_dispatch {
+    struct egl *egl;
+    int device;
+    thrd_t thrd;
+
+    atomic_int *next_job;
+    int job_count;
+    egl_device_job_func func;
+    void *data;
+
+    struct egl_device_stats *stats;
+};
+
+static inline int
+egl_dispatch_device_jobs_thread(void *arg)
+{
+    struct egl_device_dispatch *dispatch = arg;
+    struct egl *egl = dispatch->egl;
+
+    if (!egl->MakeCurrent(egl->dpy, egl->surf, egl->surf, egl->ctx))
+        egl_die("failed to make context current");
+
+    const uint64_t begin = egl_get_time_ns();
+
+    /* bound the jobs in flight such that a device claims the next job only
+     * after its GPU has caught up
+     */
+    EGLSync fences[EGL_DEVICE_MAX_JOBS_IN_FLIGHT];
+    for (int i = 0; i < EGL_DEVICE_MAX_JOBS_IN_FLIGHT; i++)
+        fences[i] = EGL_NO_SYNC;
+
+    int job_count = 0;
+    while (true) {
+        EGLSync *fence = &fences[job_count % EGL_DEVICE_MAX_JOBS_IN_FLIGHT];
+        if (*fence != EGL_NO_SYNC) {
+            if (egl->ClientWaitSync(egl->dpy, *fence, EGL_SYNC_FLUSH_COMMANDS_BIT, EGL_FOREVER) !=
+                EGL_CONDITION_SATISFIED)
+                egl_die("failed to wait fence");
+            egl->DestroySync(egl->dpy, *fence);
+            *fence = EGL_NO_SYNC;
+        }
+
+        const int job = atomic_fetch_add(dispatch->next_job, 1);
+        if (job >= dispatch->job_count)
+            break;
+
+        dispatch->func(egl, dispatch->device, job, dispatch->data);
+        job_count++;
+
+        *fence = egl->CreateSync(egl->dpy, EGL_SYNC_FENCE, NULL);
+        if (*fence == EGL_NO_SYNC)
+            egl_die("failed to create fence");
+        egl->gl.Flush();
+    }
+
+    for (int i = 0; i < EGL_DEVICE_MAX_JOBS_IN_FLIGHT; i++) {
+        if (fences[i] != EGL_NO_SYNC)
+            egl->DestroySync(egl->dpy, fences[i]);
+    }
+
+    egl->gl.Finish();
+    egl_check(egl, "device jobs");
+
+    dispatch->stats->job_count = job_count;
+    dispatch->stats->duration_ns = egl_get_time_ns() - begin;
+
+    egl->MakeCurrent(egl->dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    egl->ReleaseThread();
+
+    return 0;
+}
+
+/* This spreads independent jobs across the devices.  Each device has a
+ * thread that takes the next job whenever its GPU has fewer than
+ * EGL_DEVICE_MAX_JOBS_IN_FLIGHT jobs pending, so faster devices get more jobs.
+ */
+static inline void
+egl_dispatch_device_jobs(struct egl *egls,
+                         int egl_count,
+                         int job_count,
+                         egl_device_job_func func,
+                         void *data,
+                         struct egl_device_stats *stats)
+{
+    struct egl_device_dispatch *dispatches = calloc(egl_count, sizeof(*dispatches));
+    if (!dispatches)
+        egl_die("failed to alloc dispatches");
+
+    atomic_int next_job = 0;
+    for (int i = 0; i < egl_count; i++) {
+        struct egl_device_dispatch *dispatch = &dispatches[i];
+
+        *dispatch = (struct egl_device_dispatch){
+            .egl = &egls[i],
+            .device = i,
+            .next_job = &next_job,
+            .job_count = job_count,
+            .func = func,
+            .data = data,
+            .stats = &stats[i],
+        };
+        if (thrd_create(&dispatch->thrd, egl_dispatch_device_jobs_thread, dispatch) !=
+            thrd_success)
+            egl_die("thrd_create failed");
+    }
+
+    for (int i = 0; i < egl_count; i++) {
+        if (thrd_join(dispatches[i].thrd, NULL) != thrd_success)
+            egl_die("thrd_join failed");
+    }
+
+    free(dispatches);
+}
+
+static inline void
+egl_dump_formats(struct egl *egl)
+{
+    for (int i = 0; i < egl->format_count; i++) {
+        const struct egl_format *fmt = &egl->formats[i];
+
+        egl_log("format %d: %c%c%c%c (0x%08x)", i, (fmt->drm_format >> 0) & 0xff,
+                (fmt->drm_format >> 8) & 0xff, (fmt->drm_format >> 16) & 0xff,
+                (fmt->drm_format >> 24) & 0xff, fmt->drm_format);
+        for (int j = 0; j < fmt->drm_modifier_count; j++) {
+            egl_log("  modifier 0x%016" PRIx64 " external only %d", fmt->drm_modifiers[j],
+                    fmt->external_only[j]);
+        }
+    }
+}
+
+static inline const void *
+egl_parse_ppm(const void *ppm_data, size_t ppm_size, int *width, int *height)
+{
+    if (sscanf(ppm_data, "P6 %d %d 255\n", width, height) != 2)
+        egl_die("invalid ppm header");
+
+    const size_t img_size = *width * *height * 3;
+    if (img_size >= ppm_size)
+        egl_die("bad ppm dimension %dx%d", *width, *height);
+
+    const size_t hdr_size = ppm_size - img_size;
+    if (!isspace(((const char *)ppm_data)[hdr_size - 1]))
+        egl_die("no space at the end of ppm header");
+
+    return ppm_data + hdr_size;
+}
+
+static inline void
+egl_write_ppm(const char *filename, const void *data, int width, int height)
+{
+    FILE *fp = fopen(filename, "w");
+    if (!fp)
+        egl_die("failed to open %s", filename);
+
+    fprintf(fp, "P6 %d %d 255\n", width, height);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const void *pixel = data + ((width * y) + x) * 4;
+            if (fwrite(pixel, 3, 1, fp) != 1)
+                egl_die("failed to write pixel (%d, %x)", x, y);
+        }
+    }
+
+    fclose(fp);
+}
+
+static inline void
+egl_dump_image(struct egl *egl, int width, int height, const char *filename)
+{
+    const GLenum format = GL_RGBA;
+    const GLenum type = GL_UNSIGNED_BYTE;
+    const GLsizei size = width * height * 4;
+
+    char *data = malloc(size);
+    if (!data)
+        egl_die("failed to alloc readback buf");
+
+    egl->gl.ReadnPixels(0, 0, width, height, format, type, size, data);
+    egl_check(egl, "dump");
+
+    egl_write_ppm(filename, data, width, height);
+
+    free(data);
+}
+
+static inline void
+egl_teximage_2d_from_ppm(struct egl *egl, GLenum target, const void *ppm_data, size_t ppm_size)
+{
+    struct egl_gl *gl = &egl->gl;
+
+    int width;
+    int height;
+    ppm_data = egl_parse_ppm(ppm_data, ppm_size, &width, &height);
+
+    void *texels = malloc(width * height * 4);
+    if (!texels)
+        egl_die("failed to alloc texels");
+
+    const uint8_t *rgb = ppm_data;
+    uint8_t *rgba = texels;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            rgba[0] = rgb[0];
+            rgba[1] = rgb[1];
+            rgba[2] = rgb[2];
+            rgba[3] = 0xff;
+            rgba += 4;
+            rgb += 3;
+        }
+    }
+
+    gl->TexImage2D(target, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, texels);
+
+    free(texels);
+}
+
+static inline struct egl_framebuffer *
+egl_create_framebuffer(struct egl *egl, int width, int height)
+{
+    struct egl_gl *gl = &egl->gl;
+
+    struct egl_framebuffer *fb = calloc(1, sizeof(*fb));
+    if (!fb)
+        egl_die("failed to alloc fb");
+
+    const GLenum target = GL_FRAMEBUFFER;
+    const GLenum textarget = GL_TEXTURE_2D;
+    const GLenum att = GL_COLOR_ATTACHMENT0;
+
+    gl->GenTextures(1, &fb->tex);
+    gl->BindTexture(textarget, fb->tex);
+    gl->TexStorage2D(textarget, 1, GL_RGBA8, width, height);
+    gl->BindTexture(textarget, 0);
+
+    gl->GenFramebuffers(1, &fb->fbo);
+    gl->BindFramebuffer(target, fb->fbo);
+    gl->FramebufferTexture(target, att, fb->tex, 0);
+
+    if (gl->CheckFramebufferStatus(target) != GL_FRAMEBUFFER_COMPLETE)
+        egl_die("incomplete fbo");
+
+    gl->BindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    return fb;
+}
+
+static inline void
+egl_destroy_framebuffer(struct egl *egl, struct egl_framebuffer *fb)
+{
+    struct egl_gl *gl = &egl->gl;
+
+    gl->DeleteTextures(1, &fb->tex);
+    gl->DeleteFramebuffers(1, &fb->fbo);
+
+    free(fb);
+}
+
+static inline void
+egl_check_shader(struct egl *egl, GLuint sh)
+{
+    struct egl_gl *gl = &egl->gl;
+
+    GLint val;
+    gl->GetShaderiv(sh, GL_COMPILE_STATUS, &val);
+    if (val != GL_TRUE) {
+        char info_log[1024];
+        gl->GetShaderInfoLog(sh, sizeof(info_log), NULL, info_log);
+        egl_die("failed to compile shader: %s", info_log);
+    }
+}
+
+static inline void
+egl_check_program(struct egl *egl, GLuint prog)
+{
+    struct egl_gl *gl = &egl->gl;
+
+    GLint val;
+    gl->GetProgramiv(prog, GL_LINK_STATUS, &val);
+    if (val != GL_TRUE) {
+        char info_log[1024];
+        gl->GetProgramInfoLog(prog, sizeof(info_log), NULL, info_log);
+        egl_die("failed to link program: %s", info_log);
+    }
+}
+
+static inline GLuint
+egl_submit_shader(struct egl *egl, GLenum type, const char *glsl)
+{
+    struct egl_gl *gl = &egl->gl;
+
+    GLuint sh = gl->CreateShader(type);
+    gl->ShaderSource(sh, 1, &glsl, NULL);
+    gl->CompileShader(sh);
+
+    return sh;
+}
+
+static inline GLuint
+egl_submit_program(struct egl *egl, const GLuint *shaders, int count)
+{
+    struct egl_gl *gl = &egl->gl;
+
+    GLuint prog = gl->CreateProgram();
+    for (int i = 0; i < count; i++)
+        gl->AttachShader(prog, shaders[i]);
+    gl->LinkProgram(prog);
+
+    return prog;
+}
+
+static inline GLuint
+egl_compile_shader(struct egl *egl, GLenum type, const char *glsl)
+{
+    GLuint sh = egl_submit_shader(egl, type, glsl);
+    egl_check_shader(egl, sh);
+
+    return sh;
+}
+
+static inline GLuint
+egl_link_program(struct egl *egl, const GLuint *shaders, int count)
+{
+    GLuint prog = egl_submit_program(egl, shaders, count);
+    egl_check_program(egl, prog);
+
+    return prog;
+}
+
+static inline struct egl_program *
+egl_create_program(struct egl *egl, const char *vs_glsl, const char *fs_glsl)
+{
+    struct egl_program *prog = calloc(1, sizeof(*prog));
+    if (!prog)
+        egl_die("failed to alloc prog");
+
+    prog->vs = egl_compile_shader(egl, GL_VERTEX_SHADER, vs_glsl);
+    prog->fs = egl_compile_shader(egl, GL_FRAGMENT_SHADER, fs_glsl);
+
+    const GLuint shaders[] = { prog->vs, prog->fs };
+    prog->prog = egl_link_program(egl, shaders, ARRAY_SIZE(shaders));
+
+    return prog;
+}
+
+static inline struct egl_context_pool *
+egl_create_context_pool(struct egl *egl, int count)
+{
+    struct egl_context_pool *pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        egl_die("failed to alloc pool");
+
+    if (mtx_init(&pool->mutex, mtx_plain) != thrd_success ||
+        cnd_init(&pool->cond) != thrd_success)
+        egl_die("failed to init mtx/cnd");
+
+    pool->ctxs = malloc(sizeof(*pool->ctxs) * count * 2);
+    if (!pool->ctxs)
+        egl_die("failed to alloc pool ctxs");
+    pool->free_ctxs = pool->ctxs + count;
+
+    for (int i = 0; i < count; i++) {
+        pool->ctxs[i] = egl_create_context(egl, egl->ctx);
+        pool->free_ctxs[i] = pool->ctxs[i];
+    }
+    pool->count = count;
+    pool->free_count = count;
+
+    return pool;
+}
+
+static inline void
+egl_destroy_context_pool(struct egl *egl, struct egl_context_pool *pool)
+{
+    if (pool->free_count != pool->count)
+        egl_die("destroying a context pool with leased contexts");
+
+    for (int i = 0; i < pool->count; i++)
+        egl->DestroyContext(egl->dpy, pool->ctxs[i]);
+
+    free(pool->ctxs);
+    cnd_destroy(&pool->cond);
+    mtx_destroy(&pool->mutex);
+    free(pool);
+}
+
+/* This waits for a free context and makes it current to the calling thread
+ * without a surface.
+ */
+static inline EGLContext
+egl_lease_context(struct egl *egl, struct egl_context_pool *pool)
+{
+    mtx_lock(&pool->mutex);
+    while (!pool->free_count) {
+        if (cnd_wait(&pool->cond, &pool->mutex) != thrd_success)
+            egl_die("cnd_wait failed");
+    }
+    EGLContext ctx = pool->free_ctxs[--pool->free_count];
+    mtx_unlock(&pool->mutex);
+
+    if (!egl->MakeCurrent(egl->dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx))
+        egl_die("failed to make context current");
+
+    return ctx;
+}
+
+static inline void
+egl_return_context(struct egl *egl, struct egl_context_pool *pool, EGLContext ctx)
+{
+    if (!egl->MakeCurrent(egl->dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT))
+        egl_die("failed to release context");
+
+    mtx_lock(&pool->mutex);
+    pool->free_ctxs[pool->free_count++] = ctx;
+    cnd_signal(&pool->cond);
+    mtx_unlock(&pool->mutex);
+}
+
+static inline int
+egl_program_compiler_thread(void *arg)
+{
+    struct egl_program_compiler *compiler = arg;
+    struct egl *egl = compiler->egl;
+
+    EGLContext ctx = egl_lease_context(egl, compiler->ctx_pool);
+
+    while (true) {
+        mtx_lock(&compiler->mutex);
+        while (!compiler->head && !compiler->stop) {
+            if (cnd_wait(&compiler->cond, &compiler->mutex) != thrd_success)
+                egl_die("cnd_wait failed");
+        }
+
+        struct egl_program *prog = compiler->head;
+        if (prog) {
+            compiler->head = prog->next;
+            if (!compiler->head)
+                compiler->tail = &compiler->head;
+        }
+        mtx_unlock(&compiler->mutex);
+
+        if (!prog)
+            break;
+
+        prog->vs = egl_compile_shader(egl, GL_VERTEX_SHADER, prog->glsl[0]);
+        prog->fs = egl_compile_shader(egl, GL_FRAGMENT_SHADER, prog->glsl[1]);
+        const GLuint shaders[] = { prog->vs, prog->fs };
+        prog->prog = egl_link_program(egl, shaders, ARRAY_SIZE(shaders));
+
+        /* Shared objects are only guaranteed to be complete for other
+         * contexts once the commands that changed them have completed, which
+         * a flush alone does not guarantee.
+         */
+        egl->gl.Finish();
+        egl_check(egl, "compile");
+
+        mtx_lock(&compiler->mutex);
+        atomic_store(&prog->ready, true);
+        cnd_broadcast(&compiler->done_cond);
+        mtx_unlock(&compiler->mutex);
+    }
+
+    egl_return_context(egl, compiler->ctx_pool, ctx);
+    egl->ReleaseThread();
+
+    return 0;
+}
+
+/* This creates a compiler for egl_create_program_async.  When thread_count is
+ * 0, GL_KHR_parallel_shader_compile is used if supported, and a thread per
+ * CPU is used otherwise.
+ */
+static inline struct egl_program_compiler *
+egl_create_program_compiler(struct egl *egl, int thread_count)
+{
+    struct egl_program_compiler *compiler = calloc(1, sizeof(*compiler));
+    if (!compiler)
+        egl_die("failed to alloc program compiler");
+
+    compiler->egl = egl;
+    compiler->tail = &compiler->head;
+
+    if (!thread_count) {
+        if (egl_has_ext(egl, GL_KHR_parallel_shader_compile)) {
+            compiler->parallel_shader_compile = true;
+            /* let the driver pick */
+            egl->gl.MaxShaderCompilerThreadsKHR(0xffffffff);
+            return compiler;
+        }
+
+        thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+        if (thread_count <= 0)
+            thread_count = 1;
+    }
+
+    compiler->ctx_pool = egl_create_context_pool(egl, thread_count);
+
+    if (mtx_init(&compiler->mutex, mtx_plain) != thrd_success ||
+        cnd_init(&compiler->cond) != thrd_success ||
+        cnd_init(&compiler->done_cond) != thrd_success)
+        egl_die("failed to init mtx/cnd");
+
+    compiler->thrds = malloc(sizeof(*compiler->thrds) * thread_count);
+    if (!compiler->thrds)
+        egl_die("failed to alloc compiler threads");
+    compiler->thread_count = thread_count;
+
+    for (int i = 0; i < thread_count; i++) {
+        if (thrd_create(&compiler->thrds[i], egl_program_compiler_thread, compiler) !=
+            thrd_success)
+            egl_die("thrd_create failed");
+    }
+
+    return compiler;
+}
+
+/* Programs created by the compiler must be destroyed first. */
+static inline void
+egl_destroy_program_compiler(struct egl *egl, struct egl_program_compiler *compiler)
+{
+    if (compiler->parallel_shader_compile) {
+        free(compiler);
+        return;
+    }
+
+    mtx_lock(&compiler->mutex);
+    compiler->stop = true;
+    cnd_broadcast(&compiler->cond);
+    mtx_unlock(&compiler->mutex);
+
+    for (int i = 0; i < compiler->thread_count; i++) {
+        if (thrd_join(compiler->thrds[i], NULL) != thrd_success)
+            egl_die("thrd_join failed");
+    }
+    free(compiler->thrds);
+
+    mtx_destroy(&compiler->mutex);
+    cnd_destroy(&compiler->cond);
+    cnd_destroy(&compiler->done_cond);
+
+    egl_destroy_context_pool(egl, compiler->ctx_pool);
+
+    free(compiler);
+}
+
+/* This returns without waiting for the program to compile.  The program can
+ * be used after egl_is_program_ready returns true or egl_wait_program
+ * returns.
+ */
+static inline struct egl_program *
+egl_create_program_async(struct egl *egl,
+                         struct egl_program_compiler *compiler,
+                         const char *vs_glsl,
+                         const char *fs_glsl)
+{
+    struct egl_program *prog = calloc(1, sizeof(*prog));
+    if (!prog)
+        egl_die("failed to alloc prog");
+
+    prog->compiler = compiler;
+    atomic_init(&prog->ready, false);
+
+    if (compiler->parallel_shader_compile) {
+        prog->vs = egl_submit_shader(egl, GL_VERTEX_SHADER, vs_glsl);
+        prog->fs = egl_submit_shader(egl, GL_FRAGMENT_SHADER, fs_glsl);
+
+        const GLuint shaders[] = { prog->vs, prog->fs };
+        prog->prog = egl_submit_program(egl, shaders, ARRAY_SIZE(shaders));
+
+        return prog;
+    }
+
+    /* the caller might free the sources before they are compiled */
+    prog->glsl[0] = strdup(vs_glsl);
+    prog->glsl[1] = strdup(fs_glsl);
+    if (!prog->glsl[0] || !prog->glsl[1])
+        egl_die("failed to dup glsl");
+
+    mtx_lock(&compiler->mutex);
+    *compiler->tail = prog;
+    compiler->tail = &prog->next;
+    cnd_signal(&compiler->cond);
+    mtx_unlock(&compiler->mutex);
+
+    return prog;
 }
 
 static inline void
-egl_dump_formats(struct egl *egl)
+egl_check_program_async(struct egl *egl, struct egl_program *prog)
 {
-    for (int i = 0; i < egl->format_count; i++) {
-        const struct egl_format *fmt = egl->formats[i];
+    /* link errors are less useful than compile errors */
+    egl_check_shader(egl, prog->vs);
+    egl_check_shader(egl, prog->fs);
+    egl_check_program(egl, prog->prog);
 
-        egl_log("format %d: %c%c%c%c (0x%08x)", i, (fmt->drm_format >> 0) & 0xff,
-                (fmt->drm_format >> 8) & 0xff, (fmt->drm_format >> 16) & 0xff,
-                (fmt->drm_format >> 24) & 0xff, fmt->drm_format);
-        for (int j = 0; j < fmt->drm_modifier_count; j++) {
-            egl_log("  modifier 0x%016" PRIx64 " external only %d", fmt->drm_modifiers[j],
-                    fmt->external_only[j]);
-        }
-    }
+    atomic_store(&prog->ready, true);
 }
 
-static inline const void *
-egl_parse_ppm(const void *ppm_data, size_t ppm_size, int *width, int *height)
+/* This never blocks. */
+static inline bool
+egl_is_program_ready(struct egl *egl, struct egl_program *prog)
 {
-    if (sscanf(ppm_data, "P6 %d %d 255\n", width, height) != 2)
-        egl_die("invalid ppm header");
+    if (!prog->compiler || atomic_load(&prog->ready))
+        return true;
 
-    const size_t img_size = *width * *height * 3;
-    if (img_size >= ppm_size)
-        egl_die("bad ppm dimension %dx%d", *width, *height);
+    if (prog->compiler->parallel_shader_compile) {
+        GLint val;
+        egl->gl.GetProgramiv(prog->prog, GL_COMPLETION_STATUS_KHR, &val);
+        if (val != GL_TRUE)
+            return false;
 
-    const size_t hdr_size = ppm_size - img_size;
-    if (!isspace(((const char *)ppm_data)[hdr_size - 1]))
-        egl_die("no space at the end of ppm header");
+        egl_check_program_async(egl, prog);
+        return true;
+    }
 
-    return ppm_data + hdr_size;
+    return false;
 }
 
 static inline void
-egl_write_ppm(const char *filename, const void *data, int width, int height)
+egl_wait_program(struct egl *egl, struct egl_program *prog)
 {
-    FILE *fp = fopen(filename, "w");
-    if (!fp)
-        egl_die("failed to open %s", filename);
+    if (!prog->compiler || atomic_load(&prog->ready))
+        return;
 
-    fprintf(fp, "P6 %d %d 255\n", width, height);
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            const void *pixel = data + ((width * y) + x) * 4;
-            if (fwrite(pixel, 3, 1, fp) != 1)
-                egl_die("failed to write pixel (%d, %x)", x, y);
-        }
+    struct egl_program_compiler *compiler = prog->compiler;
+    if (compiler->parallel_shader_compile) {
+        /* this blocks */
+        egl_check_program_async(egl, prog);
+        return;
     }
 
-    fclose(fp);
+    mtx_lock(&compiler->mutex);
+    while (!atomic_load(&prog->ready)) {
+        if (cnd_wait(&compiler->done_cond, &compiler->mutex) != thrd_success)
+            egl_die("cnd_wait failed");
+    }
+    mtx_unlock(&compiler->mutex);
 }
 
 static inline void
-egl_dump_image(struct egl *egl, int width, int height, const char *filename)
+egl_destroy_program(struct egl *egl, struct egl_program *prog)
 {
-    const GLenum format = GL_RGBA;
-    const GLenum type = GL_UNSIGNED_BYTE;
-    const GLsizei size = width * height * 4;
-
-    char *data = malloc(size);
-    if (!data)
-        egl_die("failed to alloc readback buf");
+    struct egl_gl *gl = &egl->gl;
 
-    egl->gl.ReadnPixels(0, 0, width, height, format, type, size, data);
-    egl_check(egl, "dump");
+    /* a compiler thread might still own it */
+    egl_wait_program(egl, prog);
 
-    egl_write_ppm(filename, data, width, height);
+    gl->DeleteProgram(prog->prog);
+    gl->DeleteShader(prog->vs);
+    gl->DeleteShader(prog->fs);
 
-    free(data);
+    free(prog->glsl[0]);
+    free(prog->glsl[1]);
+    free(prog);
 }
 
-static inline void
-egl_teximage_2d_from_ppm(struct egl *egl, GLenum target, const void *ppm_data, size_t ppm_size)
+/* This creates a fence after the commands issued so far and flushes them.  It
+ * is a native fence, which can be exported as a sync_file, when supported.
+ */
+static inline EGLSync
+egl_create_fence(struct egl *egl)
 {
-    struct egl_gl *gl = &egl->gl;
-
-    int width;
-    int height;
-    ppm_data = egl_parse_ppm(ppm_data, ppm_size, &width, &height);
+    const bool native = egl_has_ext(egl, EGL_ANDROID_native_fence_sync);
+    EGLSync sync = egl->CreateSync(
+        egl->dpy, native ? EGL_SYNC_NATIVE_FENCE_ANDROID : EGL_SYNC_FENCE, NULL);
+    if (sync == EGL_NO_SYNC)
+        egl_die("failed to create fence");
 
-    void *texels = malloc(width * height * 4);
-    if (!texels)
-        egl_die("failed to alloc texels");
+    /* this also makes the native fence fd available */
+    egl->gl.Flush();
 
-    const uint8_t *rgb = ppm_data;
-    uint8_t *rgba = texels;
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            rgba[0] = rgb[0];
-            rgba[1] = rgb[1];
-            rgba[2] = rgb[2];
-            rgba[3] = 0xff;
-            rgba += 4;
-            rgb += 3;
-        }
-    }
+    return sync;
+}
 
-    gl->TexImage2D(target, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, texels);
+/* This returns a sync_file fd of a native fence, or -1. */
+static inline int
+egl_export_fence(struct egl *egl, EGLSync sync)
+{
+    if (!egl_has_ext(egl, EGL_ANDROID_native_fence_sync))
+        return -1;
 
-    free(texels);
+    return egl->DupNativeFenceFDANDROID(egl->dpy, sync);
 }
 
-static inline struct egl_framebuffer *
-egl_create_framebuffer(struct egl *egl, int width, int height)
+/* This takes ownership of a sync_file fd. */
+static inline EGLSync
+egl_import_fence(struct egl *egl, int fd)
 {
-    struct egl_gl *gl = &egl->gl;
+    const EGLAttrib attrs[] = {
+        EGL_SYNC_NATIVE_FENCE_FD_ANDROID,
+        fd,
+        EGL_NONE,
+    };
+    EGLSync sync = egl->CreateSync(egl->dpy, EGL_SYNC_NATIVE_FENCE_ANDROID, attrs);
+    if (sync == EGL_NO_SYNC)
+        egl_die("failed to import fence");
 
-    struct egl_framebuffer *fb = calloc(1, sizeof(*fb));
-    if (!fb)
-        egl_die("failed to alloc fb");
+    return sync;
+}
 
-    const GLenum target = GL_FRAMEBUFFER;
-    const GLenum textarget = GL_TEXTURE_2D;
-    const GLenum att = GL_COLOR_ATTACHMENT0;
+/* This makes the GPU, rather than the CPU, wait for the fence and destroys
+ * the fence.
+ */
+static inline void
+egl_wait_fence(struct egl *egl, EGLSync sync)
+{
+    if (!egl->WaitSync(egl->dpy, sync, 0))
+        egl_die("failed to wait fence");
+    egl->DestroySync(egl->dpy, sync);
+}
 
-    gl->GenTextures(1, &fb->tex);
-    gl->BindTexture(textarget, fb->tex);
-    gl->TexStorage2D(textarget, 1, GL_RGBA8, width, height);
-    gl->BindTexture(textarget, 0);
+static inline void
+egl_init_job_deque(struct egl_job_deque *deque, int capacity)
+{
+    long size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    atomic_int *jobs = realloc(deque->jobs, sizeof(*jobs) * size);
+    if (!jobs)
+        egl_die("failed to alloc job deque");
+
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    deque->mask = size - 1;
+    deque->jobs = jobs;
+}
 
-    gl->GenFramebuffers(1, &fb->fbo);
-    gl->BindFramebuffer(target, fb->fbo);
-    gl->FramebufferTexture(target, att, fb->tex, 0);
+static inline void
+egl_push_job(struct egl_job_deque *deque, int job)
+{
+    const long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    const long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (b - t > deque->mask)
+        egl_die("job deque overflow");
+
+    atomic_store_explicit(&deque->jobs[b & deque->mask], job, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+}
 
-    if (gl->CheckFramebufferStatus(target) != GL_FRAMEBUFFER_COMPLETE)
-        egl_die("incomplete fbo");
+static inline int
+egl_pop_job(struct egl_job_deque *deque)
+{
+    const long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    int job = -1;
+    if (t <= b) {
+        job = atomic_load_explicit(&deque->jobs[b & deque->mask], memory_order_relaxed);
+        if (t == b) {
+            /* the last job; race against thieves */
+            if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                         memory_order_seq_cst,
+                                                         memory_order_relaxed))
+                job = -1;
+            atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    }
 
-    gl->BindFramebuffer(GL_FRAMEBUFFER, 0);
+    return job;
+}
 
-    return fb;
+static inline int
+egl_steal_job(struct egl_job_deque *deque)
+{
+    long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    const long b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (t >= b)
+        return -1;
+
+    const int job = atomic_load_explicit(&deque->jobs[t & deque->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1, memory_order_seq_cst,
+                                                 memory_order_relaxed))
+        return -1;
+
+    return job;
 }
 
 static inline void
-egl_destroy_framebuffer(struct egl *egl, struct egl_framebuffer *fb)
+egl_run_job(struct egl_job_worker *worker, int job)
 {
-    struct egl_gl *gl = &egl->gl;
+    struct egl_job_scheduler *sched = worker->sched;
+    struct egl *egl = sched->egl;
+    const struct egl_job *info = &sched->jobs[job];
+    struct egl_job_state *state = &sched->states[job];
+
+    for (int i = 0; i < info->dep_count; i++) {
+        if (!egl->WaitSync(egl->dpy, sched->states[info->deps[i]].fence, 0))
+            egl_die("failed to wait fence");
+    }
 
-    gl->DeleteTextures(1, &fb->tex);
-    gl->DeleteFramebuffers(1, &fb->fbo);
+    info->func(egl, worker->index, info->data);
+    worker->job_count++;
 
-    free(fb);
+    if (state->dependent_count) {
+        /* dependents can run on any worker once this is flushed */
+        state->fence = egl_create_fence(egl);
+        for (int i = 0; i < state->dependent_count; i++) {
+            const int dependent = state->dependents[i];
+            if (atomic_fetch_sub(&sched->states[dependent].pending_dep_count, 1) == 1)
+                egl_push_job(&worker->deque, dependent);
+        }
+    }
+
+    atomic_fetch_sub(&sched->remaining_count, 1);
 }
 
-static inline GLuint
-egl_compile_shader(struct egl *egl, GLenum type, const char *glsl)
+static inline int
+egl_job_worker_thread(void *arg)
 {
-    struct egl_gl *gl = &egl->gl;
+    struct egl_job_worker *worker = arg;
+    struct egl_job_scheduler *sched = worker->sched;
+    struct egl *egl = sched->egl;
+
+    EGLContext ctx = egl_lease_context(egl, sched->ctx_pool);
+
+    int generation = 0;
+    while (true) {
+        mtx_lock(&sched->mutex);
+        while (sched->generation == generation && !sched->stop) {
+            if (cnd_wait(&sched->start_cond, &sched->mutex) != thrd_success)
+                egl_die("cnd_wait failed");
+        }
+        generation = sched->generation;
+        const bool stop = sched->stop;
+        mtx_unlock(&sched->mutex);
+
+        if (stop)
+            break;
+
+        while (atomic_load(&sched->remaining_count)) {
+            int job = egl_pop_job(&worker->deque);
+            for (int i = 1; job < 0 && i < sched->worker_count; i++) {
+                struct egl_job_worker *victim =
+                    &sched->workers[(worker->index + i) % sched->worker_count];
+                job = egl_steal_job(&victim->deque);
+                if (job >= 0)
+                    worker->steal_count++;
+            }
 
-    GLuint sh = gl->CreateShader(type);
-    gl->ShaderSource(sh, 1, &glsl, NULL);
-    gl->CompileShader(sh);
+            if (job >= 0)
+                egl_run_job(worker, job);
+            else
+                thrd_yield();
+        }
 
-    GLint val;
-    gl->GetShaderiv(sh, GL_COMPILE_STATUS, &val);
-    if (val != GL_TRUE) {
-        char info_log[1024];
-        gl->GetShaderInfoLog(sh, sizeof(info_log), NULL, info_log);
-        egl_die("failed to compile shader: %s", info_log);
+        egl->gl.Finish();
+        egl_check(egl, "jobs");
+
+        mtx_lock(&sched->mutex);
+        if (++sched->done_count == sched->worker_count)
+            cnd_signal(&sched->done_cond);
+        mtx_unlock(&sched->mutex);
     }
 
-    return sh;
+    egl_return_context(egl, sched->ctx_pool, ctx);
+    egl->ReleaseThread();
+
+    return 0;
 }
 
-static inline GLuint
-egl_link_program(struct egl *egl, const GLuint *shaders, int count)
+static inline struct egl_job_scheduler *
+egl_create_job_scheduler(struct egl *egl, int worker_count)
 {
-    struct egl_gl *gl = &egl->gl;
-
-    GLuint prog = gl->CreateProgram();
-    for (int i = 0; i < count; i++)
-        gl->AttachShader(prog, shaders[i]);
-    gl->LinkProgram(prog);
-
-    GLint val;
-    gl->GetProgramiv(prog, GL_LINK_STATUS, &val);
-    if (val != GL_TRUE) {
-        char info_log[1024];
-        gl->GetProgramInfoLog(prog, sizeof(info_log), NULL, info_log);
-        egl_die("failed to link program: %s", info_log);
+    struct egl_job_scheduler *sched = calloc(1, sizeof(*sched));
+    if (!sched)
+        egl_die("failed to alloc job scheduler");
+
+    sched->egl = egl;
+    sched->ctx_pool = egl_create_context_pool(egl, worker_count);
+
+    if (mtx_init(&sched->mutex, mtx_plain) != thrd_success ||
+        cnd_init(&sched->start_cond) != thrd_success ||
+        cnd_init(&sched->done_cond) != thrd_success)
+        egl_die("failed to init mtx/cnd");
+
+    sched->workers = calloc(worker_count, sizeof(*sched->workers));
+    if (!sched->workers)
+        egl_die("failed to alloc job workers");
+    sched->worker_count = worker_count;
+
+    for (int i = 0; i < worker_count; i++) {
+        struct egl_job_worker *worker = &sched->workers[i];
+        worker->sched = sched;
+        worker->index = i;
+        egl_init_job_deque(&worker->deque, 64);
+
+        if (thrd_create(&worker->thrd, egl_job_worker_thread, worker) != thrd_success)
+            egl_die("thrd_create failed");
     }
 
-    return prog;
+    return sched;
 }
 
-static inline struct egl_program *
-egl_create_program(struct egl *egl, const char *vs_glsl, const char *fs_glsl)
+static inline void
+egl_destroy_job_scheduler(struct egl *egl, struct egl_job_scheduler *sched)
 {
-    struct egl_program *prog = calloc(1, sizeof(*prog));
-    if (!prog)
-        egl_die("failed to alloc prog");
+    mtx_lock(&sched->mutex);
+    sched->stop = true;
+    cnd_broadcast(&sched->start_cond);
+    mtx_unlock(&sched->mutex);
+
+    for (int i = 0; i < sched->worker_count; i++) {
+        if (thrd_join(sched->workers[i].thrd, NULL) != thrd_success)
+            egl_die("thrd_join failed");
+        free(sched->workers[i].deque.jobs);
+    }
+    free(sched->workers);
 
-    prog->vs = egl_compile_shader(egl, GL_VERTEX_SHADER, vs_glsl);
-    prog->fs = egl_compile_shader(egl, GL_FRAGMENT_SHADER, fs_glsl);
+    free(sched->states);
+    free(sched->dependents);
 
-    const GLuint shaders[] = { prog->vs, prog->fs };
-    prog->prog = egl_link_program(egl, shaders, ARRAY_SIZE(shaders));
+    mtx_destroy(&sched->mutex);
+    cnd_destroy(&sched->start_cond);
+    cnd_destroy(&sched->done_cond);
 
-    return prog;
+    egl_destroy_context_pool(egl, sched->ctx_pool);
+
+    free(sched);
 }
 
+/* This runs a batch of jobs on the workers and returns when their GL commands
+ * have completed.  Ready jobs are spread across the workers, and idle workers
+ * steal from busy ones.  A job becomes ready on the worker that ran its last
+ * dependency.
+ */
 static inline void
-egl_destroy_program(struct egl *egl, struct egl_program *prog)
+egl_run_jobs(struct egl *egl,
+             struct egl_job_scheduler *sched,
+             const struct egl_job *jobs,
+             int count)
 {
-    struct egl_gl *gl = &egl->gl;
+    if (!count)
+        return;
 
-    gl->DeleteProgram(prog->prog);
-    gl->DeleteShader(prog->vs);
-    gl->DeleteShader(prog->fs);
+    if (count > sched->job_capacity) {
+        free(sched->states);
+        sched->states = malloc(sizeof(*sched->states) * count);
+        if (!sched->states)
+            egl_die("failed to alloc job states");
 
-    free(prog);
+        for (int i = 0; i < sched->worker_count; i++)
+            egl_init_job_deque(&sched->workers[i].deque, count);
+        sched->job_capacity = count;
+    }
+
+    /* build the dependent lists */
+    int dep_count = 0;
+    for (int i = 0; i < count; i++) {
+        sched->states[i] = (struct egl_job_state){
+            .fence = EGL_NO_SYNC,
+        };
+        atomic_init(&sched->states[i].pending_dep_count, jobs[i].dep_count);
+
+        for (int j = 0; j < jobs[i].dep_count; j++) {
+            const int dep = jobs[i].deps[j];
+            if (dep < 0 || dep >= i)
+                egl_die("job %d depends on job %d", i, dep);
+            sched->states[dep].dependent_count++;
+        }
+        dep_count += jobs[i].dep_count;
+    }
+
+    free(sched->dependents);
+    sched->dependents = malloc(sizeof(*sched->dependents) * (dep_count ? dep_count : 1));
+    if (!sched->dependents)
+        egl_die("failed to alloc job dependents");
+
+    int offset = 0;
+    for (int i = 0; i < count; i++) {
+        struct egl_job_state *state = &sched->states[i];
+        state->dependents = sched->dependents + offset;
+        offset += state->dependent_count;
+        state->dependent_count = 0;
+    }
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < jobs[i].dep_count; j++) {
+            struct egl_job_state *dep = &sched->states[jobs[i].deps[j]];
+            dep->dependents[dep->dependent_count++] = i;
+        }
+    }
+
+    /* the workers are idle and the deques are empty */
+    int ready_count = 0;
+    for (int i = 0; i < sched->worker_count; i++) {
+        struct egl_job_worker *worker = &sched->workers[i];
+        atomic_store(&worker->deque.top, 0);
+        atomic_store(&worker->deque.bottom, 0);
+        worker->job_count = 0;
+        worker->steal_count = 0;
+    }
+    for (int i = 0; i < count; i++) {
+        if (!jobs[i].dep_count)
+            egl_push_job(&sched->workers[ready_count++ % sched->worker_count].deque, i);
+    }
+
+    sched->jobs = jobs;
+    sched->job_count = count;
+    atomic_store(&sched->remaining_count, count);
+
+    mtx_lock(&sched->mutex);
+    sched->generation++;
+    sched->done_count = 0;
+    cnd_broadcast(&sched->start_cond);
+    while (sched->done_count < sched->worker_count) {
+        if (cnd_wait(&sched->done_cond, &sched->mutex) != thrd_success)
+            egl_die("cnd_wait failed");
+    }
+    mtx_unlock(&sched->mutex);
+
+    for (int i = 0; i < count; i++) {
+        if (sched->states[i].fence != EGL_NO_SYNC)
+            egl->DestroySync(egl->dpy, sched->states[i].fence);
+    }
+    sched->jobs = NULL;
+    sched->job_count = 0;
 }
 
+/* This returns NULL when the storage cannot be allocated, such as when the
+ * driver fails to allocate a forced modifier.
+ */
 static inline struct egl_image *
-egl_create_image(struct egl *egl, const struct egl_image_info *info)
+egl_try_create_image(struct egl *egl, const struct egl_image_info *info)
 {
     struct egl_image *img = calloc(1, sizeof(*img));
     if (!img)
         egl_die("failed to alloc img");
 
     img->info = *info;
-    egl_alloc_image_storage(egl, img);
+    if (!egl_try_alloc_image_storage(egl, img)) {
+        free(img);
+        return NULL;
+    }
     egl_wrap_image_storage(egl, img);
 
     return img;
 }
 
+static inline struct egl_image *
+egl_create_image(struct egl *egl, const struct egl_image_info *info)
+{
+    struct egl_image *img = egl_try_create_image(egl, info);
+    if (!img)
+        egl_die("failed to alloc image storage");
+
+    return img;
+}
+
 static inline void
 egl_rgb_to_yuv(const uint8_t *rgb, uint8_t *yuv)
 {
@@ -1262,9 +4266,111 @@ egl_create_image_from_ppm(struct egl *egl, const void *ppm_data, size_t ppm_size
 static inline void
 egl_destroy_image(struct egl *egl, struct egl_image *img)
 {
-    egl->DestroyImage(egl->dpy, img->img);
+    egl_unwrap_image_storage(egl, img);
     egl_free_image_storage(egl, img);
     free(img);
 }
 
+static inline bool
+egl_image_info_equal(const struct egl_image_info *a, const struct egl_image_info *b)
+{
+    return a->width == b->width && a->height == b->height && a->drm_format == b->drm_format &&
+           a->mapping == b->mapping && a->rendering == b->rendering &&
+           a->sampling == b->sampling && a->force_linear == b->force_linear &&
+           a->force_modifier == b->force_modifier &&
+           (!a->force_modifier || a->drm_modifier == b->drm_modifier) &&
+           egl_image_info_layer_count(a) == egl_image_info_layer_count(b) &&
+           egl_image_info_level_count(a) == egl_image_info_level_count(b);
+}
+
+static inline struct egl_image_pool *
+egl_create_image_pool(struct egl *egl, int max_idle_count)
+{
+    struct egl_image_pool *pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        egl_die("failed to alloc pool");
+
+    if (mtx_init(&pool->mutex, mtx_plain) != thrd_success)
+        egl_die("failed to init mtx");
+
+    /* one extra slot for egl_release_image to trim from */
+    pool->idle_imgs = malloc(sizeof(*pool->idle_imgs) * (max_idle_count + 1));
+    if (!pool->idle_imgs)
+        egl_die("failed to alloc pool imgs");
+    pool->max_idle_count = max_idle_count;
+
+    return pool;
+}
+
+static inline void
+egl_trim_image_pool_locked(struct egl *egl, struct egl_image_pool *pool, int keep_count)
+{
+    const int trim_count = pool->idle_count - keep_count;
+    if (trim_count > 0) {
+        for (int i = 0; i < trim_count; i++)
+            egl_destroy_image(egl, pool->idle_imgs[i]);
+
+        memmove(pool->idle_imgs, pool->idle_imgs + trim_count,
+                sizeof(*pool->idle_imgs) * keep_count);
+        pool->idle_count = keep_count;
+        pool->trim_count += trim_count;
+    }
+}
+
+/* destroy the least recently released images until keep_count remain */
+static inline void
+egl_trim_image_pool(struct egl *egl, struct egl_image_pool *pool, int keep_count)
+{
+    mtx_lock(&pool->mutex);
+    egl_trim_image_pool_locked(egl, pool, keep_count);
+    mtx_unlock(&pool->mutex);
+}
+
+static inline void
+egl_destroy_image_pool(struct egl *egl, struct egl_image_pool *pool)
+{
+    egl_trim_image_pool(egl, pool, 0);
+
+    mtx_destroy(&pool->mutex);
+    free(pool->idle_imgs);
+    free(pool);
+}
+
+/* This returns the most recently released image matching info, or creates
+ * one.  The contents of a recycled image are undefined.
+ */
+static inline struct egl_image *
+egl_acquire_image(struct egl *egl, struct egl_image_pool *pool, const struct egl_image_info *info)
+{
+    mtx_lock(&pool->mutex);
+
+    for (int i = pool->idle_count - 1; i >= 0; i--) {
+        struct egl_image *img = pool->idle_imgs[i];
+        if (!egl_image_info_equal(&img->info, info))
+            continue;
+
+        memmove(pool->idle_imgs + i, pool->idle_imgs + i + 1,
+                sizeof(*pool->idle_imgs) * (pool->idle_count - i - 1));
+        pool->idle_count--;
+        pool->hit_count++;
+
+        mtx_unlock(&pool->mutex);
+        return img;
+    }
+
+    pool->miss_count++;
+    mtx_unlock(&pool->mutex);
+
+    return egl_create_image(egl, info);
+}
+
+static inline void
+egl_release_image(struct egl *egl, struct egl_image_pool *pool, struct egl_image *img)
+{
+    mtx_lock(&pool->mutex);
+    pool->idle_imgs[pool->idle_count++] = img;
+    egl_trim_image_pool_locked(egl, pool, pool->max_idle_count);
+    mtx_unlock(&pool->mutex);
+}
+
 #endif /* EGLUTIL_H */
@@ -0,0 +1,105 @@
+/*
+ * Copyright 2022 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+/* This compares strstr on the extension strings with egl_has_ext. */
+
+#include "eglutil.h"
+
+struct ext_bench {
+    int iterations;
+
+    struct egl egl;
+
+    /* the extension strings of the display and of GL */
+    const char *exts[2];
+};
+
+static void
+ext_bench_init(struct ext_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+
+    egl_init(egl, NULL);
+
+    bench->exts[0] = egl->dpy_exts;
+    bench->exts[1] = egl->gl_exts;
+
+    egl_check(egl, "init");
+}
+
+static void
+ext_bench_cleanup(struct ext_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+
+    egl_check(egl, "cleanup");
+
+    egl_cleanup(egl);
+}
+
+static void
+ext_bench_run(struct ext_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+    const int n = bench->iterations;
+    volatile int hits;
+
+    /* query every known extension against the string it belongs to */
+    hits = 0;
+    uint64_t begin = egl_get_time_ns();
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < EGL_EXTENSION_COUNT; j++) {
+            const char *name = egl_extension_names[j].name;
+            if (strstr(bench->exts[name[0] == 'G'], name))
+                hits++;
+        }
+    }
+    const uint64_t strstr_ns = egl_get_time_ns() - begin;
+    const int strstr_hits = hits;
+
+    hits = 0;
+    begin = egl_get_time_ns();
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < EGL_EXTENSION_COUNT; j++) {
+            if (egl_test_extension(egl->exts, j))
+                hits++;
+        }
+    }
+    const uint64_t bitset_ns = egl_get_time_ns() - begin;
+
+    begin = egl_get_time_ns();
+    for (int i = 0; i < n; i++) {
+        uint64_t bits[EGL_EXTENSION_WORDS] = { 0 };
+        egl_parse_extensions(bench->exts[0], bits);
+        egl_parse_extensions(bench->exts[1], bits);
+    }
+    const uint64_t parse_ns = egl_get_time_ns() - begin;
+
+    const double queries = (double)n * EGL_EXTENSION_COUNT;
+    egl_log("%d extensions, %d supported (strstr found %d)", EGL_EXTENSION_COUNT,
+            hits / n, strstr_hits / n);
+    egl_log("strstr: %.1fns per query", strstr_ns / queries);
+    egl_log("egl_has_ext: %.1fns per query", bitset_ns / queries);
+    egl_log("parsing: %.1fus per egl_init", parse_ns / 1000.0 / n);
+}
+
+int
+main(int argc, const char **argv)
+{
+    struct ext_bench bench = {
+        .iterations = 10000,
+    };
+
+    if (argc > 1)
+        bench.iterations = atoi(argv[1]);
+    if (bench.iterations <= 0)
+        egl_die("bad iteration count");
+
+    ext_bench_init(&bench);
+    ext_bench_run(&bench);
+    ext_bench_cleanup(&bench);
+
+    return 0;
+}
@@ -0,0 +1,47 @@
+#!/bin/env python
+# Copyright 2022 Google LLC
+# SPDX-License-Identifier: MIT
+
+import re
+import sys
+
+inc_fn = sys.argv[1]
+hdr_fns = sys.argv[2:-1]
+out_fn = sys.argv[-1]
+
+proto_re = re.compile(r'^(?:EGLAPI|GL_APICALL)\s+(.*?)\s*(?:EGLAPIENTRY|GL_APIENTRY)\s+'
+                      r'((?:egl|gl)\w+)\s*\((.*)\);')
+param_re = re.compile(r'(\w+)\s*(?:\[\w*\])?\s*$')
+entry_re = re.compile(r'^PFN_(EGL|GL)(?:_EXT)?\((\w+), (\w+)\)')
+
+protos = {}
+for fn in hdr_fns:
+    with open(fn) as f:
+        for line in f:
+            m = proto_re.match(line)
+            if m:
+                protos.setdefault(m.group(2), (m.group(1), m.group(3)))
+
+with open(inc_fn) as f:
+    entries = [m.groups() for m in map(entry_re.match, f) if m]
+
+with open(out_fn, 'w') as f:
+    for api, proc, name in entries:
+        prefix = api.lower()
+        ret, params = protos[prefix + name]
+        if params.strip() == 'void':
+            params = 'void'
+            args = ''
+        else:
+            args = ', '.join(param_re.search(p).group(1) for p in params.split(','))
+
+        entry = 'EGLAPIENTRY' if api == 'EGL' else 'GL_APIENTRY'
+        call = f'((PFN{api}{proc}PROC)egl_lazy_resolve(EGL_LAZY_{prefix}{name}))({args})'
+        stmt = call if ret == 'void' else 'return ' + call
+
+        print(f'static {ret} {entry}', file=f)
+        print(f'egl_lazy_{prefix}{name}({params})', file=f)
+        print('{', file=f)
+        print(f'    {stmt};', file=f)
+        print('}', file=f)
+        print(file=f)
@@ -67,6 +67,7 @@ struct image_test {
     uint32_t height;
     bool planar;
     bool nearest;
+    bool import;
 
     struct egl egl;
 
@@ -78,6 +79,32 @@ struct image_test {
     struct egl_image *img;
 };
 
+/* This imports the dma-bufs of src as a new image, as a decoder would hand
+ * them over.
+ */
+static struct egl_image *
+image_test_reimport(struct image_test *test, const struct egl_image *src)
+{
+#ifdef __ANDROID__
+    egl_die("no dma-buf import support");
+#else
+    struct gbm_bo *bo = src->storage.bo;
+    struct gbm_import_fd_modifier_data data = {
+        .num_fds = gbm_bo_get_plane_count(bo),
+        .modifier = gbm_bo_get_modifier(bo),
+    };
+    for (uint32_t i = 0; i < data.num_fds; i++) {
+        data.fds[i] = src->storage.fds[src->storage.disjoint ? i : 0];
+        data.strides[i] = gbm_bo_get_stride_for_plane(bo, i);
+        data.offsets[i] = gbm_bo_get_offset(bo, i);
+    }
+
+    egl_log("re-importing %u %s dma-bufs", src->storage.fd_count,
+            src->storage.disjoint ? "disjoint" : "shared");
+    return egl_import_image(&test->egl, &src->info, &data);
+#endif
+}
+
 static void
 image_test_init(struct image_test *test)
 {
@@ -90,7 +117,7 @@ image_test_init(struct image_test *test)
     };
     egl_init(egl, &params);
 
-    if (!strstr(egl->gl_exts, "GL_OES_EGL_image_external"))
+    if (!egl_has_ext(egl, GL_OES_EGL_image_external))
         egl_die("no GL_OES_EGL_image_external");
 
     test->tex_target = GL_TEXTURE_EXTERNAL_OES;
@@ -108,6 +135,11 @@ image_test_init(struct image_test *test)
     egl_log("loading ppm as a %s image", test->planar ? "planar" : "non-planar");
     test->img =
         egl_create_image_from_ppm(egl, image_test_ppm, sizeof(image_test_ppm), test->planar);
+    if (test->import) {
+        struct egl_image *img = image_test_reimport(test, test->img);
+        egl_destroy_image(egl, test->img);
+        test->img = img;
+    }
     gl->EGLImageTargetTexture2DOES(test->tex_target, test->img->img);
 
     egl_check(egl, "init");
@@ -169,6 +201,8 @@ main(int argc, const char **argv)
             test.planar = true;
         else if (!strcmp(argv[i], "nearest"))
             test.nearest = true;
+        else if (!strcmp(argv[i], "import"))
+            test.import = true;
         else
             egl_die("unknown option %s", argv[i]);
     }
@@ -0,0 +1,581 @@
+/*
+ * Copyright 2022 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+/* This measures per-frame image allocation strategies, import and mapping
+ * paths, and layered images.
+ */
+
+#include "eglutil.h"
+
+/* images in flight, like a swapchain */
+#define IMAGE_BENCH_FLIGHT_COUNT 3
+
+/* layers of an atlas, and its layer size */
+#define IMAGE_BENCH_LAYER_COUNT 16
+#define IMAGE_BENCH_LAYER_SIZE 256
+
+enum image_bench_mode {
+    IMAGE_BENCH_POOL,
+    IMAGE_BENCH_IMPORT,
+    IMAGE_BENCH_EXPORT,
+    IMAGE_BENCH_MAP,
+    IMAGE_BENCH_DMA_BUF,
+    IMAGE_BENCH_LAYERED,
+
+    IMAGE_BENCH_MODE_COUNT,
+};
+
+static const char *const image_bench_mode_names[IMAGE_BENCH_MODE_COUNT] = {
+    [IMAGE_BENCH_POOL] = "pool",
+    [IMAGE_BENCH_IMPORT] = "import",
+    [IMAGE_BENCH_EXPORT] = "export",
+    [IMAGE_BENCH_MAP] = "map",
+    [IMAGE_BENCH_DMA_BUF] = "dma-buf",
+    [IMAGE_BENCH_LAYERED] = "layered",
+};
+
+struct image_bench {
+    uint32_t width;
+    uint32_t height;
+    int frame_count;
+
+    struct egl egl;
+};
+
+static void
+image_bench_init(struct image_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+
+    egl_init(egl, NULL);
+    egl_check(egl, "init");
+}
+
+static void
+image_bench_cleanup(struct image_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+
+    egl_check(egl, "cleanup");
+
+    egl_cleanup(egl);
+}
+
+static void
+image_bench_draw(struct image_bench *bench, struct egl_image *img)
+{
+    struct egl *egl = &bench->egl;
+    struct egl_gl *gl = &egl->gl;
+
+    GLuint tex;
+    gl->GenTextures(1, &tex);
+    gl->BindTexture(GL_TEXTURE_2D, tex);
+    gl->EGLImageTargetTexture2DOES(GL_TEXTURE_2D, img->img);
+    gl->BindTexture(GL_TEXTURE_2D, 0);
+
+    GLuint fbo;
+    gl->GenFramebuffers(1, &fbo);
+    gl->BindFramebuffer(GL_FRAMEBUFFER, fbo);
+    gl->FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex, 0);
+    if (gl->CheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        egl_die("incomplete fbo");
+
+    gl->Viewport(0, 0, bench->width, bench->height);
+    gl->Clear(GL_COLOR_BUFFER_BIT);
+
+    gl->BindFramebuffer(GL_FRAMEBUFFER, 0);
+    gl->DeleteFramebuffers(1, &fbo);
+    gl->DeleteTextures(1, &tex);
+
+    gl->Flush();
+}
+
+static double
+image_bench_run_pool(struct image_bench *bench, struct egl_image_pool *pool)
+{
+    struct egl *egl = &bench->egl;
+    struct egl_gl *gl = &egl->gl;
+
+    const struct egl_image_info info = {
+        .width = bench->width,
+        .height = bench->height,
+        .drm_format = DRM_FORMAT_ABGR8888,
+        .rendering = true,
+        .sampling = true,
+    };
+    struct egl_image *imgs[IMAGE_BENCH_FLIGHT_COUNT] = { 0 };
+
+    const uint64_t begin = egl_get_time_ns();
+    for (int i = 0; i < bench->frame_count; i++) {
+        struct egl_image **img = &imgs[i % IMAGE_BENCH_FLIGHT_COUNT];
+
+        /* retire the oldest frame */
+        if (*img) {
+            if (pool)
+                egl_release_image(egl, pool, *img);
+            else
+                egl_destroy_image(egl, *img);
+        }
+
+        *img = pool ? egl_acquire_image(egl, pool, &info) : egl_create_image(egl, &info);
+        image_bench_draw(bench, *img);
+    }
+    gl->Finish();
+    const uint64_t end = egl_get_time_ns();
+
+    egl_check(egl, "pool");
+
+    for (int i = 0; i < IMAGE_BENCH_FLIGHT_COUNT; i++) {
+        if (imgs[i])
+            egl_destroy_image(egl, imgs[i]);
+    }
+
+    return bench->frame_count * 1e9 / (end - begin);
+}
+
+static void
+image_bench_pool(struct image_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+
+    const double churn_fps = image_bench_run_pool(bench, NULL);
+
+    struct egl_image_pool *pool = egl_create_image_pool(egl, IMAGE_BENCH_FLIGHT_COUNT);
+    const double pool_fps = image_bench_run_pool(bench, pool);
+
+    egl_log("create/destroy: %.1f fps", churn_fps);
+    egl_log("pooled: %.1f fps (%.2fx), %d hits, %d misses, %d trims", pool_fps,
+            pool_fps / churn_fps, pool->hit_count, pool->miss_count, pool->trim_count);
+
+    egl_destroy_image_pool(egl, pool);
+}
+
+static void
+image_bench_import(struct image_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+
+    const struct egl_image_info info = {
+        .width = bench->width,
+        .height = bench->height,
+        .drm_format = DRM_FORMAT_ABGR8888,
+        .rendering = true,
+        .sampling = true,
+    };
+    struct egl_image *img = egl_create_image(egl, &info);
+
+    /* re-import while the EGLImage is alive, as another component would */
+    const int hit_count = egl->imports.hit_count;
+    uint64_t begin = egl_get_time_ns();
+    for (int i = 0; i < bench->frame_count; i++) {
+        struct egl_image view = *img;
+        egl_wrap_image_storage(egl, &view);
+        egl_unwrap_image_storage(egl, &view);
+    }
+    const uint64_t hit_ns = egl_get_time_ns() - begin;
+
+    /* import after the last EGLImage is gone */
+    const int miss_count = egl->imports.miss_count;
+    begin = egl_get_time_ns();
+    for (int i = 0; i < bench->frame_count; i++) {
+        egl_unwrap_image_storage(egl, img);
+        egl_wrap_image_storage(egl, img);
+    }
+    const uint64_t miss_ns = egl_get_time_ns() - begin;
+
+    egl_check(egl, "import");
+
+    egl_log("cached import: %.1fus (%d hits)", hit_ns / 1000.0 / bench->frame_count,
+            egl->imports.hit_count - hit_count);
+    egl_log("eglCreateImage: %.1fus (%d misses)", miss_ns / 1000.0 / bench->frame_count,
+            egl->imports.miss_count - miss_count);
+
+    egl_destroy_image(egl, img);
+}
+
+static uint64_t
+image_bench_run_export(struct image_bench *bench,
+                       struct egl_image *img,
+                       bool cached,
+                       int *export_count)
+{
+    struct egl *egl = &bench->egl;
+
+    *export_count = 0;
+
+    const uint64_t begin = egl_get_time_ns();
+    for (int i = 0; i < bench->frame_count; i++) {
+        egl_unwrap_image_storage(egl, img);
+
+#ifndef __ANDROID__
+        /* drop the exported fds to export again, as every wrap used to; each
+         * fd is a PRIME export and a close
+         */
+        if (!cached) {
+            for (int j = 0; j < img->storage.fd_count; j++)
+                close(img->storage.fds[j]);
+            *export_count += img->storage.fd_count;
+            img->storage.fd_count = 0;
+        }
+#endif
+
+        egl_wrap_image_storage(egl, img);
+    }
+    const uint64_t end = egl_get_time_ns();
+
+    egl_check(egl, "export");
+
+    return end - begin;
+}
+
+static void
+image_bench_export(struct image_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+
+    const struct egl_image_info info = {
+        .width = bench->width,
+        .height = bench->height,
+        .drm_format = DRM_FORMAT_ABGR8888,
+        .rendering = true,
+        .sampling = true,
+    };
+    struct egl_image *img = egl_create_image(egl, &info);
+
+    int uncached_count;
+    int cached_count;
+    const uint64_t uncached_ns = image_bench_run_export(bench, img, false, &uncached_count);
+    const uint64_t cached_ns = image_bench_run_export(bench, img, true, &cached_count);
+
+    egl_log("export per wrap: %.1fus", uncached_ns / 1000.0 / bench->frame_count);
+    egl_log("cached export: %.1fus, %d fd exports and closes skipped",
+            cached_ns / 1000.0 / bench->frame_count, uncached_count - cached_count);
+
+    egl_destroy_image(egl, img);
+}
+
+enum image_bench_map_test {
+    IMAGE_BENCH_MAP_UPLOAD_RW,
+    IMAGE_BENCH_MAP_UPLOAD_W,
+    IMAGE_BENCH_MAP_UPLOAD_SUBRECT,
+    IMAGE_BENCH_MAP_UPLOAD_PERSISTENT,
+    IMAGE_BENCH_MAP_READBACK_RW,
+    IMAGE_BENCH_MAP_READBACK_R,
+
+    IMAGE_BENCH_MAP_TEST_COUNT,
+};
+
+static const char *const image_bench_map_test_names[IMAGE_BENCH_MAP_TEST_COUNT] = {
+    [IMAGE_BENCH_MAP_UPLOAD_RW] = "upload read-write",
+    [IMAGE_BENCH_MAP_UPLOAD_W] = "upload write-only",
+    [IMAGE_BENCH_MAP_UPLOAD_SUBRECT] = "upload quarter write-only",
+    [IMAGE_BENCH_MAP_UPLOAD_PERSISTENT] = "upload persistent",
+    [IMAGE_BENCH_MAP_READBACK_RW] = "readback read-write",
+    [IMAGE_BENCH_MAP_READBACK_R] = "readback read-only",
+};
+
+static double
+image_bench_run_map(struct image_bench *bench,
+                    struct egl_image *img,
+                    enum image_bench_map_test test,
+                    uint32_t extra_flags)
+{
+    struct egl *egl = &bench->egl;
+    int width = bench->width;
+    int height = bench->height;
+    uint32_t flags;
+    bool write = true;
+
+    switch (test) {
+    case IMAGE_BENCH_MAP_UPLOAD_RW:
+        flags = EGL_IMAGE_MAP_READ | EGL_IMAGE_MAP_WRITE;
+        break;
+    case IMAGE_BENCH_MAP_UPLOAD_W:
+        flags = EGL_IMAGE_MAP_WRITE;
+        break;
+    case IMAGE_BENCH_MAP_UPLOAD_SUBRECT:
+        width /= 2;
+        height /= 2;
+        flags = EGL_IMAGE_MAP_WRITE;
+        break;
+    case IMAGE_BENCH_MAP_UPLOAD_PERSISTENT:
+        flags = EGL_IMAGE_MAP_WRITE | EGL_IMAGE_MAP_PERSISTENT;
+        break;
+    case IMAGE_BENCH_MAP_READBACK_RW:
+        flags = EGL_IMAGE_MAP_READ | EGL_IMAGE_MAP_WRITE;
+        write = false;
+        break;
+    case IMAGE_BENCH_MAP_READBACK_R:
+    default:
+        flags = EGL_IMAGE_MAP_READ;
+        write = false;
+        break;
+    }
+
+    volatile uint64_t sum = 0;
+    size_t size = 0;
+
+    const uint64_t begin = egl_get_time_ns();
+    for (int i = 0; i < bench->frame_count; i++) {
+        struct egl_image_map map;
+        egl_map_image_region(egl, img, 0, 0, width, height, flags | extra_flags, &map);
+
+        const size_t row_size = (size_t)map.pixel_strides[0] * width;
+        for (int y = 0; y < height; y++) {
+            uint8_t *row = map.planes[0] + (size_t)map.row_strides[0] * y;
+            if (write) {
+                memset(row, i, row_size);
+            } else {
+                uint64_t s = 0;
+                for (size_t x = 0; x + 8 <= row_size; x += 8) {
+                    uint64_t v;
+                    memcpy(&v, row + x, sizeof(v));
+                    s += v;
+                }
+                sum += s;
+            }
+        }
+        size += row_size * height;
+
+        egl_unmap_image_storage(egl, img, &map);
+    }
+    /* a persistent map starts the CPU access once and ends it here */
+    if ((flags | extra_flags) & EGL_IMAGE_MAP_PERSISTENT)
+        egl_release_image_mapping(egl, img);
+    const uint64_t end = egl_get_time_ns();
+
+    return size / 1e6 / ((end - begin) / 1e9);
+}
+
+static void
+image_bench_map(struct image_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+
+    const struct egl_format *fmt = egl_find_format(egl, DRM_FORMAT_ABGR8888);
+    if (!fmt)
+        egl_die("no ABGR8888 support");
+
+    /* the first tiled modifier that is neither compressed nor external */
+    uint64_t tiled_modifier = DRM_FORMAT_MOD_INVALID;
+    for (int i = 0; i < fmt->drm_modifier_count; i++) {
+        const uint64_t mod = fmt->drm_modifiers[i];
+        if (mod != DRM_FORMAT_MOD_LINEAR && !fmt->external_only[i] &&
+            !egl_drm_modifier_is_compressed(mod)) {
+            tiled_modifier = mod;
+            break;
+        }
+    }
+
+    for (int i = 0; i < 2; i++) {
+        const bool linear = !i;
+        if (!linear && tiled_modifier == DRM_FORMAT_MOD_INVALID) {
+            egl_log("no tiled modifier");
+            break;
+        }
+
+        const struct egl_image_info info = {
+            .width = bench->width,
+            .height = bench->height,
+            .drm_format = DRM_FORMAT_ABGR8888,
+            .mapping = true,
+            .sampling = true,
+            .force_modifier = true,
+            .drm_modifier = linear ? DRM_FORMAT_MOD_LINEAR : tiled_modifier,
+        };
+        struct egl_image *img = egl_create_image(egl, &info);
+
+        for (int j = 0; j < IMAGE_BENCH_MAP_TEST_COUNT; j++) {
+            /* tiled images cannot be mapped persistently */
+            if (!linear && j == IMAGE_BENCH_MAP_UPLOAD_PERSISTENT)
+                continue;
+
+            const double mb_s = image_bench_run_map(bench, img, j, 0);
+            egl_log("%s %s: %.1f MB/s", linear ? "linear" : "tiled",
+                    image_bench_map_test_names[j], mb_s);
+        }
+
+        egl_destroy_image(egl, img);
+    }
+
+    egl_check(egl, "map");
+}
+
+static void
+image_bench_dma_buf(struct image_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+
+    const struct egl_image_info info = {
+        .width = bench->width,
+        .height = bench->height,
+        .drm_format = DRM_FORMAT_ABGR8888,
+        .mapping = true,
+        .sampling = true,
+        .force_linear = true,
+    };
+    struct egl_image *img = egl_create_image(egl, &info);
+
+    /* direct dma-buf mmap versus gbm_bo_map on the same linear image */
+    const enum image_bench_map_test tests[] = {
+        IMAGE_BENCH_MAP_UPLOAD_W,
+        IMAGE_BENCH_MAP_READBACK_R,
+    };
+    for (uint32_t i = 0; i < ARRAY_SIZE(tests); i++) {
+        const double direct_mb_s = image_bench_run_map(bench, img, tests[i], 0);
+        const double gbm_mb_s =
+            image_bench_run_map(bench, img, tests[i], EGL_IMAGE_MAP_NO_DMA_BUF);
+        egl_log("%s: dma-buf %.1f MB/s, gbm_bo_map %.1f MB/s (%.2fx)",
+                image_bench_map_test_names[tests[i]], direct_mb_s, gbm_mb_s,
+                direct_mb_s / gbm_mb_s);
+    }
+
+    egl_destroy_image(egl, img);
+
+    egl_check(egl, "dma-buf");
+}
+
+/* This creates the textures of all layers, from either one layered image or
+ * separate images.
+ */
+static void
+image_bench_create_layers(struct image_bench *bench,
+                          bool layered,
+                          struct egl_image **imgs,
+                          GLuint *texs)
+{
+    struct egl *egl = &bench->egl;
+    struct egl_gl *gl = &egl->gl;
+
+    const struct egl_image_info info = {
+        .width = IMAGE_BENCH_LAYER_SIZE,
+        .height = IMAGE_BENCH_LAYER_SIZE,
+        .drm_format = DRM_FORMAT_ABGR8888,
+        .rendering = true,
+        .sampling = true,
+        .force_linear = true,
+        .layer_count = layered ? IMAGE_BENCH_LAYER_COUNT : 1,
+    };
+
+    if (layered)
+        imgs[0] = egl_create_image(egl, &info);
+
+    gl->GenTextures(IMAGE_BENCH_LAYER_COUNT, texs);
+    for (int i = 0; i < IMAGE_BENCH_LAYER_COUNT; i++) {
+        EGLImage view;
+        if (layered) {
+            view = egl_get_image_view(egl, imgs[0], i, 0);
+        } else {
+            imgs[i] = egl_create_image(egl, &info);
+            view = imgs[i]->img;
+        }
+
+        gl->BindTexture(GL_TEXTURE_2D, texs[i]);
+        gl->EGLImageTargetTexture2DOES(GL_TEXTURE_2D, view);
+    }
+    gl->BindTexture(GL_TEXTURE_2D, 0);
+}
+
+static void
+image_bench_destroy_layers(struct image_bench *bench,
+                           bool layered,
+                           struct egl_image **imgs,
+                           GLuint *texs)
+{
+    struct egl *egl = &bench->egl;
+    struct egl_gl *gl = &egl->gl;
+
+    gl->DeleteTextures(IMAGE_BENCH_LAYER_COUNT, texs);
+    for (int i = 0; i < (layered ? 1 : IMAGE_BENCH_LAYER_COUNT); i++)
+        egl_destroy_image(egl, imgs[i]);
+}
+
+/* This compares allocating and wrapping the layers of one layered image
+ * against separate images.  Both end up as GL_TEXTURE_2D views, because an
+ * EGLImage of a dma-buf can only be a 2D texture, so sampling is the same and
+ * is not measured.
+ */
+static void
+image_bench_layered(struct image_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+
+    for (int i = 0; i < 2; i++) {
+        const bool layered = !i;
+        struct egl_image *imgs[IMAGE_BENCH_LAYER_COUNT];
+        GLuint texs[IMAGE_BENCH_LAYER_COUNT];
+
+        const uint64_t begin = egl_get_time_ns();
+        for (int j = 0; j < bench->frame_count; j++) {
+            image_bench_create_layers(bench, layered, imgs, texs);
+            image_bench_destroy_layers(bench, layered, imgs, texs);
+        }
+        const uint64_t alloc_ns = egl_get_time_ns() - begin;
+
+        egl_check(egl, "layered");
+
+        egl_log("%s: %.1fus to allocate %d layers", layered ? "layered image" : "separate images",
+                alloc_ns / 1000.0 / bench->frame_count, IMAGE_BENCH_LAYER_COUNT);
+    }
+}
+
+int
+main(int argc, const char **argv)
+{
+    struct image_bench bench = {
+        .width = 1280,
+        .height = 720,
+        .frame_count = 300,
+    };
+
+    int mode = -1;
+    if (argc > 1) {
+        for (int i = 0; i < IMAGE_BENCH_MODE_COUNT; i++) {
+            if (!strcmp(argv[1], image_bench_mode_names[i]))
+                mode = i;
+        }
+        if (mode < 0)
+            egl_die("unknown mode %s", argv[1]);
+    }
+    if (argc > 2)
+        bench.frame_count = atoi(argv[2]);
+    if (bench.frame_count <= 0)
+        egl_die("bad frame count");
+
+    image_bench_init(&bench);
+
+    for (int i = 0; i < IMAGE_BENCH_MODE_COUNT; i++) {
+        if (mode >= 0 && mode != i)
+            continue;
+
+        egl_log("mode %s", image_bench_mode_names[i]);
+        switch (i) {
+        case IMAGE_BENCH_POOL:
+            image_bench_pool(&bench);
+            break;
+        case IMAGE_BENCH_IMPORT:
+            image_bench_import(&bench);
+            break;
+        case IMAGE_BENCH_EXPORT:
+            image_bench_export(&bench);
+            break;
+        case IMAGE_BENCH_MAP:
+            image_bench_map(&bench);
+            break;
+        case IMAGE_BENCH_DMA_BUF:
+            image_bench_dma_buf(&bench);
+            break;
+        case IMAGE_BENCH_LAYERED:
+            image_bench_layered(&bench);
+            break;
+        default:
+            break;
+        }
+    }
+
+    image_bench_cleanup(&bench);
+
+    return 0;
+}
@@ -24,6 +24,9 @@ main(void)
     egl_log("GL_VERSION: %s", egl.gl.GetString(GL_VERSION));
     egl_log("GL_SHADING_LANGUAGE_VERSION: %s", egl.gl.GetString(GL_SHADING_LANGUAGE_VERSION));
     egl_log("GL_EXTENSIONS: %s", egl.gl.GetString(GL_EXTENSIONS));
+    egl_log("--");
+    egl_log("init profile:");
+    egl_dump_init_profile(&egl, stdout);
 
     egl_cleanup(&egl);
 
@@ -0,0 +1,112 @@
+/*
+ * Copyright 2022 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+/* This runs egl_init/egl_cleanup repeatedly and reports per-phase stats as
+ * JSON on stdout.
+ */
+
+#include "eglutil.h"
+
+struct init_bench {
+    int iterations;
+    bool lazy_dispatch;
+
+    /* indexed by [phase][iteration]; the last phase is the total */
+    uint64_t *durations[EGL_INIT_PHASE_COUNT + 1];
+};
+
+static void
+init_bench_init(struct init_bench *bench)
+{
+    for (int i = 0; i < EGL_INIT_PHASE_COUNT + 1; i++) {
+        bench->durations[i] = calloc(bench->iterations, sizeof(*bench->durations[i]));
+        if (!bench->durations[i])
+            egl_die("failed to alloc durations");
+    }
+}
+
+static void
+init_bench_cleanup(struct init_bench *bench)
+{
+    for (int i = 0; i < EGL_INIT_PHASE_COUNT + 1; i++)
+        free(bench->durations[i]);
+}
+
+static void
+init_bench_run(struct init_bench *bench)
+{
+    const struct egl_init_params params = {
+        .lazy_dispatch = bench->lazy_dispatch,
+    };
+
+    for (int i = 0; i < bench->iterations; i++) {
+        struct egl egl;
+        egl_init(&egl, &params);
+
+        uint64_t total = 0;
+        for (int j = 0; j < EGL_INIT_PHASE_COUNT; j++) {
+            bench->durations[j][i] = egl.init_phase_ns[j];
+            total += egl.init_phase_ns[j];
+        }
+        bench->durations[EGL_INIT_PHASE_COUNT][i] = total;
+
+        egl_cleanup(&egl);
+    }
+}
+
+static int
+init_bench_compare(const void *a, const void *b)
+{
+    const uint64_t *x = a;
+    const uint64_t *y = b;
+    return *x < *y ? -1 : *x > *y;
+}
+
+static void
+init_bench_report(struct init_bench *bench)
+{
+    const int n = bench->iterations;
+
+    printf("{\"iterations\": %d, \"unit\": \"us\", \"phases\": {", n);
+    for (int i = 0; i < EGL_INIT_PHASE_COUNT + 1; i++) {
+        uint64_t *durations = bench->durations[i];
+        qsort(durations, n, sizeof(*durations), init_bench_compare);
+
+        const int p99 = (n * 99 + 99) / 100 - 1;
+        printf("%s\"%s\": {\"min\": %.1f, \"median\": %.1f, \"p99\": %.1f}", i ? ", " : "",
+               i < EGL_INIT_PHASE_COUNT ? egl_init_phase_names[i] : "total",
+               durations[0] / 1000.0, durations[n / 2] / 1000.0, durations[p99] / 1000.0);
+    }
+    printf("}}\n");
+}
+
+int
+main(int argc, const char **argv)
+{
+    struct init_bench bench = {
+        .iterations = 20,
+    };
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "lazy"))
+            bench.lazy_dispatch = true;
+        else if (atoi(argv[i]) > 0)
+            bench.iterations = atoi(argv[i]);
+        else
+            egl_die("unknown option %s", argv[i]);
+    }
+
+    init_bench_init(&bench);
+
+    /* keep stdout valid JSON and stdio out of the timings */
+    egl_log_set_quiet(true);
+    init_bench_run(&bench);
+    egl_log_set_quiet(false);
+
+    init_bench_report(&bench);
+    init_bench_cleanup(&bench);
+
+    return 0;
+}
@@ -0,0 +1,334 @@
+/*
+ * Copyright 2022 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+/* This measures how egl_job_scheduler scales from 1 to N workers on a batch
+ * of independent render jobs.  Before that, a batch of upload -> render ->
+ * readback chains checks that dependencies are honored across workers.
+ */
+
+#include "eglutil.h"
+
+#define JOB_BENCH_MAX_WORKER_COUNT 16
+
+static const char job_bench_vs[] = {
+#include "job_bench_test.vert.inc"
+};
+
+static const char job_bench_fs[] = {
+#include "job_bench_test.frag.inc"
+};
+
+static const float job_bench_vertices[4][2] = {
+    { -1.0f, -1.0f },
+    { 1.0f, -1.0f },
+    { -1.0f, 1.0f },
+    { 1.0f, 1.0f },
+};
+
+struct job_bench;
+
+struct job_bench_job {
+    struct job_bench *bench;
+    int index;
+
+    /* set by readback jobs */
+    bool mismatch;
+};
+
+struct job_bench {
+    int max_worker_count;
+    int job_count;
+    int draw_count;
+    uint32_t size;
+
+    struct egl egl;
+    struct egl_program *prog;
+
+    /* one src and one dst texture per job */
+    GLuint *src_texs;
+    GLuint *dst_texs;
+
+    struct job_bench_job *job_data;
+    struct egl_job *jobs;
+    int *deps;
+};
+
+static uint32_t
+job_bench_color(int index)
+{
+    return 0xff000000 | (uint32_t)(index * 0x10203) % 0xffffff;
+}
+
+static void
+job_bench_init(struct job_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+    struct egl_gl *gl = &egl->gl;
+
+    egl_init(egl, NULL);
+
+    bench->prog = egl_create_program(egl, job_bench_vs, job_bench_fs);
+
+    bench->src_texs = calloc(bench->job_count, sizeof(*bench->src_texs));
+    bench->dst_texs = calloc(bench->job_count, sizeof(*bench->dst_texs));
+    bench->job_data = calloc(bench->job_count, sizeof(*bench->job_data));
+    bench->jobs = calloc(bench->job_count * 3, sizeof(*bench->jobs));
+    bench->deps = calloc(bench->job_count * 3, sizeof(*bench->deps));
+    if (!bench->src_texs || !bench->dst_texs || !bench->job_data || !bench->jobs ||
+        !bench->deps)
+        egl_die("failed to alloc jobs");
+
+    /* textures are shared with the worker contexts; fbos are not */
+    GLuint *texs[2] = { bench->src_texs, bench->dst_texs };
+    for (int i = 0; i < 2; i++) {
+        gl->GenTextures(bench->job_count, texs[i]);
+        for (int j = 0; j < bench->job_count; j++) {
+            gl->BindTexture(GL_TEXTURE_2D, texs[i][j]);
+            gl->TexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, bench->size, bench->size);
+        }
+    }
+    gl->BindTexture(GL_TEXTURE_2D, 0);
+
+    for (int i = 0; i < bench->job_count; i++) {
+        bench->job_data[i] = (struct job_bench_job){
+            .bench = bench,
+            .index = i,
+        };
+    }
+
+    /* make everything visible to the workers */
+    gl->Finish();
+
+    egl_check(egl, "init");
+}
+
+static void
+job_bench_cleanup(struct job_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+    struct egl_gl *gl = &egl->gl;
+
+    egl_check(egl, "cleanup");
+
+    gl->DeleteTextures(bench->job_count, bench->dst_texs);
+    gl->DeleteTextures(bench->job_count, bench->src_texs);
+    free(bench->deps);
+    free(bench->jobs);
+    free(bench->job_data);
+    free(bench->dst_texs);
+    free(bench->src_texs);
+
+    egl_destroy_program(egl, bench->prog);
+    egl_cleanup(egl);
+}
+
+static GLuint
+job_bench_bind_fbo(struct egl *egl, GLuint tex)
+{
+    struct egl_gl *gl = &egl->gl;
+
+    GLuint fbo;
+    gl->GenFramebuffers(1, &fbo);
+    gl->BindFramebuffer(GL_FRAMEBUFFER, fbo);
+    gl->FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex, 0);
+    if (gl->CheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        egl_die("incomplete fbo");
+
+    return fbo;
+}
+
+static void
+job_bench_unbind_fbo(struct egl *egl, GLuint fbo)
+{
+    struct egl_gl *gl = &egl->gl;
+
+    gl->BindFramebuffer(GL_FRAMEBUFFER, 0);
+    gl->DeleteFramebuffers(1, &fbo);
+}
+
+static void
+job_bench_upload(struct egl *egl, int worker, void *data)
+{
+    struct job_bench_job *job = data;
+    struct job_bench *bench = job->bench;
+    struct egl_gl *gl = &egl->gl;
+
+    const uint32_t color = job_bench_color(job->index);
+    uint32_t *texels = malloc(sizeof(*texels) * bench->size * bench->size);
+    if (!texels)
+        egl_die("failed to alloc texels");
+    for (uint32_t i = 0; i < bench->size * bench->size; i++)
+        texels[i] = color;
+
+    gl->BindTexture(GL_TEXTURE_2D, bench->src_texs[job->index]);
+    gl->TexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, bench->size, bench->size, GL_RGBA,
+                      GL_UNSIGNED_BYTE, texels);
+    gl->BindTexture(GL_TEXTURE_2D, 0);
+
+    free(texels);
+}
+
+static void
+job_bench_render(struct egl *egl, int worker, void *data)
+{
+    struct job_bench_job *job = data;
+    struct job_bench *bench = job->bench;
+    struct egl_gl *gl = &egl->gl;
+
+    const GLuint fbo = job_bench_bind_fbo(egl, bench->dst_texs[job->index]);
+    gl->Viewport(0, 0, bench->size, bench->size);
+
+    gl->UseProgram(bench->prog->prog);
+    gl->ActiveTexture(GL_TEXTURE0);
+    gl->BindTexture(GL_TEXTURE_2D, bench->src_texs[job->index]);
+    gl->VertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, job_bench_vertices);
+    gl->EnableVertexAttribArray(0);
+
+    for (int i = 0; i < bench->draw_count; i++)
+        gl->DrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+    job_bench_unbind_fbo(egl, fbo);
+}
+
+static void
+job_bench_readback(struct egl *egl, int worker, void *data)
+{
+    struct job_bench_job *job = data;
+    struct job_bench *bench = job->bench;
+    struct egl_gl *gl = &egl->gl;
+
+    const GLuint fbo = job_bench_bind_fbo(egl, bench->dst_texs[job->index]);
+
+    uint32_t texel;
+    gl->ReadPixels(bench->size / 2, bench->size / 2, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, &texel);
+    job->mismatch = texel != job_bench_color(job->index);
+
+    job_bench_unbind_fbo(egl, fbo);
+}
+
+static void
+job_bench_check_deps(struct job_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+
+    /* job 3i uploads, 3i+1 renders, and 3i+2 reads back */
+    for (int i = 0; i < bench->job_count; i++) {
+        struct egl_job *jobs = &bench->jobs[i * 3];
+        int *deps = &bench->deps[i * 3];
+
+        deps[0] = i * 3;
+        deps[1] = i * 3 + 1;
+
+        jobs[0] = (struct egl_job){
+            .func = job_bench_upload,
+            .data = &bench->job_data[i],
+        };
+        jobs[1] = (struct egl_job){
+            .func = job_bench_render,
+            .data = &bench->job_data[i],
+            .dep_count = 1,
+            .deps = &deps[0],
+        };
+        jobs[2] = (struct egl_job){
+            .func = job_bench_readback,
+            .data = &bench->job_data[i],
+            .dep_count = 1,
+            .deps = &deps[1],
+        };
+    }
+
+    struct egl_job_scheduler *sched = egl_create_job_scheduler(egl, bench->max_worker_count);
+    egl_run_jobs(egl, sched, bench->jobs, bench->job_count * 3);
+
+    int steal_count = 0;
+    for (int i = 0; i < sched->worker_count; i++)
+        steal_count += sched->workers[i].steal_count;
+    egl_destroy_job_scheduler(egl, sched);
+
+    for (int i = 0; i < bench->job_count; i++) {
+        if (bench->job_data[i].mismatch)
+            egl_die("chain %d read back a stale texel", i);
+    }
+
+    egl_log("%d upload -> render -> readback chains on %d workers: ok, %d steals",
+            bench->job_count, bench->max_worker_count, steal_count);
+}
+
+static void
+job_bench_run(struct job_bench *bench, int worker_count, double *base_ms)
+{
+    struct egl *egl = &bench->egl;
+
+    for (int i = 0; i < bench->job_count; i++) {
+        bench->jobs[i] = (struct egl_job){
+            .func = job_bench_render,
+            .data = &bench->job_data[i],
+        };
+    }
+
+    struct egl_job_scheduler *sched = egl_create_job_scheduler(egl, worker_count);
+
+    /* warm up */
+    egl_run_jobs(egl, sched, bench->jobs, bench->job_count);
+
+    const uint64_t begin = egl_get_time_ns();
+    egl_run_jobs(egl, sched, bench->jobs, bench->job_count);
+    const uint64_t end = egl_get_time_ns();
+
+    int min_job_count = bench->job_count;
+    int max_job_count = 0;
+    int steal_count = 0;
+    for (int i = 0; i < sched->worker_count; i++) {
+        const struct egl_job_worker *worker = &sched->workers[i];
+        if (min_job_count > worker->job_count)
+            min_job_count = worker->job_count;
+        if (max_job_count < worker->job_count)
+            max_job_count = worker->job_count;
+        steal_count += worker->steal_count;
+    }
+
+    egl_destroy_job_scheduler(egl, sched);
+
+    const double ms = (end - begin) / 1000000.0;
+    if (worker_count == 1)
+        *base_ms = ms;
+
+    egl_log("%2d workers: %.2fms, %.1f jobs/s, %.2fx speedup, %d-%d jobs per worker, %d steals",
+            worker_count, ms, bench->job_count * 1000.0 / ms, *base_ms / ms, min_job_count,
+            max_job_count, steal_count);
+}
+
+int
+main(int argc, const char **argv)
+{
+    struct job_bench bench = {
+        .max_worker_count = 4,
+        .job_count = 64,
+        .draw_count = 16,
+        .size = 256,
+    };
+
+    if (argc > 1)
+        bench.max_worker_count = atoi(argv[1]);
+    if (argc > 2)
+        bench.job_count = atoi(argv[2]);
+    if (argc > 3)
+        bench.draw_count = atoi(argv[3]);
+    if (bench.max_worker_count <= 0 || bench.max_worker_count > JOB_BENCH_MAX_WORKER_COUNT ||
+        bench.job_count <= 0 || bench.draw_count <= 0)
+        egl_die("bad worker, job, or draw count");
+
+    job_bench_init(&bench);
+
+    job_bench_check_deps(&bench);
+
+    double base_ms = 0.0;
+    for (int i = 1; i <= bench.max_worker_count; i++)
+        job_bench_run(&bench, i, &base_ms);
+
+    job_bench_cleanup(&bench);
+
+    return 0;
+}
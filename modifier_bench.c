@@ -0,0 +1,436 @@
+/*
+ * Copyright 2022 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+/* This measures every (format, modifier) pair from egl_init_formats: clear
+ * fill-rate, textured draws into the image, sampling from the image, and CPU
+ * map bandwidth of the first plane.  Results are written as CSV, or JSON when
+ * the output path ends with ".json".
+ */
+
+#include "eglutil.h"
+
+static const char modifier_bench_vs[] = {
+#include "modifier_bench_test.vert.inc"
+};
+
+static const char modifier_bench_fs[] = {
+#include "modifier_bench_test.frag.inc"
+};
+
+static const float modifier_bench_vertices[4][8] = {
+    {
+        -1.0f, /* x */
+        -1.0f, /* y */
+        0.0f,  /* u */
+        0.0f,  /* v */
+        1.0f,  /* r */
+        1.0f,  /* g */
+        1.0f,  /* b */
+        1.0f,  /* a */
+    },
+    {
+        1.0f,
+        -1.0f,
+        1.0f,
+        0.0f,
+        1.0f,
+        1.0f,
+        1.0f,
+        1.0f,
+    },
+    {
+        -1.0f,
+        1.0f,
+        0.0f,
+        1.0f,
+        1.0f,
+        1.0f,
+        1.0f,
+        1.0f,
+    },
+    {
+        1.0f,
+        1.0f,
+        1.0f,
+        1.0f,
+        1.0f,
+        1.0f,
+        1.0f,
+        1.0f,
+    },
+};
+
+enum modifier_bench_test {
+    MODIFIER_BENCH_CLEAR,
+    MODIFIER_BENCH_DRAW,
+    MODIFIER_BENCH_SAMPLE,
+    MODIFIER_BENCH_MAP_READ,
+    MODIFIER_BENCH_MAP_WRITE,
+
+    MODIFIER_BENCH_TEST_COUNT,
+};
+
+static const char *const modifier_bench_test_names[MODIFIER_BENCH_TEST_COUNT] = {
+    [MODIFIER_BENCH_CLEAR] = "clear_mpix_s",
+    [MODIFIER_BENCH_DRAW] = "draw_mpix_s",
+    [MODIFIER_BENCH_SAMPLE] = "sample_mpix_s",
+    [MODIFIER_BENCH_MAP_READ] = "map_read_mb_s",
+    [MODIFIER_BENCH_MAP_WRITE] = "map_write_mb_s",
+};
+
+struct modifier_bench_result {
+    int drm_format;
+    uint64_t drm_modifier;
+    bool external_only;
+    /* false when the image cannot be allocated */
+    bool supported;
+
+    /* negative when not applicable */
+    double rates[MODIFIER_BENCH_TEST_COUNT];
+};
+
+struct modifier_bench {
+    uint32_t width;
+    uint32_t height;
+    int iterations;
+    const char *output;
+
+    struct egl egl;
+
+    struct egl_program *prog;
+    GLuint src_tex;
+    struct egl_framebuffer *fb;
+
+    int result_count;
+    struct modifier_bench_result *results;
+};
+
+static void
+modifier_bench_init(struct modifier_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+    struct egl_gl *gl = &egl->gl;
+
+    egl_init(egl, NULL);
+
+    bench->prog = egl_create_program(egl, modifier_bench_vs, modifier_bench_fs);
+
+    /* a small texture to keep textured draws bound by the destination */
+    const uint32_t texels[4] = { 0xff0000ff, 0xff00ff00, 0xffff0000, 0xffffffff };
+    gl->GenTextures(1, &bench->src_tex);
+    gl->BindTexture(GL_TEXTURE_2D, bench->src_tex);
+    gl->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    gl->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    gl->TexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 2, 2, 0, GL_RGBA, GL_UNSIGNED_BYTE, texels);
+    gl->BindTexture(GL_TEXTURE_2D, 0);
+
+    bench->fb = egl_create_framebuffer(egl, bench->width, bench->height);
+
+    int count = 0;
+    for (int i = 0; i < egl->format_count; i++)
+        count += egl->formats[i].drm_modifier_count;
+    bench->results = calloc(count ? count : 1, sizeof(*bench->results));
+    if (!bench->results)
+        egl_die("failed to alloc results");
+
+    egl_check(egl, "init");
+}
+
+static void
+modifier_bench_cleanup(struct modifier_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+    struct egl_gl *gl = &egl->gl;
+
+    egl_check(egl, "cleanup");
+
+    free(bench->results);
+    egl_destroy_framebuffer(egl, bench->fb);
+    gl->DeleteTextures(1, &bench->src_tex);
+    egl_destroy_program(egl, bench->prog);
+    egl_cleanup(egl);
+}
+
+static void
+modifier_bench_draw_quad(struct modifier_bench *bench, GLuint tex)
+{
+    struct egl *egl = &bench->egl;
+    struct egl_gl *gl = &egl->gl;
+    const GLsizei stride = sizeof(modifier_bench_vertices[0]);
+
+    gl->UseProgram(bench->prog->prog);
+    gl->ActiveTexture(GL_TEXTURE0);
+    gl->BindTexture(GL_TEXTURE_2D, tex);
+
+    gl->VertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride, &modifier_bench_vertices[0][0]);
+    gl->EnableVertexAttribArray(0);
+    gl->VertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride, &modifier_bench_vertices[0][2]);
+    gl->EnableVertexAttribArray(1);
+    gl->VertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, stride, &modifier_bench_vertices[0][4]);
+    gl->EnableVertexAttribArray(2);
+
+    gl->DrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+}
+
+static double
+modifier_bench_run_gl(struct modifier_bench *bench,
+                      enum modifier_bench_test test,
+                      GLuint tex,
+                      GLuint fbo)
+{
+    struct egl *egl = &bench->egl;
+    struct egl_gl *gl = &egl->gl;
+
+    /* sampling renders into bench->fb; the others render into the image */
+    gl->BindFramebuffer(GL_FRAMEBUFFER, test == MODIFIER_BENCH_SAMPLE ? bench->fb->fbo : fbo);
+    gl->Viewport(0, 0, bench->width, bench->height);
+    gl->Finish();
+
+    const uint64_t begin = egl_get_time_ns();
+    for (int i = 0; i < bench->iterations; i++) {
+        switch (test) {
+        case MODIFIER_BENCH_CLEAR:
+            gl->ClearColor(i & 1 ? 1.0f : 0.0f, 0.5f, 0.0f, 1.0f);
+            gl->Clear(GL_COLOR_BUFFER_BIT);
+            break;
+        case MODIFIER_BENCH_DRAW:
+            modifier_bench_draw_quad(bench, bench->src_tex);
+            break;
+        case MODIFIER_BENCH_SAMPLE:
+            modifier_bench_draw_quad(bench, tex);
+            break;
+        default:
+            break;
+        }
+    }
+    gl->Finish();
+    const uint64_t end = egl_get_time_ns();
+
+    gl->BindFramebuffer(GL_FRAMEBUFFER, 0);
+    egl_check(egl, modifier_bench_test_names[test]);
+
+    return (double)bench->width * bench->height * bench->iterations / 1e6 / ((end - begin) / 1e9);
+}
+
+static double
+modifier_bench_run_map(struct modifier_bench *bench, struct egl_image *img, bool write)
+{
+    struct egl *egl = &bench->egl;
+    volatile uint64_t sum = 0;
+    size_t size = 0;
+
+    const uint64_t begin = egl_get_time_ns();
+    for (int i = 0; i < bench->iterations; i++) {
+        struct egl_image_map map;
+        egl_map_image_storage(egl, img, &map);
+
+        const size_t row_size = (size_t)map.pixel_strides[0] * bench->width;
+        for (uint32_t y = 0; y < bench->height; y++) {
+            uint8_t *row = map.planes[0] + (size_t)map.row_strides[0] * y;
+            if (write) {
+                memset(row, i, row_size);
+            } else {
+                uint64_t s = 0;
+                for (size_t x = 0; x + 8 <= row_size; x += 8) {
+                    uint64_t v;
+                    memcpy(&v, row + x, sizeof(v));
+                    s += v;
+                }
+                sum += s;
+            }
+        }
+        size += row_size * bench->height;
+
+        egl_unmap_image_storage(egl, img, &map);
+    }
+    const uint64_t end = egl_get_time_ns();
+
+    return size / 1e6 / ((end - begin) / 1e9);
+}
+
+static void
+modifier_bench_run(struct modifier_bench *bench,
+                   int drm_format,
+                   uint64_t drm_modifier,
+                   bool external_only,
+                   struct modifier_bench_result *result)
+{
+    struct egl *egl = &bench->egl;
+    struct egl_gl *gl = &egl->gl;
+
+    *result = (struct modifier_bench_result){
+        .drm_format = drm_format,
+        .drm_modifier = drm_modifier,
+        .external_only = external_only,
+    };
+    for (int i = 0; i < MODIFIER_BENCH_TEST_COUNT; i++)
+        result->rates[i] = -1.0;
+
+    const struct egl_image_info info = {
+        .width = bench->width,
+        .height = bench->height,
+        .drm_format = drm_format,
+        .mapping = true,
+        .rendering = !external_only,
+        .sampling = true,
+        .force_modifier = true,
+        .drm_modifier = drm_modifier,
+    };
+    struct egl_image *img = egl_try_create_image(egl, &info);
+    if (!img) {
+        egl_log("failed to allocate; skipping");
+        return;
+    }
+    result->supported = true;
+
+    /* external_only images need samplerExternalOES and cannot be rendered */
+    if (!external_only) {
+        GLuint tex;
+        gl->GenTextures(1, &tex);
+        gl->BindTexture(GL_TEXTURE_2D, tex);
+        gl->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        gl->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        gl->EGLImageTargetTexture2DOES(GL_TEXTURE_2D, img->img);
+        gl->BindTexture(GL_TEXTURE_2D, 0);
+        const bool texturable = gl->GetError() == GL_NO_ERROR;
+
+        GLuint fbo;
+        gl->GenFramebuffers(1, &fbo);
+        gl->BindFramebuffer(GL_FRAMEBUFFER, fbo);
+        gl->FramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex, 0);
+        const bool renderable =
+            texturable && gl->CheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+        gl->BindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        if (renderable) {
+            result->rates[MODIFIER_BENCH_CLEAR] =
+                modifier_bench_run_gl(bench, MODIFIER_BENCH_CLEAR, tex, fbo);
+            result->rates[MODIFIER_BENCH_DRAW] =
+                modifier_bench_run_gl(bench, MODIFIER_BENCH_DRAW, tex, fbo);
+        }
+        if (texturable) {
+            result->rates[MODIFIER_BENCH_SAMPLE] =
+                modifier_bench_run_gl(bench, MODIFIER_BENCH_SAMPLE, tex, fbo);
+        }
+
+        gl->DeleteFramebuffers(1, &fbo);
+        gl->DeleteTextures(1, &tex);
+    }
+
+    /* eglutil cannot map formats it does not know, and minigbm refuses to
+     * map some compressed modifiers
+     */
+    if (egl_query_drm_format_cpp(drm_format) >= 0 &&
+        (!egl->is_minigbm || !egl_drm_modifier_is_compressed(drm_modifier))) {
+        result->rates[MODIFIER_BENCH_MAP_READ] = modifier_bench_run_map(bench, img, false);
+        result->rates[MODIFIER_BENCH_MAP_WRITE] = modifier_bench_run_map(bench, img, true);
+    }
+
+    egl_destroy_image(egl, img);
+
+    egl_check(egl, "run");
+}
+
+static void
+modifier_bench_run_all(struct modifier_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+
+    for (int i = 0; i < egl->format_count; i++) {
+        const struct egl_format *fmt = &egl->formats[i];
+
+        for (int j = 0; j < fmt->drm_modifier_count; j++) {
+            egl_log("measuring %.4s modifier 0x%016" PRIx64, (const char *)&fmt->drm_format,
+                    fmt->drm_modifiers[j]);
+
+            modifier_bench_run(bench, fmt->drm_format, fmt->drm_modifiers[j],
+                               fmt->external_only[j], &bench->results[bench->result_count++]);
+        }
+    }
+}
+
+static void
+modifier_bench_write(struct modifier_bench *bench)
+{
+    const size_t len = strlen(bench->output);
+    const bool json = len >= 5 && !strcmp(bench->output + len - 5, ".json");
+
+    FILE *fp = fopen(bench->output, "w");
+    if (!fp)
+        egl_die("failed to open %s", bench->output);
+
+    if (json) {
+        fprintf(fp, "{\"width\": %u, \"height\": %u, \"results\": [", bench->width,
+                bench->height);
+    } else {
+        fprintf(fp, "format,modifier,external_only,supported");
+        for (int i = 0; i < MODIFIER_BENCH_TEST_COUNT; i++)
+            fprintf(fp, ",%s", modifier_bench_test_names[i]);
+        fprintf(fp, "\n");
+    }
+
+    for (int i = 0; i < bench->result_count; i++) {
+        const struct modifier_bench_result *result = &bench->results[i];
+        const char *fourcc = (const char *)&result->drm_format;
+
+        if (json) {
+            fprintf(fp,
+                    "%s\n  {\"format\": \"%.4s\", \"modifier\": \"0x%016" PRIx64
+                    "\", \"external_only\": %s, \"supported\": %s",
+                    i ? "," : "", fourcc, result->drm_modifier,
+                    result->external_only ? "true" : "false",
+                    result->supported ? "true" : "false");
+            for (int j = 0; j < MODIFIER_BENCH_TEST_COUNT; j++) {
+                if (result->rates[j] >= 0.0)
+                    fprintf(fp, ", \"%s\": %.1f", modifier_bench_test_names[j], result->rates[j]);
+                else
+                    fprintf(fp, ", \"%s\": null", modifier_bench_test_names[j]);
+            }
+            fprintf(fp, "}");
+        } else {
+            fprintf(fp, "%.4s,0x%016" PRIx64 ",%d,%d", fourcc, result->drm_modifier,
+                    result->external_only, result->supported);
+            for (int j = 0; j < MODIFIER_BENCH_TEST_COUNT; j++) {
+                if (result->rates[j] >= 0.0)
+                    fprintf(fp, ",%.1f", result->rates[j]);
+                else
+                    fprintf(fp, ",");
+            }
+            fprintf(fp, "\n");
+        }
+    }
+
+    if (json)
+        fprintf(fp, "\n]}\n");
+
+    fclose(fp);
+
+    egl_log("wrote %d results to %s", bench->result_count, bench->output);
+}
+
+int
+main(int argc, const char **argv)
+{
+    struct modifier_bench bench = {
+        .width = 1024,
+        .height = 1024,
+        .iterations = 20,
+        .output = "modifier_bench.csv",
+    };
+
+    if (argc > 1)
+        bench.output = argv[1];
+    if (argc > 2)
+        bench.iterations = atoi(argv[2]);
+    if (bench.iterations <= 0)
+        egl_die("bad iteration count");
+
+    modifier_bench_init(&bench);
+    modifier_bench_run_all(&bench);
+    modifier_bench_write(&bench);
+    modifier_bench_cleanup(&bench);
+
+    return 0;
+}
@@ -5,11 +5,23 @@
 
 /* This is to trigger st_save_zombie_shader/st_context_free_zombie_objects of
  * mesa drivers.
+ *
+ * It is also a frame pipeline where a producer thread cycles N images
+ * through M consumer threads over lock-free queues, to size buffer rings.  It
+ * compares how images are handed off, and reports frames per second, thread
+ * overlap, and latency percentiles.  Per-frame stages can be written as a
+ * Chrome trace JSON file, which Perfetto also loads.
+ *
+ * In zombie mode, threads instead create programs and textures at a given
+ * rate, use them, and hand them to the next thread to destroy in another
+ * context.  RSS and DRM fdinfo memory are sampled, and the test fails when
+ * they grow past a limit.
  */
 
 #include "eglutil.h"
 
-#include <strings.h>
+#include <dirent.h>
+#include <stdalign.h>
 #include <threads.h>
 
 static const char multithread_test_vs[] = {
@@ -39,38 +51,481 @@ static const float multithread_test_vertices[4][2] = {
     },
 };
 
-#define IMAGE_COUNT 2
+#define MULTITHREAD_TEST_MAX_IMAGE_COUNT 64
+#define MULTITHREAD_TEST_MAX_CONSUMER_COUNT 16
+/* timestamp query pairs in flight per consumer */
+#define MULTITHREAD_TEST_QUERY_COUNT 16
+/* objects alive per zombie thread */
+#define MULTITHREAD_TEST_ZOMBIE_SLOT_COUNT 64
+#define MULTITHREAD_TEST_ZOMBIE_SAMPLE_MS 100
+
+enum multithread_test_handoff {
+    /* glFlush only, which gives no GPU ordering */
+    MULTITHREAD_TEST_HANDOFF_FLUSH,
+    /* glFinish, which serializes the CPU and the GPU */
+    MULTITHREAD_TEST_HANDOFF_FINISH,
+    /* a fence that the GPU of the other thread waits for */
+    MULTITHREAD_TEST_HANDOFF_FENCE,
+
+    MULTITHREAD_TEST_HANDOFF_COUNT,
+};
+
+static const char *const multithread_test_handoff_names[MULTITHREAD_TEST_HANDOFF_COUNT] = {
+    [MULTITHREAD_TEST_HANDOFF_FLUSH] = "flush",
+    [MULTITHREAD_TEST_HANDOFF_FINISH] = "finish",
+    [MULTITHREAD_TEST_HANDOFF_FENCE] = "fence",
+};
+
+enum multithread_test_stage {
+    /* the producer recreating and clearing the image */
+    MULTITHREAD_TEST_STAGE_PRODUCE,
+    /* the image sitting in the ready queue */
+    MULTITHREAD_TEST_STAGE_QUEUE,
+    /* a consumer waiting for the fence of the image */
+    MULTITHREAD_TEST_STAGE_WAIT,
+    /* a consumer submitting its draw and signaling */
+    MULTITHREAD_TEST_STAGE_DRAW,
+    /* the GPU executing the draw of a consumer */
+    MULTITHREAD_TEST_STAGE_GPU,
+
+    MULTITHREAD_TEST_STAGE_COUNT,
+};
+
+static const char *const multithread_test_stage_names[MULTITHREAD_TEST_STAGE_COUNT] = {
+    [MULTITHREAD_TEST_STAGE_PRODUCE] = "produce",
+    [MULTITHREAD_TEST_STAGE_QUEUE] = "queue",
+    [MULTITHREAD_TEST_STAGE_WAIT] = "wait",
+    [MULTITHREAD_TEST_STAGE_DRAW] = "draw",
+    [MULTITHREAD_TEST_STAGE_GPU] = "gpu",
+};
+
+struct multithread_test_trace_event {
+    enum multithread_test_stage stage;
+    int frame;
+    uint64_t begin_ns;
+    uint64_t end_ns;
+};
+
+/* owned by a thread and written out after the threads are joined */
+struct multithread_test_trace {
+    int count;
+    int capacity;
+    struct multithread_test_trace_event *events;
+};
+
+/* a fence handed off with an image */
+struct multithread_test_fence {
+    EGLSync sync;
+    /* a sync_file fd instead of sync with EGL_ANDROID_native_fence_sync */
+    int fd;
+};
+
+/* An image is owned by the thread that popped it from a queue.  The fields
+ * are published to the next owner by the queue.
+ */
+struct multithread_test_image {
+    struct egl_image *img;
+    GLuint tex;
+
+    /* signaled when the last owner is done with the image */
+    struct multithread_test_fence fence;
+
+    /* when the producer started the frame and when it queued the image */
+    int frame;
+    uint64_t begin_ns;
+    uint64_t queue_ns;
+};
+
+/* A bounded MPMC queue of image indices, after Dmitry Vyukov's.  Each cell
+ * has a sequence number telling whether it is ready for the next push or the
+ * next pop at a position.  A blocking pop spins briefly and then parks on the
+ * condition variable, which pushes signal only when there are waiters.
+ */
+#define MULTITHREAD_TEST_QUEUE_SPIN_COUNT 64
+
+struct multithread_test_queue_cell {
+    atomic_uint seq;
+    int val;
+};
+
+struct multithread_test_queue {
+    uint32_t mask;
+    struct multithread_test_queue_cell *cells;
+
+    alignas(64) atomic_uint head;
+    alignas(64) atomic_uint tail;
+
+    alignas(64) atomic_int waiter_count;
+    mtx_t mutex;
+    cnd_t cond;
+};
+
+struct multithread_test_consumer {
+    struct multithread_test *test;
+    thrd_t thrd;
+    EGLContext ctx;
+    struct egl_program *prog;
+
+    uint64_t busy_ns;
+    int frame_count;
+    int latency_capacity;
+    /* from the producer starting a frame to the consumer submitting its draw */
+    uint64_t *latencies;
+    /* from the producer queuing an image to the consumer popping it */
+    uint64_t *handoffs;
+
+    struct multithread_test_trace trace;
+
+    /* GL_TIMESTAMP_EXT pairs around draws, resolved in order */
+    struct {
+        bool enabled;
+        /* CLOCK_MONOTONIC minus GL_TIMESTAMP_EXT */
+        int64_t offset_ns;
+
+        GLuint queries[MULTITHREAD_TEST_QUERY_COUNT][2];
+        int frames[MULTITHREAD_TEST_QUERY_COUNT];
+        int submit_count;
+        int resolve_count;
+        /* draws not timed because the ring was full */
+        int drop_count;
+    } gpu;
+};
+
+struct multithread_test_zombie_object {
+    struct egl_program *prog;
+    GLuint tex;
+};
+
+/* Objects are created in slots owned by this thread and are destroyed by the
+ * next thread.  The queues hold slot handles, which are thread * SLOT_COUNT
+ * + slot.
+ */
+struct multithread_test_zombie_thread {
+    struct multithread_test *test;
+    int index;
+    thrd_t thrd;
+    EGLContext ctx;
+    struct egl_framebuffer *fb;
+
+    struct multithread_test_zombie_object objs[MULTITHREAD_TEST_ZOMBIE_SLOT_COUNT];
+    struct multithread_test_queue free_slots;
+    /* objects created by the previous thread */
+    struct multithread_test_queue inbox;
+
+    int create_count;
+    int destroy_count;
+};
+
+/* in KiB */
+struct multithread_test_memory {
+    uint64_t rss;
+    uint64_t drm;
+};
 
 struct multithread_test {
     uint32_t width;
     uint32_t height;
+    int image_count;
+    int consumer_count;
+    int duration_ms;
+    enum multithread_test_handoff handoff;
+    const char *trace_path;
 
     struct egl egl;
+    struct egl_context_pool *ctx_pool;
 
-    mtx_t mtx;
+    struct multithread_test_image imgs[MULTITHREAD_TEST_MAX_IMAGE_COUNT];
 
-    struct egl_image *imgs[IMAGE_COUNT];
-    GLuint texs[IMAGE_COUNT];
+    /* images to be produced, and images to be consumed followed by a -1 per
+     * consumer to stop
+     */
+    struct multithread_test_queue free_queue;
+    struct multithread_test_queue ready_queue;
 
     struct {
-        uint32_t img_mask;
-        cnd_t cnd;
+        int frame_count;
+        uint64_t busy_ns;
+        struct multithread_test_trace trace;
     } producer;
 
+    struct multithread_test_consumer consumers[MULTITHREAD_TEST_MAX_CONSUMER_COUNT];
+
     struct {
-        thrd_t thrd;
-        EGLContext ctx;
-        struct egl_program *prog;
-
-        bool stop;
-        uint32_t img_mask;
-        cnd_t cnd;
-    } consumer;
+        /* per thread per second */
+        int create_rate;
+        int destroy_rate;
+        uint64_t growth_limit_kb;
+
+        atomic_bool stop;
+        struct multithread_test_zombie_thread threads[MULTITHREAD_TEST_MAX_CONSUMER_COUNT];
+    } zombie;
 };
 
 static void
-multithread_test_consumer_draw(struct multithread_test *test, GLuint tex)
+multithread_test_queue_init(struct multithread_test_queue *queue, int min_size)
+{
+    uint32_t size = 1;
+    while (size < (uint32_t)min_size)
+        size <<= 1;
+
+    queue->mask = size - 1;
+    queue->cells = malloc(sizeof(*queue->cells) * size);
+    if (!queue->cells)
+        egl_die("failed to alloc queue");
+
+    for (uint32_t i = 0; i < size; i++)
+        atomic_init(&queue->cells[i].seq, i);
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+
+    atomic_init(&queue->waiter_count, 0);
+    if (mtx_init(&queue->mutex, mtx_plain) != thrd_success ||
+        cnd_init(&queue->cond) != thrd_success)
+        egl_die("failed to init queue");
+}
+
+static void
+multithread_test_queue_cleanup(struct multithread_test_queue *queue)
+{
+    cnd_destroy(&queue->cond);
+    mtx_destroy(&queue->mutex);
+    free(queue->cells);
+}
+
+static bool
+multithread_test_queue_try_push(struct multithread_test_queue *queue, int val)
+{
+    struct multithread_test_queue_cell *cell;
+    uint32_t pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    while (true) {
+        cell = &queue->cells[pos & queue->mask];
+        const uint32_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        const int32_t diff = (int32_t)(seq - pos);
+        if (!diff) {
+            if (atomic_compare_exchange_weak_explicit(&queue->head, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        }
+    }
+
+    cell->val = val;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+    return true;
+}
+
+static bool
+multithread_test_queue_try_pop(struct multithread_test_queue *queue, int *val)
+{
+    struct multithread_test_queue_cell *cell;
+    uint32_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    while (true) {
+        cell = &queue->cells[pos & queue->mask];
+        const uint32_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        const int32_t diff = (int32_t)(seq - (pos + 1));
+        if (!diff) {
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+    }
+
+    *val = cell->val;
+    atomic_store_explicit(&cell->seq, pos + queue->mask + 1, memory_order_release);
+
+    return true;
+}
+
+/* the queues are sized to never be full */
+static void
+multithread_test_queue_push(struct multithread_test_queue *queue, int val)
 {
+    if (!multithread_test_queue_try_push(queue, val))
+        egl_die("queue overflow");
+
+    /* order the push before the waiter check; the parked side pairs with it */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&queue->waiter_count, memory_order_relaxed)) {
+        mtx_lock(&queue->mutex);
+        cnd_signal(&queue->cond);
+        mtx_unlock(&queue->mutex);
+    }
+}
+
+static int
+multithread_test_queue_pop(struct multithread_test_queue *queue)
+{
+    int val;
+    for (int i = 0; i < MULTITHREAD_TEST_QUEUE_SPIN_COUNT; i++) {
+        if (multithread_test_queue_try_pop(queue, &val))
+            return val;
+        thrd_yield();
+    }
+
+    mtx_lock(&queue->mutex);
+    atomic_fetch_add_explicit(&queue->waiter_count, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    while (!multithread_test_queue_try_pop(queue, &val))
+        cnd_wait(&queue->cond, &queue->mutex);
+    atomic_fetch_sub_explicit(&queue->waiter_count, 1, memory_order_relaxed);
+    mtx_unlock(&queue->mutex);
+
+    return val;
+}
+
+static void
+multithread_test_trace(struct multithread_test *test,
+                       struct multithread_test_trace *trace,
+                       enum multithread_test_stage stage,
+                       int frame,
+                       uint64_t begin_ns,
+                       uint64_t end_ns)
+{
+    if (!test->trace_path)
+        return;
+
+    if (trace->count == trace->capacity) {
+        trace->capacity = trace->capacity ? trace->capacity * 2 : 1024;
+        trace->events = realloc(trace->events, sizeof(*trace->events) * trace->capacity);
+        if (!trace->events)
+            egl_die("failed to grow trace");
+    }
+
+    trace->events[trace->count++] = (struct multithread_test_trace_event){
+        .stage = stage,
+        .frame = frame,
+        .begin_ns = begin_ns,
+        .end_ns = end_ns,
+    };
+}
+
+static void
+multithread_test_gpu_calibrate(struct multithread_test_consumer *consumer)
+{
+    struct egl_gl *gl = &consumer->test->egl.gl;
+
+    GLint64 gpu_ns;
+    const uint64_t cpu_begin = egl_get_time_ns();
+    gl->GetInteger64v(GL_TIMESTAMP_EXT, &gpu_ns);
+    const uint64_t cpu_end = egl_get_time_ns();
+
+    consumer->gpu.offset_ns = (int64_t)(cpu_begin + (cpu_end - cpu_begin) / 2) - gpu_ns;
+}
+
+static void
+multithread_test_gpu_resolve_slot(struct multithread_test_consumer *consumer, int slot)
+{
+    struct multithread_test *test = consumer->test;
+    struct egl_gl *gl = &test->egl.gl;
+
+    GLuint64 begin;
+    GLuint64 end;
+    gl->GetQueryObjectui64vEXT(consumer->gpu.queries[slot][0], GL_QUERY_RESULT_EXT, &begin);
+    gl->GetQueryObjectui64vEXT(consumer->gpu.queries[slot][1], GL_QUERY_RESULT_EXT, &end);
+
+    /* the timestamps are meaningless after a disjoint event */
+    GLint disjoint;
+    gl->GetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+    if (disjoint) {
+        multithread_test_gpu_calibrate(consumer);
+        return;
+    }
+
+    multithread_test_trace(test, &consumer->trace, MULTITHREAD_TEST_STAGE_GPU,
+                           consumer->gpu.frames[slot], begin + consumer->gpu.offset_ns,
+                           end + consumer->gpu.offset_ns);
+}
+
+/* This reads back the query pairs in order.  Unless wait is set, it stops at
+ * the first pair the GPU is not done with instead of blocking.
+ */
+static void
+multithread_test_gpu_resolve(struct multithread_test_consumer *consumer, bool wait)
+{
+    struct egl_gl *gl = &consumer->test->egl.gl;
+
+    while (consumer->gpu.resolve_count < consumer->gpu.submit_count) {
+        const int slot = consumer->gpu.resolve_count % MULTITHREAD_TEST_QUERY_COUNT;
+
+        if (!wait) {
+            GLuint available;
+            gl->GetQueryObjectuivEXT(consumer->gpu.queries[slot][1],
+                                     GL_QUERY_RESULT_AVAILABLE_EXT, &available);
+            /* the end timestamp is written after the begin timestamp */
+            if (!available)
+                break;
+        }
+
+        consumer->gpu.resolve_count++;
+        multithread_test_gpu_resolve_slot(consumer, slot);
+    }
+}
+
+/* This is called by the thread releasing the image. */
+static void
+multithread_test_signal(struct multithread_test *test, struct multithread_test_image *img)
+{
+    struct egl *egl = &test->egl;
+    struct egl_gl *gl = &egl->gl;
+
+    switch (test->handoff) {
+    case MULTITHREAD_TEST_HANDOFF_FLUSH:
+        gl->Flush();
+        break;
+    case MULTITHREAD_TEST_HANDOFF_FINISH:
+        gl->Finish();
+        break;
+    case MULTITHREAD_TEST_HANDOFF_FENCE: {
+        EGLSync sync = egl_create_fence(egl);
+        const int fd = egl_export_fence(egl, sync);
+        if (fd >= 0) {
+            egl->DestroySync(egl->dpy, sync);
+            sync = EGL_NO_SYNC;
+        }
+
+        img->fence = (struct multithread_test_fence){
+            .sync = sync,
+            .fd = fd,
+        };
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/* This is called by the thread acquiring the image. */
+static void
+multithread_test_wait(struct multithread_test *test, struct multithread_test_image *img)
+{
+    struct egl *egl = &test->egl;
+    struct multithread_test_fence *fence = &img->fence;
+
+    if (fence->fd >= 0)
+        egl_wait_fence(egl, egl_import_fence(egl, fence->fd));
+    else if (fence->sync != EGL_NO_SYNC)
+        egl_wait_fence(egl, fence->sync);
+
+    fence->sync = EGL_NO_SYNC;
+    fence->fd = -1;
+}
+
+static void
+multithread_test_consumer_draw(struct multithread_test_consumer *consumer,
+                               GLuint tex,
+                               int frame)
+{
+    struct multithread_test *test = consumer->test;
     struct egl *egl = &test->egl;
     struct egl_gl *gl = &egl->gl;
 
@@ -84,7 +539,7 @@ multithread_test_consumer_draw(struct multithread_test *test, GLuint tex)
     /* draw with a feedback loop */
     {
         gl->Viewport(0, 0, test->width, test->height);
-        gl->UseProgram(test->consumer.prog->prog);
+        gl->UseProgram(consumer->prog->prog);
         gl->ActiveTexture(GL_TEXTURE0);
         gl->BindTexture(GL_TEXTURE_2D, tex);
 
@@ -94,77 +549,130 @@ multithread_test_consumer_draw(struct multithread_test *test, GLuint tex)
 
         egl_check(egl, "setup");
 
+        int slot = -1;
+        if (consumer->gpu.enabled) {
+            multithread_test_gpu_resolve(consumer, false);
+
+            /* drop the sample rather than stall the draw on the GPU */
+            if (consumer->gpu.submit_count - consumer->gpu.resolve_count <
+                MULTITHREAD_TEST_QUERY_COUNT) {
+                slot = consumer->gpu.submit_count++ % MULTITHREAD_TEST_QUERY_COUNT;
+                consumer->gpu.frames[slot] = frame;
+                gl->QueryCounterEXT(consumer->gpu.queries[slot][0], GL_TIMESTAMP_EXT);
+            } else {
+                consumer->gpu.drop_count++;
+            }
+        }
+
         gl->DrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+        if (slot >= 0)
+            gl->QueryCounterEXT(consumer->gpu.queries[slot][1], GL_TIMESTAMP_EXT);
         egl_check(egl, "draw");
     }
 
     gl->BindFramebuffer(GL_FRAMEBUFFER, 0);
     gl->DeleteFramebuffers(1, &fbo);
-
-    gl->Flush();
 }
 
 static void
-multithread_test_consumer_cleanup(struct multithread_test *test)
+multithread_test_consumer_cleanup(struct multithread_test_consumer *consumer)
 {
+    struct multithread_test *test = consumer->test;
     struct egl *egl = &test->egl;
+    struct egl_gl *gl = &egl->gl;
 
-    egl_destroy_program(egl, test->consumer.prog);
+    if (consumer->gpu.enabled) {
+        multithread_test_gpu_resolve(consumer, true);
+        gl->DeleteQueries(MULTITHREAD_TEST_QUERY_COUNT * 2, &consumer->gpu.queries[0][0]);
+    }
 
-    egl->MakeCurrent(egl->dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
-    egl->DestroyContext(egl->dpy, test->consumer.ctx);
+    egl_destroy_program(egl, consumer->prog);
+
+    egl_return_context(egl, test->ctx_pool, consumer->ctx);
     egl->ReleaseThread();
 }
 
 static void
-multithread_test_consumer_init(struct multithread_test *test)
+multithread_test_consumer_init(struct multithread_test_consumer *consumer)
 {
+    struct multithread_test *test = consumer->test;
     struct egl *egl = &test->egl;
 
-    const EGLint ctx_attrs[] = {
-        EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 2, EGL_NONE,
-    };
-    EGLContext ctx = egl->CreateContext(egl->dpy, egl->config, egl->ctx, ctx_attrs);
-    if (ctx == EGL_NO_CONTEXT)
-        egl_die("failed to create a context");
-    if (!egl->MakeCurrent(egl->dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx))
-        egl_die("failed to make context current");
+    consumer->ctx = egl_lease_context(egl, test->ctx_pool);
 
-    test->consumer.ctx = ctx;
+    consumer->prog = egl_create_program(egl, multithread_test_vs, multithread_test_fs);
 
-    test->consumer.prog = egl_create_program(egl, multithread_test_vs, multithread_test_fs);
+    /* queries are not shared between contexts */
+    if (test->trace_path && egl_has_ext(egl, GL_EXT_disjoint_timer_query)) {
+        struct egl_gl *gl = &egl->gl;
+
+        consumer->gpu.enabled = true;
+        gl->GenQueries(MULTITHREAD_TEST_QUERY_COUNT * 2, &consumer->gpu.queries[0][0]);
+
+        /* clear the disjoint state before calibrating */
+        GLint disjoint;
+        gl->GetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+        multithread_test_gpu_calibrate(consumer);
+    }
+}
+
+static void
+multithread_test_consumer_record(struct multithread_test_consumer *consumer,
+                                 uint64_t latency,
+                                 uint64_t handoff)
+{
+    if (consumer->frame_count == consumer->latency_capacity) {
+        const int capacity = consumer->latency_capacity ? consumer->latency_capacity * 2 : 256;
+        consumer->latencies = realloc(consumer->latencies, sizeof(uint64_t) * capacity);
+        consumer->handoffs = realloc(consumer->handoffs, sizeof(uint64_t) * capacity);
+        if (!consumer->latencies || !consumer->handoffs)
+            egl_die("failed to grow latencies");
+        consumer->latency_capacity = capacity;
+    }
+
+    consumer->latencies[consumer->frame_count] = latency;
+    consumer->handoffs[consumer->frame_count] = handoff;
+    consumer->frame_count++;
 }
 
 static int
 multithread_test_consumer(void *data)
 {
-    struct multithread_test *test = data;
+    struct multithread_test_consumer *consumer = data;
+    struct multithread_test *test = consumer->test;
 
-    multithread_test_consumer_init(test);
+    multithread_test_consumer_init(consumer);
 
-    mtx_lock(&test->mtx);
     while (true) {
-        while (!test->consumer.img_mask && !test->consumer.stop) {
-            if (cnd_wait(&test->consumer.cnd, &test->mtx) != thrd_success)
-                egl_die("cnd_wait failed");
-        }
-        if (test->consumer.stop)
+        const int idx = multithread_test_queue_pop(&test->ready_queue);
+        if (idx < 0)
             break;
 
-        const int idx = ffs(test->consumer.img_mask) - 1;
-        assert(idx >= 0 && idx < IMAGE_COUNT);
-        mtx_unlock(&test->mtx);
+        struct multithread_test_image *img = &test->imgs[idx];
+        const uint64_t begin = egl_get_time_ns();
+        const uint64_t handoff = begin - img->queue_ns;
+
+        multithread_test_wait(test, img);
+        const uint64_t draw_begin = egl_get_time_ns();
+        multithread_test_consumer_draw(consumer, img->tex, img->frame);
+        multithread_test_signal(test, img);
+        const uint64_t end = egl_get_time_ns();
 
-        multithread_test_consumer_draw(test, test->texs[idx]);
+        consumer->busy_ns += end - begin;
+        multithread_test_consumer_record(consumer, end - img->begin_ns, handoff);
 
-        mtx_lock(&test->mtx);
-        test->consumer.img_mask &= ~(1 << idx);
-        test->producer.img_mask |= (1 << idx);
-        cnd_signal(&test->producer.cnd);
+        multithread_test_trace(test, &consumer->trace, MULTITHREAD_TEST_STAGE_QUEUE, img->frame,
+                               img->queue_ns, begin);
+        multithread_test_trace(test, &consumer->trace, MULTITHREAD_TEST_STAGE_WAIT, img->frame,
+                               begin, draw_begin);
+        multithread_test_trace(test, &consumer->trace, MULTITHREAD_TEST_STAGE_DRAW, img->frame,
+                               draw_begin, end);
+
+        multithread_test_queue_push(&test->free_queue, idx);
     }
-    mtx_unlock(&test->mtx);
 
-    multithread_test_consumer_cleanup(test);
+    multithread_test_consumer_cleanup(consumer);
 
     return 0;
 }
@@ -174,13 +682,25 @@ multithread_test_init(struct multithread_test *test)
 {
     struct egl *egl = &test->egl;
 
+    /* keep stdio locks out of the producer and consumer threads */
+    egl_log_start_async();
+
     egl_init(egl, NULL);
+    test->ctx_pool = egl_create_context_pool(egl, test->consumer_count);
     egl_check(egl, "init");
 
-    if (mtx_init(&test->mtx, mtx_plain) != thrd_success ||
-        cnd_init(&test->producer.cnd) != thrd_success ||
-        cnd_init(&test->consumer.cnd) != thrd_success)
-        egl_die("failed to init mtx/cnd");
+    for (int i = 0; i < test->image_count; i++) {
+        test->imgs[i].fence.sync = EGL_NO_SYNC;
+        test->imgs[i].fence.fd = -1;
+    }
+
+    multithread_test_queue_init(&test->free_queue, test->image_count);
+    multithread_test_queue_init(&test->ready_queue, test->image_count + test->consumer_count);
+    for (int i = 0; i < test->image_count; i++)
+        multithread_test_queue_push(&test->free_queue, i);
+
+    for (int i = 0; i < test->consumer_count; i++)
+        test->consumers[i].test = test;
 }
 
 static void
@@ -189,30 +709,45 @@ multithread_test_cleanup(struct multithread_test *test)
     struct egl *egl = &test->egl;
     struct egl_gl *gl = &egl->gl;
 
-    gl->DeleteTextures(IMAGE_COUNT, test->texs);
-    for (int i = 0; i < IMAGE_COUNT; i++) {
-        if (test->imgs[i])
-            egl_destroy_image(egl, test->imgs[i]);
+    for (int i = 0; i < test->image_count; i++) {
+        struct multithread_test_image *img = &test->imgs[i];
+
+        if (img->fence.fd >= 0)
+            close(img->fence.fd);
+        if (img->fence.sync != EGL_NO_SYNC)
+            egl->DestroySync(egl->dpy, img->fence.sync);
+
+        gl->DeleteTextures(1, &img->tex);
+        if (img->img)
+            egl_destroy_image(egl, img->img);
     }
 
-    mtx_destroy(&test->mtx);
-    cnd_destroy(&test->producer.cnd);
-    cnd_destroy(&test->consumer.cnd);
+    for (int i = 0; i < test->consumer_count; i++) {
+        free(test->consumers[i].latencies);
+        free(test->consumers[i].handoffs);
+        free(test->consumers[i].trace.events);
+    }
+    free(test->producer.trace.events);
+
+    multithread_test_queue_cleanup(&test->free_queue);
+    multithread_test_queue_cleanup(&test->ready_queue);
+
+    egl_destroy_context_pool(egl, test->ctx_pool);
 
     egl_check(egl, "cleanup");
 
     egl_cleanup(egl);
+
+    egl_log_stop_async();
 }
 
 static void
-multithread_test_draw_produce(struct multithread_test *test, int idx)
+multithread_test_draw_produce(struct multithread_test *test, struct multithread_test_image *img)
 {
     struct egl *egl = &test->egl;
     struct egl_gl *gl = &egl->gl;
-    struct egl_image *img = test->imgs[idx];
-    GLuint tex = test->texs[idx];
 
-    if (!img) {
+    if (!img->img) {
         const struct egl_image_info info = {
             .width = test->width,
             .height = test->height,
@@ -221,33 +756,31 @@ multithread_test_draw_produce(struct multithread_test *test, int idx)
             .sampling = true,
             .force_linear = true,
         };
-        img = egl_create_image(egl, &info);
-
-        test->imgs[idx] = img;
+        img->img = egl_create_image(egl, &info);
     }
 
+    multithread_test_wait(test, img);
+
     /* destroy EGLImage and GL tex */
-    if (tex)
-        gl->DeleteTextures(1, &tex);
-    egl->DestroyImage(egl->dpy, img->img);
+    if (img->tex)
+        gl->DeleteTextures(1, &img->tex);
+    egl_unwrap_image_storage(egl, img->img);
 
     /* recreate EGLImage and GL tex */
-    egl_wrap_image_storage(egl, img);
-    gl->GenTextures(1, &tex);
-    gl->BindTexture(GL_TEXTURE_2D, tex);
+    egl_wrap_image_storage(egl, img->img);
+    gl->GenTextures(1, &img->tex);
+    gl->BindTexture(GL_TEXTURE_2D, img->tex);
     gl->TexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     gl->TexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    gl->EGLImageTargetTexture2DOES(GL_TEXTURE_2D, img->img);
+    gl->EGLImageTargetTexture2DOES(GL_TEXTURE_2D, img->img->img);
     gl->BindTexture(GL_TEXTURE_2D, 0);
 
-    test->texs[idx] = tex;
-
     /* clear the image */
     {
         GLuint fbo;
         gl->GenFramebuffers(1, &fbo);
         gl->BindFramebuffer(GL_FRAMEBUFFER, fbo);
-        gl->FramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, tex, 0);
+        gl->FramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, img->tex, 0);
         if (gl->CheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
             egl_die("incomplete fbo");
 
@@ -259,37 +792,518 @@ multithread_test_draw_produce(struct multithread_test *test, int idx)
         gl->BindFramebuffer(GL_FRAMEBUFFER, 0);
         gl->DeleteFramebuffers(1, &fbo);
     }
+
+    multithread_test_signal(test, img);
+}
+
+static int
+multithread_test_compare(const void *a, const void *b)
+{
+    const uint64_t *x = a;
+    const uint64_t *y = b;
+    return *x < *y ? -1 : *x > *y;
+}
+
+static void
+multithread_test_report_percentiles(const char *name, uint64_t *vals, int n)
+{
+    qsort(vals, n, sizeof(*vals), multithread_test_compare);
+
+    const int p90 = (n * 90 + 99) / 100 - 1;
+    const int p99 = (n * 99 + 99) / 100 - 1;
+    egl_log("%s: median %.1fus, p90 %.1fus, p99 %.1fus, max %.1fus", name,
+            vals[n / 2] / 1000.0, vals[p90] / 1000.0, vals[p99] / 1000.0, vals[n - 1] / 1000.0);
+}
+
+static void
+multithread_test_report(struct multithread_test *test, uint64_t duration_ns)
+{
+    int n = 0;
+    uint64_t busy_ns = test->producer.busy_ns;
+    for (int i = 0; i < test->consumer_count; i++) {
+        n += test->consumers[i].frame_count;
+        busy_ns += test->consumers[i].busy_ns;
+    }
+    if (!n)
+        egl_die("no frame consumed");
+
+    uint64_t *latencies = malloc(sizeof(*latencies) * n);
+    uint64_t *handoffs = malloc(sizeof(*handoffs) * n);
+    if (!latencies || !handoffs)
+        egl_die("failed to alloc latencies");
+
+    int c = 0;
+    for (int i = 0; i < test->consumer_count; i++) {
+        const struct multithread_test_consumer *consumer = &test->consumers[i];
+        memcpy(latencies + c, consumer->latencies, sizeof(*latencies) * consumer->frame_count);
+        memcpy(handoffs + c, consumer->handoffs, sizeof(*handoffs) * consumer->frame_count);
+        c += consumer->frame_count;
+    }
+
+    /* the average number of busy threads; above 1 means they overlapped */
+    egl_log("%s, %d images, %d consumers: %.1f fps, producer busy %.0f%%, %.2f threads busy",
+            multithread_test_handoff_names[test->handoff], test->image_count,
+            test->consumer_count, n / (duration_ns / 1e9),
+            100.0 * test->producer.busy_ns / duration_ns, (double)busy_ns / duration_ns);
+    multithread_test_report_percentiles("handoff latency", handoffs, n);
+    multithread_test_report_percentiles("frame latency", latencies, n);
+
+    free(latencies);
+    free(handoffs);
+}
+
+static void
+multithread_test_write_trace_event(FILE *fp,
+                                   const struct multithread_test_trace_event *ev,
+                                   int tid,
+                                   uint64_t base_ns,
+                                   bool *first)
+{
+    /* events before the base are clamped rather than dropped */
+    const double ts = ev->begin_ns > base_ns ? (ev->begin_ns - base_ns) / 1000.0 : 0.0;
+    const double dur = ev->end_ns > ev->begin_ns ? (ev->end_ns - ev->begin_ns) / 1000.0 : 0.0;
+    const char *name = multithread_test_stage_names[ev->stage];
+
+    if (ev->stage == MULTITHREAD_TEST_STAGE_QUEUE) {
+        /* queued images overlap; use an async track keyed by the frame */
+        fprintf(fp,
+                "%s\n  {\"name\": \"%s\", \"cat\": \"frame\", \"ph\": \"b\", \"id\": %d, "
+                "\"pid\": 1, \"tid\": %d, \"ts\": %.3f},"
+                "\n  {\"name\": \"%s\", \"cat\": \"frame\", \"ph\": \"e\", \"id\": %d, "
+                "\"pid\": 1, \"tid\": %d, \"ts\": %.3f}",
+                *first ? "" : ",", name, ev->frame, tid, ts, name, ev->frame, tid, ts + dur);
+    } else {
+        fprintf(fp,
+                "%s\n  {\"name\": \"%s\", \"cat\": \"frame\", \"ph\": \"X\", \"pid\": 1, "
+                "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"frame\": %d}}",
+                *first ? "" : ",", name, tid, ts, dur, ev->frame);
+    }
+
+    *first = false;
+}
+
+static void
+multithread_test_write_trace_thread(FILE *fp, int tid, const char *name, bool *first)
+{
+    fprintf(fp,
+            "%s\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+            "\"args\": {\"name\": \"%s\"}}",
+            *first ? "" : ",", tid, name);
+    *first = false;
+}
+
+/* This writes the Chrome trace event format.  The producer is tid 1, and
+ * consumer i is tid 2 + i on the CPU and tid 1002 + i on the GPU.
+ */
+static void
+multithread_test_write_trace(struct multithread_test *test, uint64_t base_ns)
+{
+    FILE *fp = fopen(test->trace_path, "w");
+    if (!fp)
+        egl_die("failed to open %s", test->trace_path);
+
+    bool first = true;
+    fprintf(fp, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+
+    multithread_test_write_trace_thread(fp, 1, "producer", &first);
+    for (int i = 0; i < test->consumer_count; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "consumer %d", i);
+        multithread_test_write_trace_thread(fp, 2 + i, name, &first);
+        if (test->consumers[i].gpu.enabled) {
+            snprintf(name, sizeof(name), "consumer %d gpu", i);
+            multithread_test_write_trace_thread(fp, 1002 + i, name, &first);
+            if (test->consumers[i].gpu.drop_count) {
+                egl_log("consumer %d: %d draws not timed on the gpu", i,
+                        test->consumers[i].gpu.drop_count);
+            }
+        }
+    }
+
+    int event_count = 0;
+    const struct multithread_test_trace *trace = &test->producer.trace;
+    for (int i = 0; i < trace->count; i++)
+        multithread_test_write_trace_event(fp, &trace->events[i], 1, base_ns, &first);
+    event_count += trace->count;
+
+    for (int i = 0; i < test->consumer_count; i++) {
+        trace = &test->consumers[i].trace;
+        for (int j = 0; j < trace->count; j++) {
+            const struct multithread_test_trace_event *ev = &trace->events[j];
+            const int tid = ev->stage == MULTITHREAD_TEST_STAGE_GPU ? 1002 + i : 2 + i;
+            multithread_test_write_trace_event(fp, ev, tid, base_ns, &first);
+        }
+        event_count += trace->count;
+    }
+
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+
+    egl_log("wrote %d trace events to %s", event_count, test->trace_path);
 }
 
 static void
 multithread_test_draw(struct multithread_test *test)
 {
-    test->producer.img_mask = (1 << IMAGE_COUNT) - 1;
-    if (thrd_create(&test->consumer.thrd, multithread_test_consumer, test) != thrd_success)
-        egl_die("thrd_create failed");
+    for (int i = 0; i < test->consumer_count; i++) {
+        if (thrd_create(&test->consumers[i].thrd, multithread_test_consumer,
+                        &test->consumers[i]) != thrd_success)
+            egl_die("thrd_create failed");
+    }
 
-    mtx_lock(&test->mtx);
-    while (true) {
-        while (!test->producer.img_mask) {
-            if (cnd_wait(&test->producer.cnd, &test->mtx) != thrd_success)
-                egl_die("cnd_wait failed");
+    const uint64_t begin = egl_get_time_ns();
+    const uint64_t end = begin + (uint64_t)test->duration_ms * 1000000;
+
+    while (egl_get_time_ns() < end) {
+        const int idx = multithread_test_queue_pop(&test->free_queue);
+        struct multithread_test_image *img = &test->imgs[idx];
+
+        const uint64_t produce_begin = egl_get_time_ns();
+        img->frame = test->producer.frame_count;
+        img->begin_ns = produce_begin;
+        multithread_test_draw_produce(test, img);
+
+        img->queue_ns = egl_get_time_ns();
+        test->producer.busy_ns += img->queue_ns - produce_begin;
+        test->producer.frame_count++;
+
+        multithread_test_trace(test, &test->producer.trace, MULTITHREAD_TEST_STAGE_PRODUCE,
+                               img->frame, produce_begin, img->queue_ns);
+
+        multithread_test_queue_push(&test->ready_queue, idx);
+    }
+
+    /* collect all images before stopping the consumers */
+    for (int i = 0; i < test->image_count; i++)
+        multithread_test_queue_pop(&test->free_queue);
+    for (int i = 0; i < test->consumer_count; i++)
+        multithread_test_queue_push(&test->ready_queue, -1);
+
+    for (int i = 0; i < test->consumer_count; i++) {
+        if (thrd_join(test->consumers[i].thrd, NULL) != thrd_success)
+            egl_die("thrd_join failed");
+    }
+
+    multithread_test_report(test, egl_get_time_ns() - begin);
+
+    if (test->trace_path)
+        multithread_test_write_trace(test, begin);
+}
+
+static bool
+multithread_test_parse_fdinfo(const char *path,
+                              uint64_t *client_ids,
+                              int *client_count,
+                              uint64_t *kb)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return false;
+
+    bool is_drm = false;
+    uint64_t client_id = 0;
+    uint64_t memory = 0;
+    uint64_t total = 0;
+
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "drm-client-id: %" SCNu64, &client_id) == 1) {
+            is_drm = true;
+            continue;
         }
 
-        const int idx = ffs(test->producer.img_mask) - 1;
-        assert(idx >= 0 && idx < IMAGE_COUNT);
-        mtx_unlock(&test->mtx);
+        /* drm-memory-<region> is older than drm-total-<region> */
+        uint64_t *sum;
+        if (!strncmp(line, "drm-memory-", 11))
+            sum = &memory;
+        else if (!strncmp(line, "drm-total-", 10))
+            sum = &total;
+        else
+            continue;
 
-        multithread_test_draw_produce(test, idx);
+        const char *colon = strchr(line, ':');
+        uint64_t val;
+        char unit[8] = "";
+        if (!colon || sscanf(colon + 1, "%" SCNu64 " %7s", &val, unit) < 1)
+            continue;
 
-        mtx_lock(&test->mtx);
-        test->producer.img_mask &= ~(1 << idx);
-        test->consumer.img_mask |= (1 << idx);
-        cnd_signal(&test->consumer.cnd);
+        if (!strcmp(unit, "KiB"))
+            *sum += val;
+        else if (!strcmp(unit, "MiB"))
+            *sum += val * 1024;
+        else if (!strcmp(unit, "GiB"))
+            *sum += val * 1024 * 1024;
+        else
+            *sum += val / 1024;
     }
-    mtx_unlock(&test->mtx);
 
-    if (thrd_join(test->consumer.thrd, NULL) != thrd_success)
-        egl_die("thrd_join failed");
+    fclose(fp);
+
+    if (!is_drm)
+        return false;
+
+    /* fds of the same client report the same memory */
+    for (int i = 0; i < *client_count; i++) {
+        if (client_ids[i] == client_id)
+            return true;
+    }
+    if (*client_count < 64)
+        client_ids[(*client_count)++] = client_id;
+
+    *kb += memory ? memory : total;
+
+    return true;
+}
+
+static void
+multithread_test_sample_memory(struct multithread_test_memory *mem)
+{
+    *mem = (struct multithread_test_memory){ 0 };
+
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        uint64_t size;
+        uint64_t resident;
+        if (fscanf(fp, "%" SCNu64 " %" SCNu64, &size, &resident) == 2)
+            mem->rss = resident * (uint64_t)sysconf(_SC_PAGESIZE) / 1024;
+        fclose(fp);
+    }
+
+    DIR *dir = opendir("/proc/self/fdinfo");
+    if (!dir)
+        return;
+
+    uint64_t client_ids[64];
+    int client_count = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (ent->d_name[0] == '.')
+            continue;
+
+        char path[64];
+        /* fd numbers are short */
+        snprintf(path, sizeof(path), "/proc/self/fdinfo/%.32s", ent->d_name);
+        multithread_test_parse_fdinfo(path, client_ids, &client_count, &mem->drm);
+    }
+
+    closedir(dir);
+}
+
+static void
+multithread_test_zombie_create(struct multithread_test_zombie_thread *thread, int slot)
+{
+    struct multithread_test *test = thread->test;
+    struct egl *egl = &test->egl;
+    struct egl_gl *gl = &egl->gl;
+    struct multithread_test_zombie_object *obj = &thread->objs[slot];
+
+    obj->prog = egl_create_program(egl, multithread_test_vs, multithread_test_fs);
+
+    gl->GenTextures(1, &obj->tex);
+    gl->BindTexture(GL_TEXTURE_2D, obj->tex);
+    gl->TexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, 64, 64);
+
+    /* draw to make the driver create per-context variants */
+    gl->BindFramebuffer(GL_FRAMEBUFFER, thread->fb->fbo);
+    gl->Viewport(0, 0, 64, 64);
+    gl->UseProgram(obj->prog->prog);
+    gl->ActiveTexture(GL_TEXTURE0);
+    gl->VertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(multithread_test_vertices[0]),
+                            multithread_test_vertices);
+    gl->EnableVertexAttribArray(0);
+    gl->DrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+    gl->UseProgram(0);
+    gl->BindTexture(GL_TEXTURE_2D, 0);
+    gl->BindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    /* the objects must be complete before another context destroys them */
+    gl->Flush();
+    egl_check(egl, "zombie create");
+
+    thread->create_count++;
+}
+
+static void
+multithread_test_zombie_destroy(struct multithread_test *test, int handle)
+{
+    struct egl *egl = &test->egl;
+    struct egl_gl *gl = &egl->gl;
+    struct multithread_test_zombie_thread *owner =
+        &test->zombie.threads[handle / MULTITHREAD_TEST_ZOMBIE_SLOT_COUNT];
+    struct multithread_test_zombie_object *obj =
+        &owner->objs[handle % MULTITHREAD_TEST_ZOMBIE_SLOT_COUNT];
+
+    /* the variants become zombies of the owner context */
+    egl_destroy_program(egl, obj->prog);
+    gl->DeleteTextures(1, &obj->tex);
+    *obj = (struct multithread_test_zombie_object){ 0 };
+
+    multithread_test_queue_push(&owner->free_slots, handle);
+}
+
+static int
+multithread_test_zombie_thread(void *data)
+{
+    struct multithread_test_zombie_thread *thread = data;
+    struct multithread_test *test = thread->test;
+    struct egl *egl = &test->egl;
+    struct multithread_test_zombie_thread *next =
+        &test->zombie.threads[(thread->index + 1) % test->consumer_count];
+
+    thread->ctx = egl_lease_context(egl, test->ctx_pool);
+    thread->fb = egl_create_framebuffer(egl, 64, 64);
+
+    const uint64_t create_interval = 1000000000ull / test->zombie.create_rate;
+    const uint64_t destroy_interval = 1000000000ull / test->zombie.destroy_rate;
+    uint64_t next_create = egl_get_time_ns();
+    uint64_t next_destroy = next_create;
+
+    while (!atomic_load(&test->zombie.stop)) {
+        const uint64_t now = egl_get_time_ns();
+        bool idle = true;
+
+        int handle;
+        if (now >= next_create && multithread_test_queue_try_pop(&thread->free_slots, &handle)) {
+            multithread_test_zombie_create(thread, handle % MULTITHREAD_TEST_ZOMBIE_SLOT_COUNT);
+            multithread_test_queue_push(&next->inbox, handle);
+            next_create += create_interval;
+            idle = false;
+        }
+
+        if (now >= next_destroy && multithread_test_queue_try_pop(&thread->inbox, &handle)) {
+            multithread_test_zombie_destroy(test, handle);
+            thread->destroy_count++;
+            next_destroy += destroy_interval;
+            idle = false;
+        }
+
+        /* do not build up a burst when falling behind */
+        if (next_create + 100000000 < now)
+            next_create = now;
+        if (next_destroy + 100000000 < now)
+            next_destroy = now;
+
+        if (idle) {
+            const struct timespec ts = { .tv_nsec = 100000 };
+            thrd_sleep(&ts, NULL);
+        }
+    }
+
+    egl_destroy_framebuffer(egl, thread->fb);
+    egl_check(egl, "zombie");
+
+    egl_return_context(egl, test->ctx_pool, thread->ctx);
+    egl->ReleaseThread();
+
+    return 0;
+}
+
+static void
+multithread_test_zombie(struct multithread_test *test)
+{
+    struct egl *egl = &test->egl;
+    const int thread_count = test->consumer_count;
+
+    for (int i = 0; i < thread_count; i++) {
+        struct multithread_test_zombie_thread *thread = &test->zombie.threads[i];
+        thread->test = test;
+        thread->index = i;
+
+        multithread_test_queue_init(&thread->free_slots, MULTITHREAD_TEST_ZOMBIE_SLOT_COUNT);
+        multithread_test_queue_init(&thread->inbox, MULTITHREAD_TEST_ZOMBIE_SLOT_COUNT);
+        for (int j = 0; j < MULTITHREAD_TEST_ZOMBIE_SLOT_COUNT; j++) {
+            multithread_test_queue_push(&thread->free_slots,
+                                        i * MULTITHREAD_TEST_ZOMBIE_SLOT_COUNT + j);
+        }
+    }
+
+    struct multithread_test_memory base;
+    multithread_test_sample_memory(&base);
+
+    atomic_init(&test->zombie.stop, false);
+    for (int i = 0; i < thread_count; i++) {
+        struct multithread_test_zombie_thread *thread = &test->zombie.threads[i];
+        if (thrd_create(&thread->thrd, multithread_test_zombie_thread, thread) != thrd_success)
+            egl_die("thrd_create failed");
+    }
+
+    /* let caches and pools fill up before taking the baseline */
+    const uint64_t begin = egl_get_time_ns();
+    const uint64_t warmup_end = begin + (uint64_t)test->duration_ms * 1000000 / 4;
+    const uint64_t end = begin + (uint64_t)test->duration_ms * 1000000;
+
+    struct multithread_test_memory baseline = base;
+    struct multithread_test_memory peak = base;
+    struct multithread_test_memory last = base;
+    bool warm = false;
+    bool exceeded = false;
+    int sample_count = 0;
+
+    while (egl_get_time_ns() < end) {
+        const struct timespec ts = {
+            .tv_nsec = MULTITHREAD_TEST_ZOMBIE_SAMPLE_MS * 1000000,
+        };
+        thrd_sleep(&ts, NULL);
+
+        multithread_test_sample_memory(&last);
+        sample_count++;
+
+        if (!warm) {
+            if (egl_get_time_ns() >= warmup_end) {
+                baseline = last;
+                peak = last;
+                warm = true;
+            }
+            continue;
+        }
+
+        if (peak.rss < last.rss)
+            peak.rss = last.rss;
+        if (peak.drm < last.drm)
+            peak.drm = last.drm;
+
+        if (peak.rss - baseline.rss > test->zombie.growth_limit_kb ||
+            peak.drm - baseline.drm > test->zombie.growth_limit_kb) {
+            exceeded = true;
+            break;
+        }
+    }
+
+    atomic_store(&test->zombie.stop, true);
+    for (int i = 0; i < thread_count; i++) {
+        if (thrd_join(test->zombie.threads[i].thrd, NULL) != thrd_success)
+            egl_die("thrd_join failed");
+    }
+    const uint64_t duration_ns = egl_get_time_ns() - begin;
+
+    /* destroy the objects still in flight from egl::ctx */
+    int create_count = 0;
+    int destroy_count = 0;
+    for (int i = 0; i < thread_count; i++) {
+        struct multithread_test_zombie_thread *thread = &test->zombie.threads[i];
+        int handle;
+        while (multithread_test_queue_try_pop(&thread->inbox, &handle))
+            multithread_test_zombie_destroy(test, handle);
+
+        create_count += thread->create_count;
+        destroy_count += thread->destroy_count;
+    }
+    for (int i = 0; i < thread_count; i++) {
+        multithread_test_queue_cleanup(&test->zombie.threads[i].free_slots);
+        multithread_test_queue_cleanup(&test->zombie.threads[i].inbox);
+    }
+    egl_check(egl, "zombie");
+
+    egl_log("zombie, %d threads: %.1f creates/s, %.1f cross-context destroys/s", thread_count,
+            create_count / (duration_ns / 1e9), destroy_count / (duration_ns / 1e9));
+    egl_log("%d samples: rss %" PRIu64 " -> %" PRIu64 " KiB (baseline %" PRIu64 ", peak %" PRIu64
+            "), drm %" PRIu64 " -> %" PRIu64 " KiB (baseline %" PRIu64 ", peak %" PRIu64 ")",
+            sample_count, base.rss, last.rss, baseline.rss, peak.rss, base.drm, last.drm,
+            baseline.drm, peak.drm);
+
+    if (exceeded)
+        egl_die("memory grew past %" PRIu64 " KiB after warmup", test->zombie.growth_limit_kb);
 }
 
 int
@@ -298,8 +1312,71 @@ main(int argc, const char **argv)
     struct multithread_test test = {
         .width = 1280,
         .height = 720,
+        .image_count = 2,
+        .consumer_count = 1,
+        .duration_ms = 3000,
+        .handoff = MULTITHREAD_TEST_HANDOFF_FENCE,
     };
 
+    /* multithread zombie [threads] [creates/s] [destroys/s] [duration-ms] [limit-kib] */
+    if (argc > 1 && !strcmp(argv[1], "zombie")) {
+        test.consumer_count = 2;
+        test.duration_ms = 10000;
+        test.zombie.create_rate = 200;
+        test.zombie.destroy_rate = 200;
+        test.zombie.growth_limit_kb = 32 * 1024;
+
+        if (argc > 2)
+            test.consumer_count = atoi(argv[2]);
+        if (argc > 3)
+            test.zombie.create_rate = atoi(argv[3]);
+        if (argc > 4)
+            test.zombie.destroy_rate = atoi(argv[4]);
+        if (argc > 5)
+            test.duration_ms = atoi(argv[5]);
+        if (argc > 6)
+            test.zombie.growth_limit_kb = strtoull(argv[6], NULL, 0);
+
+        /* objects must be destroyed in another context */
+        if (test.consumer_count < 2 || test.consumer_count > MULTITHREAD_TEST_MAX_CONSUMER_COUNT)
+            egl_die("bad thread count");
+        if (test.zombie.create_rate <= 0 || test.zombie.destroy_rate <= 0)
+            egl_die("bad rate");
+        if (test.duration_ms <= 0)
+            egl_die("bad duration");
+
+        multithread_test_init(&test);
+        multithread_test_zombie(&test);
+        multithread_test_cleanup(&test);
+
+        return 0;
+    }
+
+    if (argc > 1) {
+        int handoff = -1;
+        for (int i = 0; i < MULTITHREAD_TEST_HANDOFF_COUNT; i++) {
+            if (!strcmp(argv[1], multithread_test_handoff_names[i]))
+                handoff = i;
+        }
+        if (handoff < 0)
+            egl_die("unknown handoff %s", argv[1]);
+        test.handoff = handoff;
+    }
+    if (argc > 2)
+        test.image_count = atoi(argv[2]);
+    if (argc > 3)
+        test.consumer_count = atoi(argv[3]);
+    if (argc > 4)
+        test.duration_ms = atoi(argv[4]);
+    if (argc > 5)
+        test.trace_path = argv[5];
+    if (test.image_count <= 0 || test.image_count > MULTITHREAD_TEST_MAX_IMAGE_COUNT)
+        egl_die("bad image count");
+    if (test.consumer_count <= 0 || test.consumer_count > MULTITHREAD_TEST_MAX_CONSUMER_COUNT)
+        egl_die("bad consumer count");
+    if (test.duration_ms <= 0)
+        egl_die("bad duration");
+
     multithread_test_init(&test);
     multithread_test_draw(&test);
     multithread_test_cleanup(&test);
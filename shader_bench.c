@@ -0,0 +1,205 @@
+/*
+ * Copyright 2022 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+/* This measures compiling many program variants serially with
+ * egl_create_program and in parallel with egl_create_program_async, using
+ * GL_KHR_parallel_shader_compile and compiler threads.
+ */
+
+#include "eglutil.h"
+
+static const char shader_bench_vs[] = {
+#include "shader_bench_test.vert.inc"
+};
+
+static const char shader_bench_fs[] = {
+#include "shader_bench_test.frag.inc"
+};
+
+struct shader_bench {
+    int variant_count;
+    int thread_count;
+
+    struct egl egl;
+
+    /* fs variants with VARIANT and SALT defined; SALT changes for every run
+     * such that no run is served by the shader cache
+     */
+    uint64_t salt;
+    char **fs_glsls;
+    struct egl_program **progs;
+};
+
+static void
+shader_bench_init(struct shader_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+
+    egl_init(egl, NULL);
+
+    bench->fs_glsls = calloc(bench->variant_count, sizeof(*bench->fs_glsls));
+    bench->progs = calloc(bench->variant_count, sizeof(*bench->progs));
+    if (!bench->fs_glsls || !bench->progs)
+        egl_die("failed to alloc variants");
+
+    for (int i = 0; i < bench->variant_count; i++) {
+        bench->fs_glsls[i] = malloc(sizeof(shader_bench_fs) + 64);
+        if (!bench->fs_glsls[i])
+            egl_die("failed to alloc variant");
+    }
+
+    /* the on-disk cache outlives the process */
+    bench->salt = egl_get_time_ns();
+
+    egl_check(egl, "init");
+}
+
+static void
+shader_bench_cleanup(struct shader_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+
+    egl_check(egl, "cleanup");
+
+    for (int i = 0; i < bench->variant_count; i++)
+        free(bench->fs_glsls[i]);
+    free(bench->fs_glsls);
+    free(bench->progs);
+
+    egl_cleanup(egl);
+}
+
+static void
+shader_bench_destroy_programs(struct shader_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+
+    for (int i = 0; i < bench->variant_count; i++)
+        egl_destroy_program(egl, bench->progs[i]);
+}
+
+static void
+shader_bench_salt_variants(struct shader_bench *bench)
+{
+    /* insert the defines after the #version line */
+    const char *body = strchr(shader_bench_fs, '\n');
+    if (!body)
+        egl_die("bad fs");
+    const int version_len = body - shader_bench_fs + 1;
+
+    bench->salt++;
+    for (int i = 0; i < bench->variant_count; i++) {
+        snprintf(bench->fs_glsls[i], sizeof(shader_bench_fs) + 64,
+                 "%.*s#define VARIANT %d\n#define SALT %" PRIu64 "\n%s", version_len,
+                 shader_bench_fs, i, bench->salt, body + 1);
+    }
+}
+
+static uint64_t
+shader_bench_run_serial(struct shader_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+
+    shader_bench_salt_variants(bench);
+
+    const uint64_t begin = egl_get_time_ns();
+    for (int i = 0; i < bench->variant_count; i++)
+        bench->progs[i] = egl_create_program(egl, shader_bench_vs, bench->fs_glsls[i]);
+    const uint64_t end = egl_get_time_ns();
+
+    shader_bench_destroy_programs(bench);
+    egl_check(egl, "serial");
+
+    return end - begin;
+}
+
+static uint64_t
+shader_bench_run_async(struct shader_bench *bench, int thread_count, uint64_t *submit_ns)
+{
+    struct egl *egl = &bench->egl;
+
+    struct egl_program_compiler *compiler = egl_create_program_compiler(egl, thread_count);
+    shader_bench_salt_variants(bench);
+
+    const uint64_t begin = egl_get_time_ns();
+    for (int i = 0; i < bench->variant_count; i++) {
+        bench->progs[i] =
+            egl_create_program_async(egl, compiler, shader_bench_vs, bench->fs_glsls[i]);
+    }
+    const uint64_t submitted = egl_get_time_ns();
+
+    /* poll like a frame loop would, and wait for the stragglers */
+    int ready_count = 0;
+    while (ready_count < bench->variant_count) {
+        const int prev_count = ready_count;
+        for (int i = ready_count; i < bench->variant_count; i++) {
+            if (!egl_is_program_ready(egl, bench->progs[i]))
+                break;
+            ready_count++;
+        }
+
+        if (ready_count == prev_count)
+            egl_wait_program(egl, bench->progs[ready_count++]);
+    }
+    const uint64_t end = egl_get_time_ns();
+
+    shader_bench_destroy_programs(bench);
+    egl_destroy_program_compiler(egl, compiler);
+    egl_check(egl, "async");
+
+    *submit_ns = submitted - begin;
+    return end - begin;
+}
+
+int
+main(int argc, const char **argv)
+{
+    struct shader_bench bench = {
+        .variant_count = 64,
+        .thread_count = 4,
+    };
+
+    if (argc > 1)
+        bench.variant_count = atoi(argv[1]);
+    if (argc > 2)
+        bench.thread_count = atoi(argv[2]);
+    if (bench.variant_count <= 0 || bench.thread_count <= 0)
+        egl_die("bad variant or thread count");
+
+    shader_bench_init(&bench);
+
+    /* warm up the compiler, but not the shader cache */
+    shader_bench_run_serial(&bench);
+
+    const uint64_t serial_ns = shader_bench_run_serial(&bench);
+    egl_log("%d variants", bench.variant_count);
+    egl_log("serial: %.2fms", serial_ns / 1000000.0);
+
+    if (egl_has_ext(&bench.egl, GL_KHR_parallel_shader_compile)) {
+        uint64_t submit_ns;
+        const uint64_t khr_ns = shader_bench_run_async(&bench, 0, &submit_ns);
+        egl_log("GL_KHR_parallel_shader_compile: %.2fms (%.2fx), submitted in %.2fms",
+                khr_ns / 1000000.0, (double)serial_ns / khr_ns, submit_ns / 1000000.0);
+    } else {
+        egl_log("GL_KHR_parallel_shader_compile: unsupported");
+    }
+
+    for (int i = 1; i <= bench.thread_count;) {
+        uint64_t submit_ns;
+        const uint64_t thread_ns = shader_bench_run_async(&bench, i, &submit_ns);
+        egl_log("%d compiler threads: %.2fms (%.2fx), submitted in %.2fms", i,
+                thread_ns / 1000000.0, (double)serial_ns / thread_ns, submit_ns / 1000000.0);
+
+        if (i == bench.thread_count)
+            break;
+        i *= 2;
+        if (i > bench.thread_count)
+            i = bench.thread_count;
+    }
+
+    shader_bench_cleanup(&bench);
+
+    return 0;
+}
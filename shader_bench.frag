@@ -0,0 +1,31 @@
+#version 320 es
+
+/*
+ * Copyright 2022 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+/* VARIANT is defined by shader_bench */
+
+precision highp float;
+
+layout(location = 0) in vec4 in_color;
+layout(location = 0) out vec4 out_color;
+
+vec4 shade(vec4 c, float k)
+{
+    for (int i = 0; i < 4 + VARIANT % 8; i++) {
+        c = fract(sin(c * k + float(i)) * 43758.5453);
+        c = mix(c, c.wzyx, 0.5) * (1.0 + float(VARIANT) / 1024.0);
+    }
+    return c;
+}
+
+void main()
+{
+    vec4 c = in_color;
+    c = shade(c, 12.9898);
+    c = shade(c.yzwx, 78.233);
+    c = shade(c.zwxy, 37.719);
+    out_color = c;
+}
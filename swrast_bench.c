@@ -0,0 +1,347 @@
+/*
+ * Copyright 2022 Google LLC
+ * SPDX-License-Identifier: MIT
+ */
+
+/* This runs tri/tex/fbo-like workloads on the software device with varying
+ * llvmpipe thread counts.  Because LP_NUM_THREADS is only read when the
+ * driver is initialized, each thread count runs in its own process.
+ */
+
+#include "eglutil.h"
+
+#include <sys/wait.h>
+
+static const char swrast_bench_vs[] = {
+#include "swrast_bench_test.vert.inc"
+};
+
+static const char swrast_bench_fs[] = {
+#include "swrast_bench_test.frag.inc"
+};
+
+static const float swrast_bench_tri_vertices[3][8] = {
+    {
+        -1.0f, /* x */
+        -1.0f, /* y */
+        0.0f,  /* u */
+        0.0f,  /* v */
+        1.0f,  /* r */
+        0.0f,  /* g */
+        0.0f,  /* b */
+        1.0f,  /* a */
+    },
+    {
+        1.0f,
+        -1.0f,
+        0.0f,
+        0.0f,
+        0.0f,
+        1.0f,
+        0.0f,
+        1.0f,
+    },
+    {
+        0.0f,
+        1.0f,
+        0.0f,
+        0.0f,
+        0.0f,
+        0.0f,
+        1.0f,
+        1.0f,
+    },
+};
+
+static const float swrast_bench_quad_vertices[4][8] = {
+    {
+        -1.0f, /* x */
+        -1.0f, /* y */
+        0.0f,  /* u */
+        0.0f,  /* v */
+        1.0f,  /* r */
+        1.0f,  /* g */
+        1.0f,  /* b */
+        1.0f,  /* a */
+    },
+    {
+        1.0f,
+        -1.0f,
+        1.0f,
+        0.0f,
+        1.0f,
+        1.0f,
+        1.0f,
+        1.0f,
+    },
+    {
+        -1.0f,
+        1.0f,
+        0.0f,
+        1.0f,
+        1.0f,
+        1.0f,
+        1.0f,
+        1.0f,
+    },
+    {
+        1.0f,
+        1.0f,
+        1.0f,
+        1.0f,
+        1.0f,
+        1.0f,
+        1.0f,
+        1.0f,
+    },
+};
+
+enum swrast_bench_workload {
+    SWRAST_BENCH_TRI,
+    SWRAST_BENCH_TEX,
+    SWRAST_BENCH_FBO,
+
+    SWRAST_BENCH_WORKLOAD_COUNT,
+};
+
+static const char *const swrast_bench_workload_names[SWRAST_BENCH_WORKLOAD_COUNT] = {
+    [SWRAST_BENCH_TRI] = "tri",
+    [SWRAST_BENCH_TEX] = "tex",
+    [SWRAST_BENCH_FBO] = "fbo",
+};
+
+struct swrast_bench_result {
+    double fps[SWRAST_BENCH_WORKLOAD_COUNT];
+};
+
+struct swrast_bench {
+    uint32_t width;
+    uint32_t height;
+    int frame_count;
+    int max_thread_count;
+
+    struct egl egl;
+
+    struct egl_program *prog;
+    GLuint white_tex;
+    GLuint checker_tex;
+    struct egl_framebuffer *fb;
+    void *readback;
+};
+
+static GLuint
+swrast_bench_create_texture(struct swrast_bench *bench, int size, bool checker)
+{
+    struct egl *egl = &bench->egl;
+    struct egl_gl *gl = &egl->gl;
+
+    uint32_t *texels = malloc(size * size * 4);
+    if (!texels)
+        egl_die("failed to alloc texels");
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++)
+            texels[size * y + x] = !checker || ((x ^ y) & 0x10) ? 0xffffffff : 0xff000000;
+    }
+
+    GLuint tex;
+    gl->GenTextures(1, &tex);
+    gl->BindTexture(GL_TEXTURE_2D, tex);
+    gl->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    gl->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    gl->TexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, texels);
+    gl->BindTexture(GL_TEXTURE_2D, 0);
+
+    free(texels);
+
+    return tex;
+}
+
+static void
+swrast_bench_init(struct swrast_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+
+    const struct egl_init_params params = {
+        .pbuffer_width = bench->width,
+        .pbuffer_height = bench->height,
+        .software = true,
+    };
+    egl_init(egl, &params);
+
+    bench->prog = egl_create_program(egl, swrast_bench_vs, swrast_bench_fs);
+    bench->white_tex = swrast_bench_create_texture(bench, 1, false);
+    bench->checker_tex = swrast_bench_create_texture(bench, 256, true);
+    bench->fb = egl_create_framebuffer(egl, bench->width, bench->height);
+
+    bench->readback = malloc(bench->width * bench->height * 4);
+    if (!bench->readback)
+        egl_die("failed to alloc readback buf");
+
+    egl_check(egl, "init");
+}
+
+static void
+swrast_bench_cleanup(struct swrast_bench *bench)
+{
+    struct egl *egl = &bench->egl;
+    struct egl_gl *gl = &egl->gl;
+
+    egl_check(egl, "cleanup");
+
+    free(bench->readback);
+    egl_destroy_framebuffer(egl, bench->fb);
+    gl->DeleteTextures(1, &bench->checker_tex);
+    gl->DeleteTextures(1, &bench->white_tex);
+    egl_destroy_program(egl, bench->prog);
+    egl_cleanup(egl);
+}
+
+static void
+swrast_bench_draw(struct swrast_bench *bench, enum swrast_bench_workload workload)
+{
+    struct egl *egl = &bench->egl;
+    struct egl_gl *gl = &egl->gl;
+
+    const bool quad = workload == SWRAST_BENCH_TEX;
+    const float *vertices =
+        quad ? &swrast_bench_quad_vertices[0][0] : &swrast_bench_tri_vertices[0][0];
+    const GLsizei stride = sizeof(swrast_bench_quad_vertices[0]);
+
+    if (workload == SWRAST_BENCH_FBO)
+        gl->BindFramebuffer(GL_FRAMEBUFFER, bench->fb->fbo);
+    gl->Viewport(0, 0, bench->width, bench->height);
+
+    gl->Clear(GL_COLOR_BUFFER_BIT);
+
+    gl->UseProgram(bench->prog->prog);
+    gl->ActiveTexture(GL_TEXTURE0);
+    gl->BindTexture(GL_TEXTURE_2D, quad ? bench->checker_tex : bench->white_tex);
+
+    gl->VertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride, vertices);
+    gl->EnableVertexAttribArray(0);
+    gl->VertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride, vertices + 2);
+    gl->EnableVertexAttribArray(1);
+    gl->VertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, stride, vertices + 4);
+    gl->EnableVertexAttribArray(2);
+
+    gl->DrawArrays(quad ? GL_TRIANGLE_STRIP : GL_TRIANGLES, 0, quad ? 4 : 3);
+
+    if (workload == SWRAST_BENCH_FBO) {
+        gl->ReadnPixels(0, 0, bench->width, bench->height, GL_RGBA, GL_UNSIGNED_BYTE,
+                        bench->width * bench->height * 4, bench->readback);
+        gl->BindFramebuffer(GL_FRAMEBUFFER, 0);
+    } else {
+        gl->Flush();
+    }
+}
+
+static void
+swrast_bench_run(struct swrast_bench *bench, struct swrast_bench_result *result)
+{
+    struct egl *egl = &bench->egl;
+    struct egl_gl *gl = &egl->gl;
+
+    for (int i = 0; i < SWRAST_BENCH_WORKLOAD_COUNT; i++) {
+        /* warm up */
+        swrast_bench_draw(bench, i);
+        gl->Finish();
+
+        const uint64_t begin = egl_get_time_ns();
+        for (int j = 0; j < bench->frame_count; j++)
+            swrast_bench_draw(bench, i);
+        gl->Finish();
+        const uint64_t end = egl_get_time_ns();
+
+        egl_check(egl, swrast_bench_workload_names[i]);
+
+        result->fps[i] = bench->frame_count * 1e9 / (end - begin);
+    }
+}
+
+static void
+swrast_bench_run_with_threads(struct swrast_bench *bench,
+                              int thread_count,
+                              struct swrast_bench_result *result)
+{
+    int fds[2];
+    if (pipe(fds))
+        egl_die("failed to create pipe");
+
+    fflush(stdout);
+    const pid_t pid = fork();
+    if (pid < 0)
+        egl_die("failed to fork");
+
+    if (!pid) {
+        close(fds[0]);
+
+        char val[16];
+        snprintf(val, sizeof(val), "%d", thread_count);
+        setenv("LP_NUM_THREADS", val, true);
+
+        swrast_bench_init(bench);
+        swrast_bench_run(bench, result);
+        swrast_bench_cleanup(bench);
+
+        if (write(fds[1], result, sizeof(*result)) != sizeof(*result))
+            egl_die("failed to write result");
+        close(fds[1]);
+
+        fflush(stdout);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    const bool ok = read(fds[0], result, sizeof(*result)) == sizeof(*result);
+    close(fds[0]);
+
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) || !ok)
+        egl_die("benchmark with %d threads failed", thread_count);
+}
+
+static void
+swrast_bench_sweep(struct swrast_bench *bench)
+{
+    struct swrast_bench_result base;
+
+    for (int thread_count = 1; thread_count <= bench->max_thread_count;) {
+        struct swrast_bench_result result;
+        swrast_bench_run_with_threads(bench, thread_count, &result);
+        if (thread_count == 1)
+            base = result;
+
+        for (int i = 0; i < SWRAST_BENCH_WORKLOAD_COUNT; i++) {
+            egl_log("threads %d: %s %.1f fps (%.2fx)", thread_count,
+                    swrast_bench_workload_names[i], result.fps[i], result.fps[i] / base.fps[i]);
+        }
+
+        if (thread_count == bench->max_thread_count)
+            break;
+        thread_count *= 2;
+        if (thread_count > bench->max_thread_count)
+            thread_count = bench->max_thread_count;
+    }
+}
+
+int
+main(int argc, const char **argv)
+{
+    struct swrast_bench bench = {
+        .width = 1280,
+        .height = 720,
+        .frame_count = 100,
+        .max_thread_count = sysconf(_SC_NPROCESSORS_ONLN),
+    };
+
+    if (argc > 1)
+        bench.max_thread_count = atoi(argv[1]);
+    if (argc > 2)
+        bench.frame_count = atoi(argv[2]);
+    if (bench.max_thread_count <= 0 || bench.frame_count <= 0)
+        egl_die("bad thread or frame count");
+
+    swrast_bench_sweep(&bench);
+
+    return 0;
+}